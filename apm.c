@@ -0,0 +1,336 @@
+/**
+ * Copyright (c) 2016 Tim Kuijsten
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "apm.h"
+#include "compat/compat.h"
+
+#include <err.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+/* latencies per command name */
+struct cmdstats {
+  char name[MAXAPMCMDNAME];
+  latency_t lat;
+  uint64_t failed;
+};
+
+/* namespace of a started command, looked up by request id on completion */
+struct inflight {
+  int64_t request_id;
+  char ns[MAXAPMNS];
+};
+
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace = NULL;
+static struct cmdstats *stats = NULL;
+static size_t nstats = 0;
+static struct inflight inflight[MAXINFLIGHT];
+
+static void started(const mongoc_apm_command_started_t *event);
+static void succeeded(const mongoc_apm_command_succeeded_t *event);
+static void failed(const mongoc_apm_command_failed_t *event);
+static struct cmdstats *getstats(const char *name);
+static void lookup_ns(int64_t request_id, char *ns, size_t nssize);
+static void write_event(bson_t *event);
+static mongoc_apm_callbacks_t *new_callbacks(void);
+
+/*
+ * Start collecting command statistics. If tracefile is not NULL, every command
+ * started, succeeded and failed event is appended to it as one line of JSON.
+ *
+ * Return 0 on success or -1 on failure.
+ */
+int
+apm_init(const char *tracefile)
+{
+  memset(inflight, 0, sizeof(inflight));
+
+  if (tracefile == NULL)
+    return 0;
+
+  if ((trace = fopen(tracefile, "ae")) == NULL)
+    return -1;
+
+  /* keep the file usable with tail -f */
+  setvbuf(trace, NULL, _IOLBF, 0);
+
+  return 0;
+}
+
+void
+apm_end(void)
+{
+  pthread_mutex_lock(&mtx);
+  if (trace != NULL) {
+    fclose(trace);
+    trace = NULL;
+  }
+  free(stats);
+  stats = NULL;
+  nstats = 0;
+  pthread_mutex_unlock(&mtx);
+}
+
+/*
+ * Register the command monitoring callbacks on a single client.
+ *
+ * Return 0 on success or -1 on failure.
+ */
+int
+apm_set_client(mongoc_client_t *client)
+{
+  mongoc_apm_callbacks_t *cbs;
+  int ret;
+
+  cbs = new_callbacks();
+  ret = mongoc_client_set_apm_callbacks(client, cbs, NULL) ? 0 : -1;
+  mongoc_apm_callbacks_destroy(cbs);
+
+  return ret;
+}
+
+/*
+ * Register the command monitoring callbacks on a client pool. Must be called
+ * before the first client is popped.
+ *
+ * Return 0 on success or -1 on failure.
+ */
+int
+apm_set_pool(mongoc_client_pool_t *pool)
+{
+  mongoc_apm_callbacks_t *cbs;
+  int ret;
+
+  cbs = new_callbacks();
+  ret = mongoc_client_pool_set_apm_callbacks(pool, cbs, NULL) ? 0 : -1;
+  mongoc_apm_callbacks_destroy(cbs);
+
+  return ret;
+}
+
+/*
+ * Print the number of commands, failures and latency percentiles in
+ * milliseconds per command name.
+ */
+void
+apm_print_stats(FILE *fp)
+{
+  struct cmdstats *cs;
+  size_t i;
+
+  pthread_mutex_lock(&mtx);
+
+  fprintf(fp, "%-20s %8s %8s %10s %10s %10s %10s\n", "command", "count",
+      "failed", "p50 ms", "p90 ms", "p99 ms", "max ms");
+
+  for (i = 0; i < nstats; i++) {
+    cs = &stats[i];
+    fprintf(fp, "%-20s %8llu %8llu %10.3f %10.3f %10.3f %10.3f\n", cs->name,
+        (unsigned long long)cs->lat.n, (unsigned long long)cs->failed,
+        latency_pct(&cs->lat, 50) / 1e3, latency_pct(&cs->lat, 90) / 1e3,
+        latency_pct(&cs->lat, 99) / 1e3, cs->lat.max / 1e3);
+  }
+
+  pthread_mutex_unlock(&mtx);
+}
+
+static mongoc_apm_callbacks_t *
+new_callbacks(void)
+{
+  mongoc_apm_callbacks_t *cbs;
+
+  cbs = mongoc_apm_callbacks_new();
+  mongoc_apm_set_command_started_cb(cbs, started);
+  mongoc_apm_set_command_succeeded_cb(cbs, succeeded);
+  mongoc_apm_set_command_failed_cb(cbs, failed);
+
+  return cbs;
+}
+
+static void
+started(const mongoc_apm_command_started_t *event)
+{
+  const char *dbname, *name;
+  struct inflight *inf;
+  bson_iter_t it;
+  bson_t *ev;
+  int64_t request_id;
+
+  dbname = mongoc_apm_command_started_get_database_name(event);
+  name = mongoc_apm_command_started_get_command_name(event);
+  request_id = mongoc_apm_command_started_get_request_id(event);
+
+  pthread_mutex_lock(&mtx);
+
+  /* the collection, if any, is the value of the first field of the command */
+  inf = &inflight[request_id % MAXINFLIGHT];
+  inf->request_id = request_id;
+  strlcpy(inf->ns, dbname, sizeof(inf->ns));
+  if (bson_iter_init(&it, mongoc_apm_command_started_get_command(event)) &&
+      bson_iter_next(&it) && BSON_ITER_HOLDS_UTF8(&it)) {
+    strlcat(inf->ns, ".", sizeof(inf->ns));
+    strlcat(inf->ns, bson_iter_utf8(&it, NULL), sizeof(inf->ns));
+  }
+
+  if (trace != NULL) {
+    ev = BCON_NEW("event", BCON_UTF8("started"),
+        "command", BCON_UTF8(name),
+        "ns", BCON_UTF8(inf->ns),
+        "requestId", BCON_INT64(request_id),
+        "host", BCON_UTF8(mongoc_apm_command_started_get_host(event)->host_and_port));
+    write_event(ev);
+    bson_destroy(ev);
+  }
+
+  pthread_mutex_unlock(&mtx);
+}
+
+static void
+succeeded(const mongoc_apm_command_succeeded_t *event)
+{
+  const char *name;
+  char ns[MAXAPMNS];
+  struct cmdstats *cs;
+  bson_t *ev;
+  int64_t request_id, duration;
+
+  name = mongoc_apm_command_succeeded_get_command_name(event);
+  request_id = mongoc_apm_command_succeeded_get_request_id(event);
+  duration = mongoc_apm_command_succeeded_get_duration(event);
+
+  pthread_mutex_lock(&mtx);
+
+  if ((cs = getstats(name)) != NULL)
+    latency_add(&cs->lat, duration);
+
+  if (trace != NULL) {
+    lookup_ns(request_id, ns, sizeof(ns));
+    ev = BCON_NEW("event", BCON_UTF8("succeeded"),
+        "command", BCON_UTF8(name),
+        "ns", BCON_UTF8(ns),
+        "requestId", BCON_INT64(request_id),
+        "durationUs", BCON_INT64(duration),
+        "replySize", BCON_INT64(mongoc_apm_command_succeeded_get_reply(event)->len));
+    write_event(ev);
+    bson_destroy(ev);
+  }
+
+  pthread_mutex_unlock(&mtx);
+}
+
+static void
+failed(const mongoc_apm_command_failed_t *event)
+{
+  const char *name;
+  char ns[MAXAPMNS];
+  struct cmdstats *cs;
+  bson_error_t error;
+  bson_t *ev;
+  int64_t request_id, duration;
+
+  name = mongoc_apm_command_failed_get_command_name(event);
+  request_id = mongoc_apm_command_failed_get_request_id(event);
+  duration = mongoc_apm_command_failed_get_duration(event);
+  mongoc_apm_command_failed_get_error(event, &error);
+
+  pthread_mutex_lock(&mtx);
+
+  if ((cs = getstats(name)) != NULL) {
+    latency_add(&cs->lat, duration);
+    cs->failed++;
+  }
+
+  if (trace != NULL) {
+    lookup_ns(request_id, ns, sizeof(ns));
+    ev = BCON_NEW("event", BCON_UTF8("failed"),
+        "command", BCON_UTF8(name),
+        "ns", BCON_UTF8(ns),
+        "requestId", BCON_INT64(request_id),
+        "durationUs", BCON_INT64(duration),
+        "replySize", BCON_INT64(mongoc_apm_command_failed_get_reply(event)->len),
+        "error", BCON_UTF8(error.message));
+    write_event(ev);
+    bson_destroy(ev);
+  }
+
+  pthread_mutex_unlock(&mtx);
+}
+
+/*
+ * Return the statistics of the given command name, add it if it's new. Return
+ * NULL if MAXAPMCMDS is reached. Must be called with mtx locked.
+ */
+static struct cmdstats *
+getstats(const char *name)
+{
+  struct cmdstats *cs;
+  size_t i;
+
+  for (i = 0; i < nstats; i++)
+    if (strcmp(stats[i].name, name) == 0)
+      return &stats[i];
+
+  if (nstats == MAXAPMCMDS)
+    return NULL;
+
+  if ((cs = reallocarray(stats, nstats + 1, sizeof(*stats))) == NULL)
+    err(1, "getstats");
+  stats = cs;
+
+  cs = &stats[nstats++];
+  strlcpy(cs->name, name, sizeof(cs->name));
+  latency_init(&cs->lat);
+  cs->failed = 0;
+
+  return cs;
+}
+
+/*
+ * Copy the namespace of a started command into ns, or an empty string if it's
+ * unknown. Must be called with mtx locked.
+ */
+static void
+lookup_ns(int64_t request_id, char *ns, size_t nssize)
+{
+  struct inflight *inf;
+
+  inf = &inflight[request_id % MAXINFLIGHT];
+  if (inf->request_id == request_id)
+    strlcpy(ns, inf->ns, nssize);
+  else
+    ns[0] = '\0';
+}
+
+/*
+ * Append event with a timestamp in microseconds since the epoch to the trace
+ * file. Must be called with mtx locked.
+ */
+static void
+write_event(bson_t *event)
+{
+  struct timeval tv;
+  char *str;
+
+  gettimeofday(&tv, NULL);
+  BSON_APPEND_INT64(event, "ts", (int64_t)tv.tv_sec * 1000000 + tv.tv_usec);
+
+  str = bson_as_json(event, NULL);
+  fprintf(trace, "%s\n", str);
+  bson_free(str);
+}
@@ -0,0 +1,37 @@
+#ifndef APM_H
+#define APM_H
+
+/**
+ * Copyright (c) 2016 Tim Kuijsten
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "latency.h"
+
+#include <mongoc.h>
+
+#include <stdio.h>
+
+#define MAXAPMCMDS 100   /* maximum number of distinct command names tracked */
+#define MAXINFLIGHT 256  /* maximum number of concurrent commands traced */
+#define MAXAPMCMDNAME 64
+#define MAXAPMNS 402     /* database name, "." and collection name */
+
+int apm_init(const char *tracefile);
+void apm_end(void);
+int apm_set_client(mongoc_client_t *client);
+int apm_set_pool(mongoc_client_pool_t *pool);
+void apm_print_stats(FILE *fp);
+
+#endif
@@ -0,0 +1,406 @@
+/**
+ * Copyright (c) 2016 Tim Kuijsten
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "mongovi.h"
+
+#define BENCHRANGE 100                  /* documents per range scan */
+#define BENCHSTACK (16 * 1024 * 1024)   /* exec_* keep large buffers on the stack */
+
+enum workload { WINSERT, WFINDID, WRANGE, WUPDATE, NWORKLOADS };
+
+static const char *workloads[] = { "insert", "findid", "range", "update", NULL };
+
+struct benchcfg {
+  int64_t ops;        /* operations per workload if duration is 0 */
+  int64_t duration;   /* duration per workload in microseconds */
+  int concurrency;
+  int docsize;
+  int fields;
+  int enabled[NWORKLOADS];
+};
+
+/* shared state of all workers running one workload */
+struct bench {
+  const struct benchcfg *cfg;
+  const path_t *ns;
+  enum workload workload;
+  pthread_mutex_t mtx;
+  int64_t next;       /* next operation number */
+  int64_t ndocs;      /* documents with an _id in [0, ndocs) exist */
+  int64_t deadline;
+  int64_t errors;
+  latency_t lat;
+};
+
+static int parse_bench_opts(const char *line, struct benchcfg *cfg);
+static int run_workload(struct bench *b);
+static void *bench_worker(void *arg);
+static size_t bench_doc(char *dst, size_t dstsize, int64_t id, const struct benchcfg *cfg);
+static uint64_t xorshift(uint64_t *state);
+
+/*
+ * Run insert, find by id, range scan and update workloads against the
+ * collection in ns, either for a fixed number of operations or a fixed
+ * duration, with a configurable number of concurrent clients. Every operation
+ * is built as a command line and executed by the same exec_* function the
+ * shell uses. Prints the number of operations, errors, operations per second
+ * and latency percentiles per workload.
+ *
+ * The insert workload creates documents with integer ids starting at 0 and
+ * refuses to run on a collection that is not empty. The other workloads
+ * expect documents created by an earlier insert workload.
+ *
+ * return 0 on success, -1 on failure
+ */
+int
+exec_bench(const path_t *ns, const char *line)
+{
+  struct benchcfg cfg;
+  struct bench b;
+  mongoc_client_t *client;
+  mongoc_collection_t *coll;
+  bson_error_t error;
+  int64_t count;
+  int i;
+
+  if (parse_bench_opts(line, &cfg) < 0) {
+    warnx("usage: bench [-n ops] [-d seconds] [-c concurrency] [-s docsize] [-f fields] [-w workload[,workload]]");
+    return -1;
+  }
+
+  client = mongoc_client_pool_pop(get_pool());
+  coll = mongoc_client_get_collection(client, ns->dbname, ns->collname);
+  count = mongoc_collection_count(coll, MONGOC_QUERY_NONE, NULL, 0, 0, NULL, &error);
+  mongoc_collection_destroy(coll);
+  mongoc_client_pool_push(get_pool(), client);
+
+  if (count == -1) {
+    warnx("cursor failed: %d.%d %s", error.domain, error.code, error.message);
+    return -1;
+  }
+
+  if (cfg.enabled[WINSERT] && count > 0) {
+    warnx("insert workload needs an empty collection");
+    return -1;
+  }
+
+  printf("%-8s %10s %8s %12s %10s %10s %10s %10s\n", "workload", "ops",
+      "errors", "ops/s", "p50 ms", "p90 ms", "p99 ms", "max ms");
+
+  b.cfg = &cfg;
+  b.ns = ns;
+  b.ndocs = count;
+  if (pthread_mutex_init(&b.mtx, NULL) != 0)
+    errx(1, "exec_bench: can't initialize mutex");
+
+  for (i = 0; i < NWORKLOADS && !interrupted; i++) {
+    if (!cfg.enabled[i])
+      continue;
+
+    if (i != WINSERT && b.ndocs == 0) {
+      warnx("%s: no documents", workloads[i]);
+      continue;
+    }
+
+    b.workload = i;
+    if (run_workload(&b) < 0) {
+      pthread_mutex_destroy(&b.mtx);
+      return -1;
+    }
+
+    if (i == WINSERT)
+      b.ndocs = b.lat.n;
+  }
+
+  pthread_mutex_destroy(&b.mtx);
+
+  return 0;
+}
+
+/*
+ * Parse the options of the bench command into cfg.
+ *
+ * Return 0 on success or -1 on failure.
+ */
+static int
+parse_bench_opts(const char *line, struct benchcfg *cfg)
+{
+  Tokenizer *t;
+  const char **av;
+  char *list, *cp, *w;
+  long val;
+  int ac, i, j, any;
+
+  cfg->ops = 10000;
+  cfg->duration = 0;
+  cfg->concurrency = 1;
+  cfg->docsize = 100;
+  cfg->fields = 1;
+  for (i = 0; i < NWORKLOADS; i++)
+    cfg->enabled[i] = 1;
+
+  t = tok_init(NULL);
+  if (tok_str(t, line, &ac, &av) != 0) {
+    tok_end(t);
+    return -1;
+  }
+
+  for (i = 0; i < ac; i++) {
+    if (av[i][0] != '-' || strlen(av[i]) != 2 || i + 1 == ac)
+      goto err;
+
+    if (av[i][1] == 'w') {
+      for (j = 0; j < NWORKLOADS; j++)
+        cfg->enabled[j] = 0;
+      if ((list = strdup(av[++i])) == NULL)
+        err(1, "parse_bench_opts");
+      cp = list;
+      any = 0;
+      while ((w = strsep(&cp, ",")) != NULL) {
+        for (j = 0; workloads[j] != NULL; j++)
+          if (strcmp(w, workloads[j]) == 0)
+            break;
+        if (workloads[j] == NULL) {
+          free(list);
+          goto err;
+        }
+        cfg->enabled[j] = any = 1;
+      }
+      free(list);
+      if (!any)
+        goto err;
+      continue;
+    }
+
+    val = strtol(av[++i], &cp, 10);
+    if (*cp != '\0' || val < 1 || val > INT_MAX)
+      goto err;
+
+    switch (av[i - 1][1]) {
+    case 'n':
+      cfg->ops = val;
+      break;
+    case 'd':
+      cfg->duration = val * 1000000;
+      break;
+    case 'c':
+      if (val > MAXWORKERS)
+        goto err;
+      cfg->concurrency = val;
+      break;
+    case 's':
+      cfg->docsize = val;
+      break;
+    case 'f':
+      cfg->fields = val;
+      break;
+    default:
+      goto err;
+    }
+  }
+
+  /* a document must fit in a command line */
+  if ((size_t)cfg->docsize + 100 + cfg->fields * 20 > MAXLINE)
+    goto err;
+
+  tok_end(t);
+  return 0;
+
+err:
+  tok_end(t);
+  return -1;
+}
+
+/*
+ * Run the workload in b on the configured number of workers and print the
+ * results.
+ *
+ * Return 0 on success or -1 on failure.
+ */
+static int
+run_workload(struct bench *b)
+{
+  pthread_attr_t attr;
+  pthread_t threads[MAXWORKERS];
+  int64_t start, elapsed;
+  int i;
+
+  b->next = 0;
+  b->errors = 0;
+  latency_init(&b->lat);
+
+  if (pthread_attr_init(&attr) != 0)
+    return -1;
+  if (pthread_attr_setstacksize(&attr, BENCHSTACK) != 0)
+    return -1;
+
+  start = bson_get_monotonic_time();
+  b->deadline = start + b->cfg->duration;
+
+  for (i = 0; i < b->cfg->concurrency; i++)
+    if (pthread_create(&threads[i], &attr, bench_worker, b) != 0)
+      errx(1, "run_workload: can't create thread");
+
+  for (i = 0; i < b->cfg->concurrency; i++)
+    pthread_join(threads[i], NULL);
+
+  elapsed = bson_get_monotonic_time() - start;
+  pthread_attr_destroy(&attr);
+
+  printf("%-8s %10llu %8lld %12.1f %10.3f %10.3f %10.3f %10.3f\n",
+      workloads[b->workload], (unsigned long long)b->lat.n,
+      (long long)b->errors, elapsed > 0 ? b->lat.n * 1e6 / elapsed : 0.0,
+      latency_pct(&b->lat, 50) / 1e3, latency_pct(&b->lat, 90) / 1e3,
+      latency_pct(&b->lat, 99) / 1e3, b->lat.max / 1e3);
+  fflush(stdout);
+
+  return 0;
+}
+
+static void *
+bench_worker(void *arg)
+{
+  struct bench *b = arg;
+  mongoc_client_t *client;
+  mongoc_collection_t *coll;
+  latency_t lat;
+  char *line;
+  size_t linesize, len;
+  int64_t op, id, start, errors;
+  uint64_t seed;
+  int ret;
+
+  thread_init(1);
+
+  client = mongoc_client_pool_pop(get_pool());
+  coll = mongoc_client_get_collection(client, b->ns->dbname, b->ns->collname);
+
+  linesize = b->cfg->docsize + 100 + b->cfg->fields * 20;
+  if ((line = malloc(linesize)) == NULL)
+    err(1, "bench_worker");
+
+  latency_init(&lat);
+  errors = 0;
+  seed = bson_get_monotonic_time() ^ (uintptr_t)&lat;
+
+  for (;;) {
+    if (interrupted)
+      break;
+
+    pthread_mutex_lock(&b->mtx);
+    op = b->next++;
+    pthread_mutex_unlock(&b->mtx);
+
+    if (b->cfg->duration) {
+      if (bson_get_monotonic_time() >= b->deadline)
+        break;
+    } else if (op >= b->cfg->ops) {
+      break;
+    }
+
+    id = b->workload == WINSERT ? op : (int64_t)(xorshift(&seed) % b->ndocs);
+
+    switch (b->workload) {
+    case WINSERT:
+      len = bench_doc(line, linesize, id, b->cfg);
+      break;
+    case WFINDID:
+      len = snprintf(line, linesize, "{ _id: %lld }", (long long)id);
+      break;
+    case WRANGE:
+      len = snprintf(line, linesize, "{ _id: { $gte: %lld, $lt: %lld } }",
+          (long long)id, (long long)id + BENCHRANGE);
+      break;
+    case WUPDATE:
+      len = snprintf(line, linesize, "{ _id: %lld } { $inc: { n: 1 } }", (long long)id);
+      break;
+    default:
+      errx(1, "unknown workload");
+    }
+
+    start = bson_get_monotonic_time();
+    switch (b->workload) {
+    case WINSERT:
+      ret = exec_insert(coll, line, len);
+      break;
+    case WFINDID:
+    case WRANGE:
+      ret = exec_query(b->ns, coll, line, len, 0);
+      break;
+    case WUPDATE:
+      ret = exec_update(coll, line, 0);
+      break;
+    default:
+      ret = -1;
+    }
+    latency_add(&lat, bson_get_monotonic_time() - start);
+
+    if (ret != 0)
+      errors++;
+  }
+
+  pthread_mutex_lock(&b->mtx);
+  latency_merge(&b->lat, &lat);
+  b->errors += errors;
+  pthread_mutex_unlock(&b->mtx);
+
+  free(line);
+  mongoc_collection_destroy(coll);
+  mongoc_client_pool_push(get_pool(), client);
+  thread_end();
+
+  return NULL;
+}
+
+/*
+ * Write a relaxed json document with the given id and cfg->fields string
+ * fields that together are about cfg->docsize bytes.
+ *
+ * Return the length of the document.
+ */
+static size_t
+bench_doc(char *dst, size_t dstsize, int64_t id, const struct benchcfg *cfg)
+{
+  size_t len, pad;
+  int i;
+
+  len = snprintf(dst, dstsize, "{ _id: %lld, n: 0", (long long)id);
+
+  pad = cfg->docsize > 30 + cfg->fields * 8 ? (cfg->docsize - 30) / cfg->fields - 8 : 1;
+
+  for (i = 0; i < cfg->fields && len + pad + 20 < dstsize; i++) {
+    len += snprintf(dst + len, dstsize - len, ", f%d: \"", i);
+    memset(dst + len, 'a' + (id + i) % 26, pad);
+    len += pad;
+    dst[len++] = '"';
+  }
+
+  len += snprintf(dst + len, dstsize - len, " }");
+
+  return len;
+}
+
+static uint64_t
+xorshift(uint64_t *state)
+{
+  uint64_t x = *state;
+
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+
+  return *state = x;
+}
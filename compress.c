@@ -0,0 +1,584 @@
+/**
+ * Copyright (c) 2016 Tim Kuijsten
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "mongovi.h"
+
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define COMPRESSBLOCK (1024 * 1024) /* input bytes per compressed block */
+#define COMPRESSLEVEL 6             /* gzip compression level */
+#define ZSTDLEVEL 3                 /* zstd compression level */
+#define INFLATEBUF (256 * 1024)
+
+/* a block of output that is compressed by its own thread */
+struct block {
+  int method;
+  unsigned char *src;
+  size_t srclen;
+  unsigned char *dst;
+  size_t dstsize;
+  size_t dstlen;
+  int ok;
+};
+
+/* state of the decompressing thread */
+struct inflater {
+  int method;
+  int in;                     /* compressed input */
+  int out;                    /* write end of the pipe to the importer */
+  const unsigned char *prefix;  /* input that is already read */
+  size_t prefixlen;
+  int failed;
+};
+
+/* state of the compressing thread */
+struct deflater {
+  int method;
+  int in;                     /* read end of the pipe that replaces stdout */
+  int out;                    /* the original stdout */
+  int nworkers;
+  int failed;
+};
+
+static pthread_t inflatethr, deflatethr;
+static struct inflater inf;
+static struct deflater def;
+static int deflating = 0;     /* compress_start succeeded and compress_end did not run */
+
+static void *inflate_worker(void *arg);
+static int inflate_gzip(struct inflater *in);
+#ifdef HAVE_ZSTD
+static int inflate_zstd(struct inflater *in);
+#endif
+static ssize_t read_input(struct inflater *in, unsigned char *buf, size_t bufsize);
+static void *deflate_worker(void *arg);
+static void compress_atexit(void);
+static void *compress_block(void *arg);
+static ssize_t read_full(int fd, unsigned char *buf, size_t n);
+static int write_full(int fd, const unsigned char *buf, size_t n);
+
+/*
+ * Determine the compression method from the first n bytes of a stream.
+ *
+ * return COMPGZIP, COMPZSTD or COMPNONE
+ */
+int
+detect_compression(const unsigned char *magic, size_t n)
+{
+  if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+    return COMPGZIP;
+  if (n >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+    return COMPZSTD;
+  return COMPNONE;
+}
+
+/*
+ * Parse the name of a compression method.
+ *
+ * return COMPGZIP or COMPZSTD on success, -1 on failure
+ */
+int
+parse_compression(const char *name)
+{
+  if (name == NULL || strcmp(name, "gzip") == 0)
+    return COMPGZIP;
+  if (strcmp(name, "zstd") == 0)
+    return COMPZSTD;
+  return -1;
+}
+
+/*
+ * Decompress fd on a separate thread. The first prefixlen bytes of the stream
+ * are already read from fd and passed in prefix, which must stay valid until
+ * decompress_end.
+ *
+ * return the read end of a pipe with the decompressed data on success, -1 on
+ * failure
+ */
+int
+decompress_start(int fd, int method, const unsigned char *prefix, size_t prefixlen)
+{
+  int pfd[2];
+
+#ifndef HAVE_ZSTD
+  if (method == COMPZSTD) {
+    warnx("input is zstd compressed, but zstd support is not compiled in");
+    return -1;
+  }
+#endif
+
+  if (pipe(pfd) == -1) {
+    warn("pipe");
+    return -1;
+  }
+
+  /* writes fail with EPIPE if the importer stops early */
+  signal(SIGPIPE, SIG_IGN);
+
+  inf.method = method;
+  inf.in = fd;
+  inf.out = pfd[1];
+  inf.prefix = prefix;
+  inf.prefixlen = prefixlen;
+  inf.failed = 0;
+
+  if (pthread_create(&inflatethr, NULL, inflate_worker, &inf) != 0) {
+    warnx("can't start decompression thread");
+    close(pfd[0]);
+    close(pfd[1]);
+    return -1;
+  }
+
+  return pfd[0];
+}
+
+/*
+ * Wait for the decompression thread to finish. The read end of the pipe must
+ * be closed first so that the thread stops if the importer stopped early.
+ *
+ * return 0 if all input was decompressed, -1 otherwise
+ */
+int
+decompress_end(void)
+{
+  pthread_join(inflatethr, NULL);
+
+  return inf.failed ? -1 : 0;
+}
+
+static void *
+inflate_worker(void *arg)
+{
+  struct inflater *in = arg;
+
+#ifdef HAVE_ZSTD
+  if (in->method == COMPZSTD)
+    in->failed = inflate_zstd(in) == -1;
+  else
+#endif
+    in->failed = inflate_gzip(in) == -1;
+
+  close(in->out);
+
+  return NULL;
+}
+
+/*
+ * Inflate gzip input, which may consist of several members as written by
+ * compress_start and pigz.
+ *
+ * return 0 on success, -1 on failure
+ */
+static int
+inflate_gzip(struct inflater *in)
+{
+  z_stream z;
+  unsigned char *src, *dst;
+  ssize_t n;
+  int r, ret;
+
+  if ((src = malloc(INFLATEBUF)) == NULL || (dst = malloc(INFLATEBUF)) == NULL)
+    err(1, "inflate_gzip");
+
+  memset(&z, 0, sizeof(z));
+  if (inflateInit2(&z, 15 + 16) != Z_OK)
+    errx(1, "inflateInit2");
+
+  ret = 0;
+  r = Z_OK;
+  for (;;) {
+    if (z.avail_in == 0) {
+      if ((n = read_input(in, src, INFLATEBUF)) <= 0) {
+        if (n == -1 || r != Z_STREAM_END) {
+          warnx("unexpected end of compressed input");
+          ret = -1;
+        }
+        break;
+      }
+      z.next_in = src;
+      z.avail_in = n;
+    }
+
+    /* start the next member */
+    if (r == Z_STREAM_END && inflateReset(&z) != Z_OK) {
+      ret = -1;
+      break;
+    }
+
+    z.next_out = dst;
+    z.avail_out = INFLATEBUF;
+    if ((r = inflate(&z, Z_NO_FLUSH)) != Z_OK && r != Z_STREAM_END) {
+      warnx("gzip: %s", z.msg ? z.msg : "inflate error");
+      ret = -1;
+      break;
+    }
+
+    if (write_full(in->out, dst, INFLATEBUF - z.avail_out) == -1) {
+      ret = -1;
+      break;
+    }
+  }
+
+  inflateEnd(&z);
+  free(src);
+  free(dst);
+
+  return ret;
+}
+
+#ifdef HAVE_ZSTD
+/*
+ * Decompress zstd input, consecutive frames are handled by the stream.
+ *
+ * return 0 on success, -1 on failure
+ */
+static int
+inflate_zstd(struct inflater *in)
+{
+  ZSTD_DStream *zs;
+  ZSTD_inBuffer zin;
+  ZSTD_outBuffer zout;
+  unsigned char *src, *dst;
+  size_t r, srcsize, dstsize;
+  ssize_t n;
+  int ret;
+
+  srcsize = ZSTD_DStreamInSize();
+  dstsize = ZSTD_DStreamOutSize();
+  if ((src = malloc(srcsize)) == NULL || (dst = malloc(dstsize)) == NULL)
+    err(1, "inflate_zstd");
+
+  if ((zs = ZSTD_createDStream()) == NULL)
+    errx(1, "ZSTD_createDStream");
+  ZSTD_initDStream(zs);
+
+  ret = 0;
+  r = 0;
+  while ((n = read_input(in, src, srcsize)) > 0) {
+    zin.src = src;
+    zin.size = n;
+    zin.pos = 0;
+    while (zin.pos < zin.size) {
+      zout.dst = dst;
+      zout.size = dstsize;
+      zout.pos = 0;
+      r = ZSTD_decompressStream(zs, &zout, &zin);
+      if (ZSTD_isError(r)) {
+        warnx("zstd: %s", ZSTD_getErrorName(r));
+        ret = -1;
+        goto done;
+      }
+      if (write_full(in->out, dst, zout.pos) == -1) {
+        ret = -1;
+        goto done;
+      }
+    }
+  }
+
+  /* r is 0 at the end of a frame */
+  if (n == -1 || r != 0) {
+    warnx("unexpected end of compressed input");
+    ret = -1;
+  }
+
+done:
+  ZSTD_freeDStream(zs);
+  free(src);
+  free(dst);
+
+  return ret;
+}
+#endif
+
+/*
+ * Read compressed input, starting with the prefix.
+ *
+ * return the number of bytes read, 0 on end of input or -1 on failure
+ */
+static ssize_t
+read_input(struct inflater *in, unsigned char *buf, size_t bufsize)
+{
+  ssize_t n;
+
+  if (in->prefixlen > 0) {
+    n = in->prefixlen < bufsize ? in->prefixlen : bufsize;
+    memcpy(buf, in->prefix, n);
+    in->prefix += n;
+    in->prefixlen -= n;
+  } else {
+    while ((n = read(in->in, buf, bufsize)) == -1 && errno == EINTR)
+      ;
+    if (n == -1) {
+      warn("read");
+      return -1;
+    }
+  }
+
+  progress_add(&progress.compressed, n);
+
+  return n;
+}
+
+/*
+ * Compress everything that is written to stdout from now on with method.
+ * Output is cut in blocks that are compressed concurrently, each block becomes
+ * a gzip member or zstd frame of its own. If the process exits without calling
+ * compress_end, for example with errx, the output is still finished.
+ *
+ * return 0 on success, -1 on failure
+ */
+int
+compress_start(int method)
+{
+  int pfd[2];
+  long ncpu;
+
+#ifndef HAVE_ZSTD
+  if (method == COMPZSTD) {
+    warnx("zstd support is not compiled in");
+    return -1;
+  }
+#endif
+
+  fflush(stdout);
+
+  if (pipe(pfd) == -1) {
+    warn("pipe");
+    return -1;
+  }
+
+  /* writes to stdout fail with EPIPE if the compressor stops early */
+  signal(SIGPIPE, SIG_IGN);
+
+  def.method = method;
+  def.in = pfd[0];
+  if ((def.out = dup(STDOUT_FILENO)) == -1 || dup2(pfd[1], STDOUT_FILENO) == -1) {
+    warn("dup");
+    return -1;
+  }
+  close(pfd[1]);
+
+  ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  def.nworkers = ncpu < 1 ? 1 : ncpu > MAXWORKERS ? MAXWORKERS : ncpu;
+  def.failed = 0;
+
+  if (pthread_create(&deflatethr, NULL, deflate_worker, &def) != 0) {
+    warnx("can't start compression thread");
+    return -1;
+  }
+  deflating = 1;
+
+  if (atexit(compress_atexit) != 0)
+    warnx("can't register compress_end");
+
+  return 0;
+}
+
+/*
+ * Flush and close stdout and wait until all output is compressed and written.
+ *
+ * return 0 on success, -1 on failure
+ */
+int
+compress_end(void)
+{
+  if (!deflating)
+    return 0;
+  deflating = 0;
+
+  fflush(stdout);
+  close(STDOUT_FILENO);
+  pthread_join(deflatethr, NULL);
+  close(def.out);
+
+  return def.failed ? -1 : 0;
+}
+
+/* finish the output on exit, unless the compressor itself exits */
+static void
+compress_atexit(void)
+{
+  if (deflating && !pthread_equal(pthread_self(), deflatethr) && compress_end() == -1)
+    warnx("compressed output is incomplete");
+}
+
+/*
+ * Read stdout in batches of one block per worker, compress the blocks of a
+ * batch concurrently and write them in order.
+ */
+static void *
+deflate_worker(void *arg)
+{
+  struct deflater *d = arg;
+  struct block blocks[MAXWORKERS];
+  pthread_t threads[MAXWORKERS];
+  ssize_t n;
+  int i, nblocks, eof;
+
+  for (i = 0; i < d->nworkers; i++) {
+    blocks[i].method = d->method;
+    if ((blocks[i].src = malloc(COMPRESSBLOCK)) == NULL)
+      err(1, "deflate_worker");
+#ifdef HAVE_ZSTD
+    if (d->method == COMPZSTD)
+      blocks[i].dstsize = ZSTD_compressBound(COMPRESSBLOCK);
+    else
+#endif
+      blocks[i].dstsize = compressBound(COMPRESSBLOCK) + 32;  /* gzip header and trailer */
+    if ((blocks[i].dst = malloc(blocks[i].dstsize)) == NULL)
+      err(1, "deflate_worker");
+  }
+
+  eof = 0;
+  while (!eof) {
+    for (nblocks = 0; nblocks < d->nworkers && !eof; nblocks++) {
+      if ((n = read_full(d->in, blocks[nblocks].src, COMPRESSBLOCK)) == -1) {
+        d->failed = 1;
+        break;
+      }
+      if (n < COMPRESSBLOCK)
+        eof = 1;
+      if (n == 0)
+        break;
+      blocks[nblocks].srclen = n;
+    }
+    if (d->failed)
+      break;
+
+    /* the last block compresses on this thread */
+    for (i = 0; i < nblocks - 1; i++)
+      if (pthread_create(&threads[i], NULL, compress_block, &blocks[i]) != 0)
+        compress_block(&blocks[i]);
+    if (nblocks > 0)
+      compress_block(&blocks[nblocks - 1]);
+    for (i = 0; i < nblocks - 1; i++)
+      pthread_join(threads[i], NULL);
+
+    for (i = 0; i < nblocks; i++) {
+      if (!blocks[i].ok || write_full(d->out, blocks[i].dst, blocks[i].dstlen) == -1) {
+        d->failed = 1;
+        break;
+      }
+    }
+    if (d->failed)
+      break;
+  }
+
+  /* let writers to stdout fail instead of block */
+  close(d->in);
+
+  for (i = 0; i < d->nworkers; i++) {
+    free(blocks[i].src);
+    free(blocks[i].dst);
+  }
+
+  return NULL;
+}
+
+/* compress one block into a complete gzip member or zstd frame */
+static void *
+compress_block(void *arg)
+{
+  struct block *b = arg;
+  z_stream z;
+
+  b->ok = 0;
+
+#ifdef HAVE_ZSTD
+  if (b->method == COMPZSTD) {
+    b->dstlen = ZSTD_compress(b->dst, b->dstsize, b->src, b->srclen, ZSTDLEVEL);
+    if (ZSTD_isError(b->dstlen))
+      warnx("zstd: %s", ZSTD_getErrorName(b->dstlen));
+    else
+      b->ok = 1;
+    return NULL;
+  }
+#endif
+
+  memset(&z, 0, sizeof(z));
+  if (deflateInit2(&z, COMPRESSLEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    warnx("deflateInit2");
+    return NULL;
+  }
+
+  z.next_in = b->src;
+  z.avail_in = b->srclen;
+  z.next_out = b->dst;
+  z.avail_out = b->dstsize;
+  if (deflate(&z, Z_FINISH) != Z_STREAM_END)
+    warnx("gzip: %s", z.msg ? z.msg : "deflate error");
+  else
+    b->ok = 1;
+  b->dstlen = b->dstsize - z.avail_out;
+  deflateEnd(&z);
+
+  return NULL;
+}
+
+/*
+ * Read until n bytes are read or end of file.
+ *
+ * return the number of bytes read or -1 on failure
+ */
+static ssize_t
+read_full(int fd, unsigned char *buf, size_t n)
+{
+  size_t off;
+  ssize_t r;
+
+  for (off = 0; off < n; off += r) {
+    if ((r = read(fd, buf + off, n - off)) == -1) {
+      if (errno == EINTR) {
+        r = 0;
+        continue;
+      }
+      warn("read");
+      return -1;
+    }
+    if (r == 0)
+      break;
+  }
+
+  return off;
+}
+
+/*
+ * Write all n bytes of buf to fd.
+ *
+ * return 0 on success, -1 on failure
+ */
+static int
+write_full(int fd, const unsigned char *buf, size_t n)
+{
+  ssize_t r;
+
+  while (n > 0) {
+    if ((r = write(fd, buf, n)) == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EPIPE)
+        warn("write");
+      return -1;
+    }
+    buf += r;
+    n -= r;
+  }
+
+  return 0;
+}
@@ -0,0 +1,439 @@
+/**
+ * Copyright (c) 2016 Tim Kuijsten
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "mongovi.h"
+
+#define COPYBATCH 1000  /* documents per getMore and bulk write of a client copy */
+
+static int copy_coll(mongoc_client_t *client, const path_t *src, const path_t *dst);
+static int copy_server(mongoc_client_t *client, const path_t *src, const path_t *dst);
+static int copy_client(mongoc_client_t *client, const path_t *src, const path_t *dst);
+static int flush_copy(mongoc_bulk_operation_t *bulk, int64_t *copied);
+static int check_paths(mongoc_client_t *client, const path_t *src, const path_t *dst);
+static int coll_exists(mongoc_client_t *client, const path_t *ns);
+static int coll_options(mongoc_client_t *client, const path_t *ns);
+static int copy_indexes(mongoc_client_t *client, const path_t *src, const path_t *dst);
+
+/*
+ * Copy the collection src to dst, which must not exist. The server copies the
+ * documents with $out or $merge, if it can't, documents are streamed through
+ * an unordered bulk insert without conversion to JSON. Indexes are not copied.
+ *
+ * return 0 on success, -1 on failure
+ */
+int
+exec_cp(const path_t *src, const path_t *dst)
+{
+  mongoc_client_t *client;
+  int ret;
+
+  client = mongoc_client_pool_pop(get_pool());
+
+  ret = -1;
+  if (check_paths(client, src, dst) == 0)
+    ret = copy_coll(client, src, dst);
+
+  mongoc_client_pool_push(get_pool(), client);
+
+  return ret;
+}
+
+/*
+ * Rename the collection src to dst, which must not exist, with
+ * renameCollection. If the server can't rename across databases, for example
+ * on a sharded cluster, src is copied to dst, its indexes are recreated on dst
+ * and src is dropped. Collections with options, like a validator, are not
+ * copied this way.
+ *
+ * return 0 on success, -1 on failure
+ */
+int
+exec_mv(const path_t *src, const path_t *dst)
+{
+  mongoc_client_t *client;
+  mongoc_collection_t *coll;
+  bson_error_t error;
+  bson_t *cmd;
+  char from[MAXDBNAME + MAXCOLLNAME + 1], to[MAXDBNAME + MAXCOLLNAME + 1];
+  int ret;
+
+  client = mongoc_client_pool_pop(get_pool());
+
+  if (check_paths(client, src, dst) == -1) {
+    mongoc_client_pool_push(get_pool(), client);
+    return -1;
+  }
+
+  snprintf(from, sizeof(from), "%s.%s", src->dbname, src->collname);
+  snprintf(to, sizeof(to), "%s.%s", dst->dbname, dst->collname);
+
+  ret = 0;
+  cmd = BCON_NEW("renameCollection", BCON_UTF8(from), "to", BCON_UTF8(to));
+  if (mongoc_client_command_simple(client, "admin", cmd, NULL, NULL, &error)) {
+    fprintf(outfp(), "renamed /%s/%s to /%s/%s\n", src->dbname, src->collname, dst->dbname,
+        dst->collname);
+  } else if (strcmp(src->dbname, dst->dbname) == 0) {
+    warnx("%d.%d %s", error.domain, error.code, error.message);
+    ret = -1;
+  } else if ((ret = coll_options(client, src)) != 0) {
+    if (ret == 1)
+      warnx("can't rename across databases and /%s/%s has options, use cp: %s", src->dbname,
+          src->collname, error.message);
+    ret = -1;
+  } else {
+    warnx("can't rename across databases, copying: %s", error.message);
+    if ((ret = copy_coll(client, src, dst)) == 0 && (ret = copy_indexes(client, src, dst)) == -1)
+      warnx("/%s/%s is kept", src->dbname, src->collname);
+    if (ret == 0) {
+      coll = mongoc_client_get_collection(client, src->dbname, src->collname);
+      if (mongoc_collection_drop(coll, &error)) {
+        fprintf(outfp(), "dropped /%s/%s\n", src->dbname, src->collname);
+      } else {
+        warnx("%d.%d %s", error.domain, error.code, error.message);
+        ret = -1;
+      }
+      mongoc_collection_destroy(coll);
+    }
+  }
+  bson_destroy(cmd);
+
+  mongoc_client_pool_push(get_pool(), client);
+
+  return ret;
+}
+
+/*
+ * Copy src to dst on the server or, if that fails before anything is written,
+ * through this client.
+ *
+ * return 0 on success, -1 on failure
+ */
+static int
+copy_coll(mongoc_client_t *client, const path_t *src, const path_t *dst)
+{
+  if (copy_server(client, src, dst) == 0)
+    return 0;
+
+  /* a failed $merge may have written part of the documents */
+  switch (coll_exists(client, dst)) {
+  case -1:
+    return -1;
+  case 1:
+    warnx("/%s/%s is incomplete", dst->dbname, dst->collname);
+    return -1;
+  }
+
+  warnx("copying through the client");
+  return copy_client(client, src, dst);
+}
+
+/*
+ * Copy src to dst with an aggregation. $out is used within a database, $merge,
+ * available since MongoDB 4.2, across databases.
+ *
+ * return 0 on success, -1 on failure
+ */
+static int
+copy_server(mongoc_client_t *client, const path_t *src, const path_t *dst)
+{
+  mongoc_collection_t *coll;
+  mongoc_cursor_t *cursor;
+  bson_error_t error;
+  const bson_t *doc;
+  bson_t *pipeline;
+  int64_t start;
+  int ret;
+
+  if (strcmp(src->dbname, dst->dbname) == 0)
+    pipeline = BCON_NEW("pipeline", "[", "{", "$out", BCON_UTF8(dst->collname), "}", "]");
+  else
+    pipeline = BCON_NEW("pipeline", "[", "{", "$merge", "{", "into", "{",
+        "db", BCON_UTF8(dst->dbname), "coll", BCON_UTF8(dst->collname), "}", "}", "}", "]");
+
+  coll = mongoc_client_get_collection(client, src->dbname, src->collname);
+
+  start = bson_get_monotonic_time();
+  cursor = mongoc_collection_aggregate(coll, MONGOC_QUERY_NONE, pipeline, NULL, NULL);
+  while (mongoc_cursor_next(cursor, &doc))
+    ;
+
+  ret = 0;
+  if (mongoc_cursor_error(cursor, &error)) {
+    warnx("%d.%d %s", error.domain, error.code, error.message);
+    ret = -1;
+  } else {
+    fprintf(outfp(), "copied /%s/%s to /%s/%s in %.3fs\n", src->dbname, src->collname, dst->dbname,
+        dst->collname, (bson_get_monotonic_time() - start) / 1e6);
+  }
+
+  mongoc_cursor_destroy(cursor);
+  mongoc_collection_destroy(coll);
+  bson_destroy(pipeline);
+
+  return ret;
+}
+
+/*
+ * Read every document of src and insert it into dst in unordered bulks of
+ * COPYBATCH documents. Documents stay BSON.
+ *
+ * return 0 on success, -1 on failure
+ */
+static int
+copy_client(mongoc_client_t *client, const path_t *src, const path_t *dst)
+{
+  mongoc_collection_t *from, *to;
+  mongoc_bulk_operation_t *bulk;
+  mongoc_cursor_t *cursor;
+  bson_error_t error;
+  const bson_t *doc;
+  bson_t *opts, *bulkopts, filter;
+  int64_t copied, queued, start;
+  int ret;
+
+  from = mongoc_client_get_collection(client, src->dbname, src->collname);
+  to = mongoc_client_get_collection(client, dst->dbname, dst->collname);
+  opts = BCON_NEW("batchSize", BCON_INT32(COPYBATCH));
+  bulkopts = BCON_NEW("ordered", BCON_BOOL(false));
+
+  ret = 0;
+  copied = queued = 0;
+  bulk = NULL;
+  start = bson_get_monotonic_time();
+  bson_init(&filter);
+  cursor = mongoc_collection_find_with_opts(from, &filter, opts, NULL);
+  while (!interrupted && mongoc_cursor_next(cursor, &doc)) {
+    if (bulk == NULL)
+      bulk = mongoc_collection_create_bulk_operation_with_opts(to, bulkopts);
+    if (!mongoc_bulk_operation_insert_with_opts(bulk, doc, NULL, &error)) {
+      warnx("%d.%d %s", error.domain, error.code, error.message);
+      ret = -1;
+      break;
+    }
+    if (++queued == COPYBATCH) {
+      ret = flush_copy(bulk, &copied);
+      bulk = NULL;
+      queued = 0;
+      if (ret == -1)
+        break;
+    }
+  }
+
+  if (ret == 0 && mongoc_cursor_error(cursor, &error)) {
+    warnx("cursor failed: %d.%d %s", error.domain, error.code, error.message);
+    ret = -1;
+  }
+  if (ret == 0 && !interrupted && queued > 0)
+    ret = flush_copy(bulk, &copied);
+  else if (bulk != NULL)
+    mongoc_bulk_operation_destroy(bulk);
+  if (interrupted)
+    ret = -1;
+
+  fprintf(outfp(), "copied %lld documents from /%s/%s to /%s/%s in %.3fs\n", (long long)copied,
+      src->dbname, src->collname, dst->dbname, dst->collname,
+      (bson_get_monotonic_time() - start) / 1e6);
+
+  mongoc_cursor_destroy(cursor);
+  bson_destroy(&filter);
+  bson_destroy(bulkopts);
+  bson_destroy(opts);
+  mongoc_collection_destroy(to);
+  mongoc_collection_destroy(from);
+
+  return ret;
+}
+
+/*
+ * Execute and destroy bulk and add the number of inserted documents to copied.
+ *
+ * return 0 on success, -1 on failure
+ */
+static int
+flush_copy(mongoc_bulk_operation_t *bulk, int64_t *copied)
+{
+  bson_error_t error;
+  bson_t reply;
+  int ret;
+
+  ret = 0;
+  if (!mongoc_bulk_operation_execute(bulk, &reply, &error)) {
+    warnx("%d.%d %s", error.domain, error.code, error.message);
+    ret = -1;
+  }
+  *copied += bson_lookup_int64(&reply, "nInserted");
+
+  bson_destroy(&reply);
+  mongoc_bulk_operation_destroy(bulk);
+
+  return ret;
+}
+
+/*
+ * Make sure src and dst both name a collection, src exists and dst does not.
+ *
+ * return 0 on success, -1 on failure
+ */
+static int
+check_paths(mongoc_client_t *client, const path_t *src, const path_t *dst)
+{
+  int r;
+
+  if (!strlen(src->collname) || !strlen(dst->collname)) {
+    warnx("both paths must name a collection");
+    return -1;
+  }
+
+  if ((r = coll_exists(client, src)) == -1)
+    return -1;
+  if (r == 0) {
+    warnx("/%s/%s does not exist", src->dbname, src->collname);
+    return -1;
+  }
+
+  if ((r = coll_exists(client, dst)) == -1)
+    return -1;
+  if (r == 1) {
+    warnx("/%s/%s exists", dst->dbname, dst->collname);
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Check if the collection in ns exists.
+ *
+ * return 1 if it exists, 0 if not and -1 on failure
+ */
+static int
+coll_exists(mongoc_client_t *client, const path_t *ns)
+{
+  mongoc_database_t *db;
+  bson_error_t error;
+  int r;
+
+  memset(&error, 0, sizeof(error));
+  db = mongoc_client_get_database(client, ns->dbname);
+  r = mongoc_database_has_collection(db, ns->collname, &error);
+  mongoc_database_destroy(db);
+
+  if (!r && error.code != 0) {
+    warnx("%d.%d %s", error.domain, error.code, error.message);
+    return -1;
+  }
+
+  return r;
+}
+
+/*
+ * Check if the collection in ns was created with options, like a validator,
+ * capped or a collation.
+ *
+ * return 1 if it has options, 0 if not and -1 on failure
+ */
+static int
+coll_options(mongoc_client_t *client, const path_t *ns)
+{
+  mongoc_database_t *db;
+  mongoc_cursor_t *cursor;
+  bson_error_t error;
+  bson_iter_t it, opts;
+  const bson_t *doc;
+  bson_t *filter;
+  int r;
+
+  db = mongoc_client_get_database(client, ns->dbname);
+  filter = BCON_NEW("filter", "{", "name", BCON_UTF8(ns->collname), "}");
+  cursor = mongoc_database_find_collections_with_opts(db, filter);
+
+  r = 0;
+  if (mongoc_cursor_next(cursor, &doc) && bson_iter_init_find(&it, doc, "options") &&
+      BSON_ITER_HOLDS_DOCUMENT(&it) && bson_iter_recurse(&it, &opts) && bson_iter_next(&opts))
+    r = 1;
+
+  if (mongoc_cursor_error(cursor, &error)) {
+    warnx("%d.%d %s", error.domain, error.code, error.message);
+    r = -1;
+  }
+
+  mongoc_cursor_destroy(cursor);
+  bson_destroy(filter);
+  mongoc_database_destroy(db);
+
+  return r;
+}
+
+/*
+ * Create every index of src, except the one on _id, on dst with a single
+ * createIndexes.
+ *
+ * return 0 on success, -1 on failure
+ */
+static int
+copy_indexes(mongoc_client_t *client, const path_t *src, const path_t *dst)
+{
+  mongoc_collection_t *coll;
+  mongoc_cursor_t *cursor;
+  bson_error_t error;
+  bson_iter_t it;
+  const bson_t *doc;
+  const char *key;
+  char keybuf[16];
+  bson_t cmd, indexes, index;
+  uint32_t n;
+  int ret;
+
+  coll = mongoc_client_get_collection(client, src->dbname, src->collname);
+  cursor = mongoc_collection_find_indexes_with_opts(coll, NULL);
+
+  bson_init(&cmd);
+  BSON_APPEND_UTF8(&cmd, "createIndexes", dst->collname);
+  bson_append_array_begin(&cmd, "indexes", -1, &indexes);
+
+  n = 0;
+  while (mongoc_cursor_next(cursor, &doc)) {
+    if (bson_iter_init_find(&it, doc, "name") && BSON_ITER_HOLDS_UTF8(&it) &&
+        strcmp(bson_iter_utf8(&it, NULL), "_id_") == 0)
+      continue;
+
+    /* the namespace and version are set by the server */
+    bson_uint32_to_string(n++, &key, keybuf, sizeof(keybuf));
+    bson_append_document_begin(&indexes, key, -1, &index);
+    bson_copy_to_excluding_noinit(doc, &index, "ns", "v", NULL);
+    bson_append_document_end(&indexes, &index);
+  }
+  bson_append_array_end(&cmd, &indexes);
+
+  ret = 0;
+  if (mongoc_cursor_error(cursor, &error)) {
+    warnx("%d.%d %s", error.domain, error.code, error.message);
+    ret = -1;
+  } else if (n > 0) {
+    if (mongoc_client_write_command_with_opts(client, dst->dbname, &cmd, NULL, NULL, &error)) {
+      fprintf(outfp(), "created %u indexes on /%s/%s\n", n, dst->dbname, dst->collname);
+    } else {
+      warnx("%d.%d %s", error.domain, error.code, error.message);
+      ret = -1;
+    }
+  }
+
+  bson_destroy(&cmd);
+  mongoc_cursor_destroy(cursor);
+  mongoc_collection_destroy(coll);
+
+  return ret;
+}
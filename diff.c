@@ -0,0 +1,736 @@
+/**
+ * Copyright (c) 2016 Tim Kuijsten
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "mongovi.h"
+
+#define DIFFLEAF 1000  /* compare ranges of at most this many documents document by document */
+#define DIFFSPLIT 16   /* split a differing range in at most this many ranges */
+#define MAXTYPES 32    /* maximum number of distinct _id types */
+#define MAXTYPE 24     /* maximum length of a type alias */
+
+/* number of documents and hash of a range on one side */
+struct sum {
+  char type[MAXTYPE];
+  int64_t n;
+  int64_t h;
+};
+
+/*
+ * A range of _id values of one type. Comparison operators only match values of
+ * the same type, so a range never spans types.
+ */
+struct range {
+  char type[MAXTYPE];  /* $type alias of the _id values */
+  bson_t *lo;          /* { _id: inclusive lower bound } or NULL if unbounded */
+  bson_t *hi;          /* { _id: exclusive upper bound } or NULL if unbounded */
+  int known;           /* sum is already known */
+  struct sum sum[2];
+  bson_t **split;      /* { _id: split point } for the next level */
+  size_t nsplit;
+};
+
+/* state shared by the workers of one diff */
+struct diff {
+  path_t ns[2];
+  int hashes;          /* the server can hash documents */
+  struct sum types[2][MAXTYPES];  /* sums per type of _id of both collections */
+  size_t ntypes[2];
+  struct range *ranges;
+  FILE *out;           /* output stream of the calling thread */
+  pthread_mutex_t mtx;
+  int64_t differ;      /* number of differing _ids */
+  int64_t fetched;     /* number of documents compared through the client */
+};
+
+/* a growing list of documents and their _id as { _id: id } */
+struct docs {
+  bson_t **v;
+  bson_t **id;
+  size_t n;
+  size_t size;
+};
+
+static int parse_diff_opts(const char *line, int *parallel, const char **a, const char **b,
+    Tokenizer *t);
+static int sum_worker(mongoc_client_t *client, void *arg, size_t i);
+static int diff_worker(mongoc_client_t *client, void *arg, size_t i);
+static int fingerprint(mongoc_collection_t *coll, const struct range *r, int hashes,
+    struct sum *sums, size_t *n);
+static int split_range(mongoc_collection_t *coll, struct range *r);
+static int compare_range(struct diff *d, mongoc_collection_t *coll[2], const struct range *r);
+static int fetch_range(mongoc_collection_t *coll, const struct range *r, int hashes,
+    struct docs *docs);
+static int print_docs(struct diff *d, mongoc_collection_t *coll, int side, const bson_t *ids);
+static int dbhash(mongoc_client_t *client, const path_t *ns, char *md5, size_t md5size);
+static void range_match(const struct range *r, bson_t *match);
+static void append_id(bson_t *arr, size_t *n, const bson_t *doc);
+static void push_doc(struct docs *docs, const bson_t *doc);
+static void free_docs(struct docs *docs);
+static void free_ranges(struct range *ranges, size_t n);
+static bson_t *copy_bound(const bson_t *bound);
+
+/*
+ * Compare the documents of two collections, like rsync does. Both collections
+ * are split in ranges of _id values and each range is hashed on the server with
+ * an aggregation. Only ranges of which the hashes differ are split further,
+ * until a range is small enough to compare the hash of every document. Only the
+ * documents that differ are fetched and printed, preceded by "<" if they are in
+ * the first collection and ">" if they are in the second.
+ *
+ * If the server can't hash documents, dbHash is used to see if the collections
+ * are identical, if not, ranges are compared through the client.
+ *
+ * return 0 on success, -1 on failure
+ */
+int
+exec_diff(const path_t *cwd, const char *line)
+{
+  struct diff d;
+  struct range *next;
+  struct sum *sum;
+  mongoc_client_t *client;
+  Tokenizer *t;
+  const char *a, *b;
+  char md5[2][33];
+  int64_t start, level;
+  size_t n, nnext, i, j, k, s;
+  int parallel, ret;
+
+  t = tok_init(NULL);
+  if (parse_diff_opts(line, &parallel, &a, &b, t) == -1) {
+    warnx("usage: diff [-p 1..%d] path path", MAXWORKERS);
+    tok_end(t);
+    return -1;
+  }
+
+  /* both paths are relative to the current database and collection */
+  d.ns[0] = d.ns[1] = *cwd;
+  if (parse_path(a, &d.ns[0], NULL, NULL) < 0 || parse_path(b, &d.ns[1], NULL, NULL) < 0) {
+    warnx("illegal path spec");
+    tok_end(t);
+    return -1;
+  }
+  tok_end(t);
+
+  if (!strlen(d.ns[0].collname) || !strlen(d.ns[1].collname)) {
+    warnx("both paths must name a collection");
+    return -1;
+  }
+
+  start = bson_get_monotonic_time();
+  d.hashes = 1;
+  d.out = outfp();
+  d.differ = 0;
+  d.fetched = 0;
+  if (pthread_mutex_init(&d.mtx, NULL) != 0)
+    errx(1, "exec_diff: can't initialize mutex");
+
+  /* sum every type of _id of both collections at the same time */
+  if (fanout(sum_worker, &d, 2, 2) == -1) {
+    d.hashes = 0;
+    client = mongoc_client_pool_pop(get_pool());
+    if (dbhash(client, &d.ns[0], md5[0], sizeof(md5[0])) == 0 &&
+        dbhash(client, &d.ns[1], md5[1], sizeof(md5[1])) == 0 && strcmp(md5[0], md5[1]) == 0)
+      d.ntypes[0] = d.ntypes[1] = 0;
+    else
+      d.ntypes[0] = d.ntypes[1] = 1;
+    mongoc_client_pool_push(get_pool(), client);
+
+    if (d.ntypes[0] == 1) {
+      warnx("can't hash documents on the server, comparing through the client");
+      if (fanout(sum_worker, &d, 2, 2) == -1) {
+        pthread_mutex_destroy(&d.mtx);
+        return -1;
+      }
+    }
+  }
+
+  /* start with one range for every type of _id that differs */
+  n = 0;
+  d.ranges = bson_malloc0((d.ntypes[0] + d.ntypes[1] + 1) * sizeof(*d.ranges));
+  for (s = 0; s < 2; s++) {
+    for (i = 0; i < d.ntypes[s]; i++) {
+      sum = &d.types[s][i];
+      for (j = 0; j < n; j++)
+        if (strcmp(d.ranges[j].type, sum->type) == 0)
+          break;
+      if (j == n) {
+        strlcpy(d.ranges[n].type, sum->type, MAXTYPE);
+        d.ranges[n].known = 1;
+        n++;
+      }
+      d.ranges[j].sum[s] = *sum;
+    }
+  }
+
+  k = 0;
+  for (i = 0; i < n; i++)
+    if (!d.hashes || d.ranges[i].sum[0].n != d.ranges[i].sum[1].n ||
+        d.ranges[i].sum[0].h != d.ranges[i].sum[1].h)
+      d.ranges[k++] = d.ranges[i];
+  n = k;
+
+  /* compare the differing ranges of one level, split the ones that are too big */
+  ret = 0;
+  level = 0;
+  while (n > 0 && !interrupted) {
+    level++;
+    if (fanout(diff_worker, &d, n, parallel) == -1) {
+      ret = -1;
+      break;
+    }
+
+    nnext = 0;
+    for (i = 0; i < n; i++)
+      if (d.ranges[i].nsplit > 0)
+        nnext += d.ranges[i].nsplit + 1;
+
+    next = bson_malloc0((nnext + 1) * sizeof(*next));
+    k = 0;
+    for (i = 0; i < n; i++) {
+      for (j = 0; d.ranges[i].nsplit > 0 && j <= d.ranges[i].nsplit; j++) {
+        strlcpy(next[k].type, d.ranges[i].type, MAXTYPE);
+        next[k].lo = copy_bound(j == 0 ? d.ranges[i].lo : d.ranges[i].split[j - 1]);
+        next[k].hi = copy_bound(j == d.ranges[i].nsplit ? d.ranges[i].hi : d.ranges[i].split[j]);
+        k++;
+      }
+    }
+
+    free_ranges(d.ranges, n);
+    d.ranges = next;
+    n = nnext;
+  }
+  free_ranges(d.ranges, n);
+
+  if (interrupted) {
+    warnx("interrupted");
+    ret = -1;
+  }
+
+  fprintf(d.out, "%lld documents differ, %lld compared through the client, %lld levels in %.3fs\n",
+      (long long)d.differ, (long long)d.fetched, (long long)level,
+      (bson_get_monotonic_time() - start) / 1e6);
+
+  pthread_mutex_destroy(&d.mtx);
+
+  return ret;
+}
+
+/*
+ * Parse the options and both paths of diff. The paths point into the tokenizer
+ * t.
+ *
+ * return 0 on success, -1 on failure
+ */
+static int
+parse_diff_opts(const char *line, int *parallel, const char **a, const char **b, Tokenizer *t)
+{
+  const char **av;
+  char *end;
+  long val;
+  int ac, i;
+
+  *parallel = GLOBWORKERS;
+
+  if (tok_str(t, line, &ac, &av) != 0)
+    return -1;
+
+  i = 0;
+  if (ac == 4 && strcmp(av[0], "-p") == 0) {
+    val = strtol(av[1], &end, 10);
+    if (*end != '\0' || val < 1 || val > MAXWORKERS)
+      return -1;
+    *parallel = val;
+    i = 2;
+  }
+
+  if (ac - i != 2)
+    return -1;
+
+  *a = av[i];
+  *b = av[i + 1];
+
+  return 0;
+}
+
+/*
+ * Sum every type of _id of the i'th collection of the diff in arg. Runs on a
+ * fanout worker.
+ *
+ * return 0 on success, -1 on failure
+ */
+static int
+sum_worker(mongoc_client_t *client, void *arg, size_t i)
+{
+  struct diff *d = arg;
+  mongoc_collection_t *coll;
+  int ret;
+
+  coll = mongoc_client_get_collection(client, d->ns[i].dbname, d->ns[i].collname);
+  ret = fingerprint(coll, NULL, d->hashes, d->types[i], &d->ntypes[i]);
+  mongoc_collection_destroy(coll);
+
+  return ret;
+}
+
+/*
+ * Compare the i'th range of the diff in arg. If the range is equal on both
+ * sides nothing is done, if it's small enough the documents are compared,
+ * otherwise split points for the next level are determined. Runs on a fanout
+ * worker.
+ *
+ * return 0 on success, -1 on failure
+ */
+static int
+diff_worker(mongoc_client_t *client, void *arg, size_t i)
+{
+  struct diff *d = arg;
+  struct range *r = &d->ranges[i];
+  mongoc_collection_t *coll[2];
+  struct sum sums[MAXTYPES];
+  size_t n, s;
+  int ret;
+
+  if (interrupted)
+    return -1;
+
+  for (s = 0; s < 2; s++)
+    coll[s] = mongoc_client_get_collection(client, d->ns[s].dbname, d->ns[s].collname);
+
+  ret = 0;
+  for (s = 0; s < 2 && !r->known; s++) {
+    if ((ret = fingerprint(coll[s], r, d->hashes, sums, &n)) == -1)
+      break;
+    /* a range has one type, or none if it's empty on this side */
+    r->sum[s].n = n > 0 ? sums[0].n : 0;
+    r->sum[s].h = n > 0 ? sums[0].h : 0;
+  }
+
+  if (ret == 0 && (!d->hashes || r->sum[0].n != r->sum[1].n || r->sum[0].h != r->sum[1].h)) {
+    s = r->sum[0].n >= r->sum[1].n ? 0 : 1;
+    if (r->sum[s].n > DIFFLEAF)
+      ret = split_range(coll[s], r);
+    if (ret == 0 && r->nsplit == 0)
+      ret = compare_range(d, coll, r);
+  }
+
+  for (s = 0; s < 2; s++)
+    mongoc_collection_destroy(coll[s]);
+
+  return ret;
+}
+
+/*
+ * Count and hash the documents in coll per type of _id, in range r or in the
+ * whole collection if r is NULL. Without hashes only the documents are counted.
+ * sums must have room for MAXTYPES sums, the number of sums is stored in n.
+ *
+ * return 0 on success, -1 on failure
+ */
+static int
+fingerprint(mongoc_collection_t *coll, const struct range *r, int hashes, struct sum *sums,
+    size_t *n)
+{
+  mongoc_cursor_t *cursor;
+  bson_error_t error;
+  bson_iter_t it;
+  const bson_t *doc;
+  bson_t *pipeline, *opts, match;
+  int ret;
+
+  bson_init(&match);
+  if (r != NULL)
+    range_match(r, &match);
+
+  /* numbers of different types compare equal, so group them as one type */
+  if (hashes)
+    pipeline = BCON_NEW("pipeline", "[",
+        "{", "$match", BCON_DOCUMENT(&match), "}",
+        "{", "$group", "{",
+          "_id", "{", "$cond", "[", "{", "$isNumber", BCON_UTF8("$_id"), "}",
+            BCON_UTF8("number"), "{", "$type", BCON_UTF8("$_id"), "}", "]", "}",
+          "n", "{", "$sum", BCON_INT32(1), "}",
+          "h", "{", "$sum", "{", "$mod", "[", "{", "$toHashedIndexKey", BCON_UTF8("$$ROOT"), "}",
+            BCON_INT64(4294967296), "]", "}", "}",
+        "}", "}", "]");
+  else
+    pipeline = BCON_NEW("pipeline", "[",
+        "{", "$match", BCON_DOCUMENT(&match), "}",
+        "{", "$group", "{",
+          "_id", "{", "$cond", "[", "{", "$isNumber", BCON_UTF8("$_id"), "}",
+            BCON_UTF8("number"), "{", "$type", BCON_UTF8("$_id"), "}", "]", "}",
+          "n", "{", "$sum", BCON_INT32(1), "}",
+        "}", "}", "]");
+  opts = BCON_NEW("allowDiskUse", BCON_BOOL(true));
+
+  *n = 0;
+  cursor = mongoc_collection_aggregate(coll, MONGOC_QUERY_NONE, pipeline, opts, NULL);
+  while (!interrupted && mongoc_cursor_next(cursor, &doc)) {
+    if (*n == MAXTYPES || !bson_iter_init_find(&it, doc, "_id") || !BSON_ITER_HOLDS_UTF8(&it))
+      continue;
+    strlcpy(sums[*n].type, bson_iter_utf8(&it, NULL), MAXTYPE);
+    sums[*n].n = bson_lookup_int64(doc, "n");
+    sums[*n].h = bson_lookup_int64(doc, "h");
+    (*n)++;
+  }
+
+  ret = 0;
+  if (mongoc_cursor_error(cursor, &error)) {
+    warnx("%d.%d %s", error.domain, error.code, error.message);
+    ret = -1;
+  }
+
+  mongoc_cursor_destroy(cursor);
+  bson_destroy(opts);
+  bson_destroy(pipeline);
+  bson_destroy(&match);
+
+  return ret;
+}
+
+/*
+ * Pick up to DIFFSPLIT - 1 random _ids in range r of coll as split points.
+ *
+ * return 0 on success, -1 on failure
+ */
+static int
+split_range(mongoc_collection_t *coll, struct range *r)
+{
+  mongoc_cursor_t *cursor;
+  bson_error_t error;
+  const bson_t *doc;
+  bson_t *pipeline, *opts, match;
+  int ret;
+
+  bson_init(&match);
+  range_match(r, &match);
+
+  pipeline = BCON_NEW("pipeline", "[",
+      "{", "$match", BCON_DOCUMENT(&match), "}",
+      "{", "$sample", "{", "size", BCON_INT32(DIFFSPLIT - 1), "}", "}",
+      "{", "$project", "{", "_id", BCON_INT32(1), "}", "}",
+      "{", "$sort", "{", "_id", BCON_INT32(1), "}", "}",
+      "]");
+  opts = BCON_NEW("allowDiskUse", BCON_BOOL(true));
+
+  r->split = bson_malloc0(DIFFSPLIT * sizeof(*r->split));
+  r->nsplit = 0;
+  cursor = mongoc_collection_aggregate(coll, MONGOC_QUERY_NONE, pipeline, opts, NULL);
+  while (mongoc_cursor_next(cursor, &doc)) {
+    /* skip duplicates and the lower bound, it would create an empty range */
+    if (r->nsplit == DIFFSPLIT - 1)
+      continue;
+    if (r->nsplit > 0 && bson_equal(r->split[r->nsplit - 1], doc))
+      continue;
+    if (r->lo != NULL && bson_equal(r->lo, doc))
+      continue;
+    r->split[r->nsplit++] = bson_copy(doc);
+  }
+
+  ret = 0;
+  if (mongoc_cursor_error(cursor, &error)) {
+    warnx("%d.%d %s", error.domain, error.code, error.message);
+    ret = -1;
+  }
+
+  mongoc_cursor_destroy(cursor);
+  bson_destroy(opts);
+  bson_destroy(pipeline);
+  bson_destroy(&match);
+
+  return ret;
+}
+
+/*
+ * Compare range r of both collections document by document and print the
+ * documents of which the _id is only on one side or whose contents differ.
+ * Both sides are fetched sorted on _id, with hashes only the _id and the hash
+ * of every document.
+ *
+ * return 0 on success, -1 on failure
+ */
+static int
+compare_range(struct diff *d, mongoc_collection_t *coll[2], const struct range *r)
+{
+  struct docs docs[2];
+  bson_t ids, arr;
+  size_t i, j, k, n;
+  int ret;
+
+  memset(docs, 0, sizeof(docs));
+  if (fetch_range(coll[0], r, d->hashes, &docs[0]) == -1 ||
+      fetch_range(coll[1], r, d->hashes, &docs[1]) == -1) {
+    free_docs(&docs[0]);
+    free_docs(&docs[1]);
+    return -1;
+  }
+
+  /*
+   * Both lists are in the same order, so every document of b that is skipped
+   * before the next match is only in b.
+   */
+  bson_init(&ids);
+  bson_append_array_begin(&ids, "$in", -1, &arr);
+  n = 0;
+  j = 0;
+  for (i = 0; i < docs[0].n; i++) {
+    for (k = j; k < docs[1].n; k++)
+      if (bson_equal(docs[0].id[i], docs[1].id[k]))
+        break;
+
+    if (k == docs[1].n) {
+      append_id(&arr, &n, docs[0].v[i]);
+      continue;
+    }
+
+    for (; j < k; j++)
+      append_id(&arr, &n, docs[1].v[j]);
+    if (!bson_equal(docs[0].v[i], docs[1].v[k]))
+      append_id(&arr, &n, docs[0].v[i]);
+    j = k + 1;
+  }
+  for (; j < docs[1].n; j++)
+    append_id(&arr, &n, docs[1].v[j]);
+  bson_append_array_end(&ids, &arr);
+
+  ret = 0;
+  if (n > 0 && (print_docs(d, coll[0], 0, &ids) == -1 || print_docs(d, coll[1], 1, &ids) == -1))
+    ret = -1;
+
+  pthread_mutex_lock(&d->mtx);
+  d->differ += n;
+  d->fetched += docs[0].n + docs[1].n;
+  pthread_mutex_unlock(&d->mtx);
+
+  bson_destroy(&ids);
+  free_docs(&docs[0]);
+  free_docs(&docs[1]);
+
+  return ret;
+}
+
+/*
+ * Fetch all documents in range r of coll sorted on _id. With hashes only the
+ * _id and a hash of every document is fetched.
+ *
+ * return 0 on success, -1 on failure
+ */
+static int
+fetch_range(mongoc_collection_t *coll, const struct range *r, int hashes, struct docs *docs)
+{
+  mongoc_cursor_t *cursor;
+  bson_error_t error;
+  const bson_t *doc;
+  bson_t *pipeline, match;
+  int ret;
+
+  bson_init(&match);
+  range_match(r, &match);
+
+  if (hashes)
+    pipeline = BCON_NEW("pipeline", "[",
+        "{", "$match", BCON_DOCUMENT(&match), "}",
+        "{", "$sort", "{", "_id", BCON_INT32(1), "}", "}",
+        "{", "$project", "{", "h", "{", "$toHashedIndexKey", BCON_UTF8("$$ROOT"), "}", "}", "}",
+        "]");
+  else
+    pipeline = BCON_NEW("pipeline", "[",
+        "{", "$match", BCON_DOCUMENT(&match), "}",
+        "{", "$sort", "{", "_id", BCON_INT32(1), "}", "}",
+        "]");
+
+  cursor = mongoc_collection_aggregate(coll, MONGOC_QUERY_NONE, pipeline, NULL, NULL);
+  while (!interrupted && mongoc_cursor_next(cursor, &doc))
+    push_doc(docs, doc);
+
+  ret = 0;
+  if (mongoc_cursor_error(cursor, &error)) {
+    warnx("%d.%d %s", error.domain, error.code, error.message);
+    ret = -1;
+  }
+
+  mongoc_cursor_destroy(cursor);
+  bson_destroy(pipeline);
+  bson_destroy(&match);
+
+  return ret;
+}
+
+/*
+ * Fetch the documents with an _id in ids from coll and print them, preceded by
+ * "<" for the first and ">" for the second collection.
+ *
+ * return 0 on success, -1 on failure
+ */
+static int
+print_docs(struct diff *d, mongoc_collection_t *coll, int side, const bson_t *ids)
+{
+  mongoc_cursor_t *cursor;
+  bson_error_t error;
+  const bson_t *doc;
+  bson_t query, *opts;
+  char *str;
+  int ret;
+
+  bson_init(&query);
+  BSON_APPEND_DOCUMENT(&query, "_id", ids);
+  opts = BCON_NEW("sort", "{", "_id", BCON_INT32(1), "}");
+
+  cursor = mongoc_collection_find_with_opts(coll, &query, opts, NULL);
+  while (!interrupted && mongoc_cursor_next(cursor, &doc)) {
+    str = bson_as_json(doc, NULL);
+    pthread_mutex_lock(&d->mtx);
+    fprintf(d->out, "%c /%s/%s %s\n", side ? '>' : '<', d->ns[side].dbname,
+        d->ns[side].collname, str);
+    pthread_mutex_unlock(&d->mtx);
+    bson_free(str);
+  }
+
+  ret = 0;
+  if (mongoc_cursor_error(cursor, &error)) {
+    warnx("%d.%d %s", error.domain, error.code, error.message);
+    ret = -1;
+  }
+
+  mongoc_cursor_destroy(cursor);
+  bson_destroy(opts);
+  bson_destroy(&query);
+
+  return ret;
+}
+
+/*
+ * Get the md5 of the collection in ns with dbHash.
+ *
+ * return 0 on success, -1 on failure
+ */
+static int
+dbhash(mongoc_client_t *client, const path_t *ns, char *md5, size_t md5size)
+{
+  bson_error_t error;
+  bson_iter_t it, colls;
+  bson_t *cmd, reply;
+  int ret;
+
+  cmd = BCON_NEW("dbHash", BCON_INT32(1), "collections", "[", BCON_UTF8(ns->collname), "]");
+
+  ret = -1;
+  if (!mongoc_client_command_simple(client, ns->dbname, cmd, NULL, &reply, &error)) {
+    warnx("dbHash: %d.%d %s", error.domain, error.code, error.message);
+  } else if (bson_iter_init_find(&it, &reply, "collections") && BSON_ITER_HOLDS_DOCUMENT(&it) &&
+      bson_iter_recurse(&it, &colls) && bson_iter_find(&colls, ns->collname) &&
+      BSON_ITER_HOLDS_UTF8(&colls)) {
+    strlcpy(md5, bson_iter_utf8(&colls, NULL), md5size);
+    ret = 0;
+  }
+
+  bson_destroy(&reply);
+  bson_destroy(cmd);
+
+  return ret;
+}
+
+/* build the filter { _id: { $type: type, $gte: lo, $lt: hi } } of range r */
+static void
+range_match(const struct range *r, bson_t *match)
+{
+  bson_iter_t it;
+  bson_t id;
+
+  bson_append_document_begin(match, "_id", -1, &id);
+  BSON_APPEND_UTF8(&id, "$type", r->type);
+  if (r->lo != NULL && bson_iter_init_find(&it, r->lo, "_id"))
+    bson_append_iter(&id, "$gte", -1, &it);
+  if (r->hi != NULL && bson_iter_init_find(&it, r->hi, "_id"))
+    bson_append_iter(&id, "$lt", -1, &it);
+  bson_append_document_end(match, &id);
+}
+
+/* append the _id of doc to the array arr which has n elements */
+static void
+append_id(bson_t *arr, size_t *n, const bson_t *doc)
+{
+  bson_iter_t it;
+  char key[16];
+
+  if (!bson_iter_init_find(&it, doc, "_id"))
+    return;
+
+  snprintf(key, sizeof(key), "%zu", *n);
+  bson_append_iter(arr, key, -1, &it);
+  (*n)++;
+}
+
+/* append a copy of doc and its _id to docs */
+static void
+push_doc(struct docs *docs, const bson_t *doc)
+{
+  bson_iter_t it;
+
+  if (docs->n == docs->size) {
+    docs->size = docs->size ? docs->size * 2 : 64;
+    if ((docs->v = reallocarray(docs->v, docs->size, sizeof(*docs->v))) == NULL)
+      err(1, "push_doc");
+    if ((docs->id = reallocarray(docs->id, docs->size, sizeof(*docs->id))) == NULL)
+      err(1, "push_doc");
+  }
+
+  docs->v[docs->n] = bson_copy(doc);
+  docs->id[docs->n] = bson_new();
+  if (bson_iter_init_find(&it, doc, "_id"))
+    bson_append_iter(docs->id[docs->n], "_id", -1, &it);
+  docs->n++;
+}
+
+static void
+free_docs(struct docs *docs)
+{
+  size_t i;
+
+  for (i = 0; i < docs->n; i++) {
+    bson_destroy(docs->v[i]);
+    bson_destroy(docs->id[i]);
+  }
+  free(docs->v);
+  free(docs->id);
+  docs->v = NULL;
+  docs->id = NULL;
+  docs->n = docs->size = 0;
+}
+
+static void
+free_ranges(struct range *ranges, size_t n)
+{
+  size_t i, j;
+
+  for (i = 0; i < n; i++) {
+    if (ranges[i].lo != NULL)
+      bson_destroy(ranges[i].lo);
+    if (ranges[i].hi != NULL)
+      bson_destroy(ranges[i].hi);
+    for (j = 0; j < ranges[i].nsplit; j++)
+      bson_destroy(ranges[i].split[j]);
+    bson_free(ranges[i].split);
+  }
+  bson_free(ranges);
+}
+
+/* return a copy of bound, or NULL if it's unbounded */
+static bson_t *
+copy_bound(const bson_t *bound)
+{
+  return bound == NULL ? NULL : bson_copy(bound);
+}
@@ -0,0 +1,441 @@
+/**
+ * Copyright (c) 2016 Tim Kuijsten
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "mongovi.h"
+
+#define GREPHITS 10       /* default number of documents to stop after */
+#define GREPTIMEOUT 2000  /* default maxTimeMS per collection */
+#define GREPSAMPLE 100    /* documents sampled to find the fields of a collection */
+#define GREPDEPTH 3       /* maximum depth of sampled fields */
+#define MAXGREPFIELDS 64  /* maximum number of fields searched per collection */
+#define MAXFIELD 256      /* maximum length of a dotted field name */
+
+struct grepcfg {
+  int sample;       /* search sampled fields instead of indexed fields */
+  long hits;
+  long timeout;
+  long parallel;
+  const char *value;
+  const char *glob;
+};
+
+/* state shared by the workers of one grep */
+struct grep {
+  const struct grepcfg *cfg;
+  const path_t *ns;
+  bson_t values;    /* the value as string and, if it parses as such, number and object id */
+  FILE *out;        /* output stream of the calling thread */
+  pthread_mutex_t mtx;
+  long hits;
+};
+
+/* field names of one collection */
+struct fields {
+  char names[MAXGREPFIELDS][MAXFIELD];
+  int n;
+};
+
+static int parse_grep_opts(const char *line, struct grepcfg *cfg, Tokenizer *t);
+static void grep_values(const char *value, bson_t *values);
+static int grep_worker(mongoc_client_t *client, void *arg, size_t i);
+static int indexed_fields(mongoc_collection_t *coll, struct fields *f);
+static int sampled_fields(mongoc_collection_t *coll, long timeout, struct fields *f);
+static void add_fields(struct fields *f, const bson_t *doc, const char *prefix, int depth);
+static void add_field(struct fields *f, const char *name);
+
+/*
+ * Search for a value in every collection that matches a glob, by default all
+ * collections in the current database, or all collections if no database is
+ * selected. The value is searched in the indexed fields of every collection,
+ * or with -s in the fields of a sample of its documents. Collections are
+ * searched concurrently with a maxTimeMS per query, and the search stops after
+ * a number of hits. Every hit is printed preceded by its namespace.
+ *
+ * return 0 on success, -1 on failure
+ */
+int
+exec_grep(const path_t *cwd, const char *line)
+{
+  struct grepcfg cfg;
+  struct grep g;
+  mongoc_client_t *client;
+  Tokenizer *t;
+  path_t pattern, *ns;
+  size_t n;
+  int ret;
+
+  t = tok_init(NULL);
+  if (parse_grep_opts(line, &cfg, t) == -1) {
+    warnx("usage: grep [-s] [-n hits] [-t ms] [-p 1..%d] value [glob]", MAXWORKERS);
+    tok_end(t);
+    return -1;
+  }
+
+  /* search the current database or everything by default */
+  pattern = *cwd;
+  pattern.collname[0] = '\0';
+  if (cfg.glob == NULL)
+    cfg.glob = strlen(pattern.dbname) ? "*" : "/*/*";
+  if (parse_path(cfg.glob, &pattern, NULL, NULL) < 0 || !strlen(pattern.dbname)) {
+    warnx("illegal glob: %s", cfg.glob);
+    tok_end(t);
+    return -1;
+  }
+  if (!strlen(pattern.collname))
+    strlcpy(pattern.collname, "*", MAXCOLLNAME);
+
+  client = mongoc_client_pool_pop(get_pool());
+  ret = match_namespaces(client, &pattern, &ns, &n);
+  mongoc_client_pool_push(get_pool(), client);
+  if (ret == -1) {
+    tok_end(t);
+    return -1;
+  }
+
+  g.cfg = &cfg;
+  g.ns = ns;
+  g.hits = 0;
+  g.out = outfp();
+  bson_init(&g.values);
+  grep_values(cfg.value, &g.values);
+  if (pthread_mutex_init(&g.mtx, NULL) != 0)
+    errx(1, "exec_grep: can't initialize mutex");
+
+  ret = fanout(grep_worker, &g, n, cfg.parallel);
+
+  if (interrupted) {
+    warnx("interrupted");
+    ret = -1;
+  }
+
+  pthread_mutex_destroy(&g.mtx);
+  bson_destroy(&g.values);
+  free(ns);
+  tok_end(t);
+
+  return ret;
+}
+
+/*
+ * Parse the options, value and glob of grep. The strings in cfg point into the
+ * tokenizer t.
+ *
+ * return 0 on success, -1 on failure
+ */
+static int
+parse_grep_opts(const char *line, struct grepcfg *cfg, Tokenizer *t)
+{
+  const char **av;
+  char *end;
+  long val;
+  int ac, i;
+
+  cfg->sample = 0;
+  cfg->hits = GREPHITS;
+  cfg->timeout = GREPTIMEOUT;
+  cfg->parallel = GLOBWORKERS;
+  cfg->value = NULL;
+  cfg->glob = NULL;
+
+  if (tok_str(t, line, &ac, &av) != 0)
+    return -1;
+
+  for (i = 0; i < ac && av[i][0] == '-' && strlen(av[i]) == 2; i++) {
+    if (av[i][1] == 's') {
+      cfg->sample = 1;
+      continue;
+    }
+
+    if (i + 1 == ac)
+      return -1;
+    val = strtol(av[++i], &end, 10);
+    if (*end != '\0' || val < 1 || val > INT_MAX)
+      return -1;
+
+    switch (av[i - 1][1]) {
+    case 'n':
+      cfg->hits = val;
+      break;
+    case 't':
+      cfg->timeout = val;
+      break;
+    case 'p':
+      if (val > MAXWORKERS)
+        return -1;
+      cfg->parallel = val;
+      break;
+    default:
+      return -1;
+    }
+  }
+
+  if (i == ac || ac - i > 2)
+    return -1;
+
+  cfg->value = av[i];
+  if (i + 1 < ac)
+    cfg->glob = av[i + 1];
+
+  return 0;
+}
+
+/*
+ * Build the array of values to search for: the string itself and, if it is a
+ * number or an object id, that as well.
+ */
+static void
+grep_values(const char *value, bson_t *values)
+{
+  bson_t arr;
+  bson_oid_t oid;
+  char *end;
+  long long num;
+
+  bson_append_array_begin(values, "$in", -1, &arr);
+  BSON_APPEND_UTF8(&arr, "0", value);
+
+  errno = 0;
+  num = strtoll(value, &end, 10);
+  if (*value != '\0' && *end == '\0' && errno == 0) {
+    if (num >= INT32_MIN && num <= INT32_MAX)
+      BSON_APPEND_INT32(&arr, "1", num);
+    else
+      BSON_APPEND_INT64(&arr, "1", num);
+  } else if (strlen(value) == 24 && bson_oid_is_valid(value, 24)) {
+    bson_oid_init_from_string(&oid, value);
+    BSON_APPEND_OID(&arr, "1", &oid);
+  }
+
+  bson_append_array_end(values, &arr);
+}
+
+/*
+ * Search the i'th namespace of the grep in arg for the value in all its
+ * indexed or sampled fields. Runs on a fanout worker.
+ *
+ * return 0 on success, -1 on failure
+ */
+static int
+grep_worker(mongoc_client_t *client, void *arg, size_t i)
+{
+  struct grep *g = arg;
+  const path_t *ns = &g->ns[i];
+  mongoc_collection_t *coll;
+  mongoc_cursor_t *cursor;
+  bson_error_t error;
+  struct fields f;
+  const bson_t *doc;
+  bson_t query, or, cond, opts;
+  char key[16], *str;
+  long remaining;
+  int j, ret;
+
+  pthread_mutex_lock(&g->mtx);
+  remaining = g->cfg->hits - g->hits;
+  pthread_mutex_unlock(&g->mtx);
+  if (remaining <= 0 || interrupted)
+    return 0;
+
+  coll = mongoc_client_get_collection(client, ns->dbname, ns->collname);
+
+  f.n = 0;
+  if (g->cfg->sample)
+    ret = sampled_fields(coll, g->cfg->timeout, &f);
+  else
+    ret = indexed_fields(coll, &f);
+  if (ret == -1 || f.n == 0) {
+    if (ret == -1)
+      warnx("/%s/%s: can't determine fields", ns->dbname, ns->collname);
+    mongoc_collection_destroy(coll);
+    return ret;
+  }
+
+  /* { $or: [ { field: { $in: values } }, ... ] } */
+  bson_init(&query);
+  bson_append_array_begin(&query, "$or", -1, &or);
+  for (j = 0; j < f.n; j++) {
+    snprintf(key, sizeof(key), "%d", j);
+    bson_append_document_begin(&or, key, -1, &cond);
+    bson_append_document(&cond, f.names[j], -1, &g->values);
+    bson_append_document_end(&or, &cond);
+  }
+  bson_append_array_end(&query, &or);
+
+  bson_init(&opts);
+  BSON_APPEND_INT64(&opts, "limit", remaining);
+  BSON_APPEND_INT64(&opts, "maxTimeMS", g->cfg->timeout);
+
+  ret = 0;
+  cursor = mongoc_collection_find_with_opts(coll, &query, &opts, NULL);
+  while (!interrupted && mongoc_cursor_next(cursor, &doc)) {
+    str = bson_as_json(doc, NULL);
+    pthread_mutex_lock(&g->mtx);
+    if (g->hits < g->cfg->hits) {
+      fprintf(g->out, "/%s/%s %s\n", ns->dbname, ns->collname, str);
+      g->hits++;
+    }
+    remaining = g->cfg->hits - g->hits;
+    pthread_mutex_unlock(&g->mtx);
+    bson_free(str);
+    if (remaining <= 0)
+      break;
+  }
+  if (mongoc_cursor_error(cursor, &error)) {
+    warnx("/%s/%s: %d.%d %s", ns->dbname, ns->collname, error.domain, error.code, error.message);
+    ret = -1;
+  }
+
+  mongoc_cursor_destroy(cursor);
+  bson_destroy(&opts);
+  bson_destroy(&query);
+  mongoc_collection_destroy(coll);
+
+  return ret;
+}
+
+/*
+ * Collect the first field of every index that supports equality matches, the
+ * other fields of a compound index can't be used on their own. _id is always
+ * included.
+ *
+ * return 0 on success, -1 on failure
+ */
+static int
+indexed_fields(mongoc_collection_t *coll, struct fields *f)
+{
+  mongoc_cursor_t *cursor;
+  bson_error_t error;
+  bson_iter_t it, key;
+  const bson_t *doc;
+  const char *prefix;
+  int special, ret;
+
+  add_field(f, "_id");
+
+  cursor = mongoc_collection_find_indexes_with_opts(coll, NULL);
+  while (mongoc_cursor_next(cursor, &doc)) {
+    if (!bson_iter_init_find(&it, doc, "key") || !BSON_ITER_HOLDS_DOCUMENT(&it) ||
+        !bson_iter_recurse(&it, &key))
+      continue;
+    prefix = NULL;
+    special = 0;
+    /* text, geo and wildcard indexes don't index the value itself */
+    while (bson_iter_next(&key)) {
+      if (prefix == NULL)
+        prefix = bson_iter_key(&key);
+      if (strchr(bson_iter_key(&key), '$') != NULL || (BSON_ITER_HOLDS_UTF8(&key) &&
+          strcmp(bson_iter_utf8(&key, NULL), "hashed") != 0))
+        special = 1;
+    }
+    if (prefix != NULL && !special)
+      add_field(f, prefix);
+  }
+
+  ret = 0;
+  if (mongoc_cursor_error(cursor, &error)) {
+    warnx("%d.%d %s", error.domain, error.code, error.message);
+    ret = -1;
+  }
+  mongoc_cursor_destroy(cursor);
+
+  return ret;
+}
+
+/*
+ * Collect the fields of a random sample of documents, including those of
+ * embedded documents up to GREPDEPTH levels deep.
+ *
+ * return 0 on success, -1 on failure
+ */
+static int
+sampled_fields(mongoc_collection_t *coll, long timeout, struct fields *f)
+{
+  mongoc_cursor_t *cursor;
+  bson_error_t error;
+  const bson_t *doc;
+  bson_t *pipeline, *opts;
+  int ret;
+
+  pipeline = BCON_NEW("pipeline", "[", "{", "$sample", "{", "size", BCON_INT32(GREPSAMPLE), "}",
+      "}", "]");
+  opts = BCON_NEW("maxTimeMS", BCON_INT64(timeout));
+
+  cursor = mongoc_collection_aggregate(coll, MONGOC_QUERY_NONE, pipeline, opts, NULL);
+  while (mongoc_cursor_next(cursor, &doc))
+    add_fields(f, doc, "", 1);
+
+  ret = 0;
+  if (mongoc_cursor_error(cursor, &error)) {
+    warnx("%d.%d %s", error.domain, error.code, error.message);
+    ret = -1;
+  }
+
+  mongoc_cursor_destroy(cursor);
+  bson_destroy(opts);
+  bson_destroy(pipeline);
+
+  return ret;
+}
+
+/* add every field of doc, dotted with prefix, recurse into embedded documents */
+static void
+add_fields(struct fields *f, const bson_t *doc, const char *prefix, int depth)
+{
+  bson_iter_t it;
+  bson_t sub;
+  const uint8_t *data;
+  uint32_t len;
+  char name[MAXFIELD];
+
+  if (!bson_iter_init(&it, doc))
+    return;
+
+  while (bson_iter_next(&it)) {
+    if (snprintf(name, sizeof(name), "%s%s", prefix, bson_iter_key(&it)) >= (int)sizeof(name))
+      continue;
+
+    if (BSON_ITER_HOLDS_DOCUMENT(&it)) {
+      if (depth < GREPDEPTH) {
+        bson_iter_document(&it, &len, &data);
+        if (bson_init_static(&sub, data, len)) {
+          strlcat(name, ".", sizeof(name));
+          add_fields(f, &sub, name, depth + 1);
+        }
+      }
+      continue;
+    }
+
+    add_field(f, name);
+  }
+}
+
+/* add name to f unless it's already there or f is full */
+static void
+add_field(struct fields *f, const char *name)
+{
+  int i;
+
+  for (i = 0; i < f->n; i++)
+    if (strcmp(f->names[i], name) == 0)
+      return;
+
+  if (f->n == MAXGREPFIELDS)
+    return;
+
+  if (strlcpy(f->names[f->n], name, MAXFIELD) >= MAXFIELD)
+    return;
+  f->n++;
+}
@@ -0,0 +1,738 @@
+/**
+ * Copyright (c) 2016 Tim Kuijsten
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "mongovi.h"
+
+#include <sys/mman.h>
+
+#define MAXKEYS 16              /* maximum number of fields in an upsert key */
+#define CHECKPOINTIVAL 1000000  /* minimum microseconds between checkpoints */
+
+/* state of one import */
+struct import {
+  const import_t *cfg;
+  mongoc_collection_t *collection;
+  mongoc_bulk_operation_t *bulk;
+  const char *keys[MAXKEYS];
+  int nkeys;
+  int upsert;           /* match on keys instead of inserting */
+  bson_t *update;       /* update document of IMPORTUPDATE */
+  unsigned char *json;  /* strict json of the current line */
+  size_t jsonsize;
+  jsmntok_t *tokens;    /* parsed tokens of the current line */
+  unsigned int ntokens;
+  int64_t offset;       /* input bytes consumed */
+  int64_t line;         /* current input line */
+  int64_t queued;       /* operations in the current bulk */
+  int64_t lastcp;       /* time of the last checkpoint */
+};
+
+static int import_mapped(struct import *im, FILE *fp, off_t size);
+static int import_compressed(struct import *im, int fd, int method, const unsigned char *prefix, size_t prefixlen);
+static int import_stream(struct import *im, FILE *fp, const unsigned char *prefix, size_t prefixlen);
+static int import_buffer(struct import *im, const char *buf, size_t size);
+static int import_line(struct import *im, const char *line, size_t len);
+static int split_keys(struct import *im, char *keys);
+static int parse_update(struct import *im, const char *update);
+static int parse_line(struct import *im, const char *line, size_t len);
+static int queue_doc(struct import *im, const bson_t *doc);
+static int key_selector(struct import *im, const bson_t *doc, bson_t *sel);
+static int flush_bulk(struct import *im);
+static int read_checkpoint(const char *file, int64_t *offset, int64_t *line);
+static int write_checkpoint(struct import *im, int force);
+static int skip_input(FILE *fp, int64_t offset);
+static ssize_t read_magic(int fd, unsigned char *buf, size_t n);
+static int isblankchar(char c);
+
+/*
+ * Read one JSON document per line from fp and write every document into
+ * collection. Documents are inserted, or if cfg->upsertkey or cfg->replace is
+ * set, matched on the fields in cfg->upsertkey, or on _id if not set, and
+ * either replaced as a whole or updated field by field. Operations are sent in
+ * unordered bulks of IMPORTBULK operations.
+ *
+ * If cfg->mode is IMPORTREMOVE or IMPORTUPDATE every line is a selector or a
+ * bare id instead, and all matching documents are removed or updated with
+ * cfg->update.
+ *
+ * If cfg->checkpoint is set, the input offset and line number after the last
+ * acknowledged bulk are written to it. If cfg->resume is set as well, input up
+ * to the offset in the checkpoint is skipped.
+ *
+ * gzip and zstd compressed input is detected and decompressed on a separate
+ * thread, offsets are those of the decompressed input.
+ *
+ * return 0 if every document was written, -1 otherwise, which includes a lost
+ * bulk
+ */
+int
+exec_import(mongoc_collection_t *collection, FILE *fp, const import_t *cfg)
+{
+  struct import im;
+  struct stat st;
+  unsigned char magic[4];
+  ssize_t nmagic;
+  char *keys;
+  int fd, isreg, method, lost;
+
+  lost = 0;
+  memset(&im, 0, sizeof(im));
+  im.cfg = cfg;
+  im.collection = collection;
+  im.upsert = cfg->upsertkey != NULL || cfg->replace;
+
+  if (cfg->resume) {
+    if (read_checkpoint(cfg->checkpoint, &im.offset, &im.line) == -1)
+      return -1;
+    progress_add(&progress.bytes, im.offset);
+    progress_add(&progress.skipped, im.offset);
+  }
+
+  if ((keys = strdup(cfg->upsertkey ? cfg->upsertkey : "_id")) == NULL)
+    err(1, "exec_import");
+  if (split_keys(&im, keys) == -1) {
+    free(keys);
+    return -1;
+  }
+
+  /* grown by parse_line if a line needs more */
+  im.jsonsize = MAXDOC;
+  im.ntokens = TOKENS;
+  if ((im.json = malloc(im.jsonsize)) == NULL)
+    err(1, "exec_import");
+  if ((im.tokens = reallocarray(NULL, im.ntokens, sizeof(*im.tokens))) == NULL)
+    err(1, "exec_import");
+
+  if (cfg->mode == IMPORTUPDATE && parse_update(&im, cfg->update) == -1) {
+    free(im.tokens);
+    free(im.json);
+    free(keys);
+    return -1;
+  }
+
+  /*
+   * Regular files are peeked at, the magic bytes of other input are consumed
+   * and passed on. Uncompressed regular files are parsed in place.
+   */
+  fd = fileno(fp);
+  isreg = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+  if (isreg) {
+    nmagic = pread(fd, magic, sizeof(magic), 0);
+    method = detect_compression(magic, nmagic > 0 ? nmagic : 0);
+    nmagic = 0;
+  } else if ((nmagic = read_magic(fd, magic, sizeof(magic))) == -1) {
+    progress_add(&progress.errors, 1);
+    goto done;
+  } else {
+    method = detect_compression(magic, nmagic);
+  }
+
+  if (method != COMPNONE)
+    lost = import_compressed(&im, fd, method, magic, nmagic);
+  else if (isreg && st.st_size > 0)
+    lost = import_mapped(&im, fp, st.st_size);
+  else
+    lost = import_stream(&im, fp, magic, nmagic);
+
+  if (!lost && flush_bulk(&im) == 0)
+    write_checkpoint(&im, 1);
+  else
+    lost = 1;
+
+done:
+
+  /* a lost bulk may not show up as errors, the rest of the input is not read */
+  if (lost)
+    warnx("import stopped at line %lld", (long long)im.line);
+  if (interrupted)
+    warnx("interrupted");
+  if (progress.errors)
+    warnx("%lld documents written, %lld errors", (long long)progress.acked,
+        (long long)progress.errors);
+
+  if (im.update)
+    bson_destroy(im.update);
+  free(im.tokens);
+  free(im.json);
+  free(keys);
+
+  return lost || progress.errors || interrupted ? -1 : 0;
+}
+
+/*
+ * Map the file fp of size bytes and import every line in it, starting at
+ * im->offset. No line is copied before it is parsed. If the file can't be
+ * mapped, for example because it does not fit in the address space, it is read
+ * like any other stream.
+ *
+ * return 0 on success, -1 if a bulk is lost
+ */
+static int
+import_mapped(struct import *im, FILE *fp, off_t size)
+{
+  const char *map;
+  int ret;
+
+  if (im->offset > size) {
+    warnx("input ends before the checkpoint");
+    progress_add(&progress.errors, 1);
+    return 0;
+  }
+
+  if ((off_t)(size_t)size != size ||
+      (map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(fp), 0)) == MAP_FAILED)
+    return import_stream(im, fp, NULL, 0);
+  madvise((void *)map, size, MADV_SEQUENTIAL);
+
+  ret = import_buffer(im, map + im->offset, size - im->offset);
+
+  munmap((void *)map, size);
+
+  return ret;
+}
+
+/*
+ * Decompress fd with method on a separate thread and import every line of the
+ * output. prefix holds the first prefixlen bytes of fd that are already read.
+ *
+ * return 0 on success, -1 if a bulk is lost
+ */
+static int
+import_compressed(struct import *im, int fd, int method, const unsigned char *prefix,
+    size_t prefixlen)
+{
+  FILE *fp;
+  int pfd, ret;
+
+  if ((pfd = decompress_start(fd, method, prefix, prefixlen)) == -1) {
+    progress_add(&progress.errors, 1);
+    return 0;
+  }
+
+  if ((fp = fdopen(pfd, "r")) == NULL)
+    err(1, "import_compressed");
+
+  ret = import_stream(im, fp, NULL, 0);
+  fclose(fp);
+
+  /* the decompressor fails as well if the import stopped early */
+  if (decompress_end() == -1 && ret == 0 && !interrupted)
+    progress_add(&progress.errors, 1);
+
+  return ret;
+}
+
+/*
+ * Import every line read from fp, after skipping im->offset bytes. prefix holds
+ * the first prefixlen bytes of input that are already read from fp.
+ *
+ * return 0 on success, -1 if a bulk is lost
+ */
+static int
+import_stream(struct import *im, FILE *fp, const unsigned char *prefix, size_t prefixlen)
+{
+  char *line, *first;
+  size_t linesize, skip;
+  ssize_t len;
+  int ret;
+
+  skip = im->offset < (int64_t)prefixlen ? (size_t)im->offset : prefixlen;
+  prefix += skip;
+  prefixlen -= skip;
+  if (skip_input(fp, im->offset - skip) == -1) {
+    progress_add(&progress.errors, 1);
+    return 0;
+  }
+
+  ret = 0;
+  line = NULL;
+  linesize = 0;
+
+  /* complete the first line with the bytes that are already read */
+  if (prefixlen > 0) {
+    if ((len = getline(&line, &linesize, fp)) == -1)
+      len = 0;
+    if ((first = malloc(prefixlen + len)) == NULL)
+      err(1, "import_stream");
+    memcpy(first, prefix, prefixlen);
+    if (len > 0)
+      memcpy(first + prefixlen, line, len);
+    ret = import_buffer(im, first, prefixlen + len);
+    free(first);
+  }
+
+  while (ret == 0 && !interrupted && (len = getline(&line, &linesize, fp)) != -1)
+    ret = import_line(im, line, len);
+
+  if (ferror(fp)) {
+    warn("read error on line %lld", (long long)im->line + 1);
+    progress_add(&progress.errors, 1);
+  }
+
+  free(line);
+
+  return ret;
+}
+
+/*
+ * Import every line in buf of size bytes, the last line may lack a newline.
+ *
+ * return 0 on success, -1 if a bulk is lost
+ */
+static int
+import_buffer(struct import *im, const char *buf, size_t size)
+{
+  const char *line, *end, *nl;
+  size_t len;
+
+  end = buf + size;
+  for (line = buf; !interrupted && line < end; line += len) {
+    if ((nl = memchr(line, '\n', end - line)) != NULL)
+      len = nl - line + 1;
+    else
+      len = end - line;
+
+    if (import_line(im, line, len) == -1)
+      return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Parse one line of len bytes, which holds at most one document, and queue it.
+ * The bulk is sent when it is full.
+ *
+ * return 0 on success, -1 if a bulk is lost
+ */
+static int
+import_line(struct import *im, const char *line, size_t len)
+{
+  bson_error_t error;
+  bson_t *doc;
+  size_t i;
+
+  im->line++;
+  im->offset += len;
+  progress_add(&progress.bytes, len);
+
+  for (i = 0; i < len && isblankchar(line[i]); i++)
+    ;
+  if (i == len)
+    return 0;
+
+  if (parse_line(im, line + i, len - i) == -1) {
+    progress_add(&progress.errors, 1);
+    return 0;
+  }
+
+  if ((doc = bson_new_from_json(im->json, -1, &error)) == NULL) {
+    warnx("line %lld: %d.%d %s", (long long)im->line, error.domain, error.code, error.message);
+    progress_add(&progress.errors, 1);
+    return 0;
+  }
+  progress_add(&progress.parsed, 1);
+
+  if (queue_doc(im, doc) == -1)
+    progress_add(&progress.errors, 1);
+  bson_destroy(doc);
+
+  /* stop if a bulk is lost, the checkpoint must stay before it */
+  if (im->queued >= IMPORTBULK) {
+    if (flush_bulk(im) == -1)
+      return -1;
+    write_checkpoint(im, 0);
+  }
+
+  return 0;
+}
+
+/*
+ * Convert a line without leading blanks to strict json in im->json. In remove
+ * and update mode a line that does not start with a "{" is a bare id.
+ *
+ * The token array and im->json are doubled until the line fits. Every token
+ * spans at least one byte of the line and adds less than 16 bytes of quotes,
+ * separators and closing brackets, which bounds both.
+ *
+ * return 0 on success, -1 on failure
+ */
+static int
+parse_line(struct import *im, const char *line, size_t len)
+{
+  long r;
+
+  if (im->cfg->mode != IMPORTINSERT && line[0] != '{') {
+    while (len > 0 && isblankchar(line[len - 1]))
+      len--;
+    if (idtosel((char *)im->json, im->jsonsize, line, len) == -1) {
+      warnx("line %lld: invalid id", (long long)im->line);
+      return -1;
+    }
+    return 0;
+  }
+
+  /* every line holds exactly one document, no need to search its end */
+  for (;;) {
+    r = relaxed_to_strict_tokens(im->json, im->jsonsize, line, len, im->tokens, im->ntokens);
+    if (r == JSMN_ERROR_NOMEM && im->ntokens <= len && im->ntokens <= UINT_MAX / 2) {
+      im->ntokens *= 2;
+      if ((im->tokens = reallocarray(im->tokens, im->ntokens, sizeof(*im->tokens))) == NULL)
+        err(1, "parse_line");
+    } else if (r == -11 && im->jsonsize / 17 <= len + 1) {
+      im->jsonsize *= 2;
+      if ((im->json = realloc(im->json, im->jsonsize)) == NULL)
+        err(1, "parse_line");
+    } else {
+      break;
+    }
+  }
+  if (r <= 0) {
+    warnx("line %lld: jsonify error: %ld", (long long)im->line, r);
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Parse the update document that is applied to every selector in update mode.
+ *
+ * return 0 on success, -1 on failure
+ */
+static int
+parse_update(struct import *im, const char *update)
+{
+  bson_error_t error;
+  long r;
+
+  if ((r = relaxed_to_strict(im->json, im->jsonsize, update, strlen(update), 0)) <= 0) {
+    warnx("update document: jsonify error: %ld", r);
+    return -1;
+  }
+
+  if ((im->update = bson_new_from_json(im->json, -1, &error)) == NULL) {
+    warnx("update document: %d.%d %s", error.domain, error.code, error.message);
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Split a comma separated list of field names into im->keys. The names point
+ * into keys.
+ *
+ * return 0 on success, -1 on failure
+ */
+static int
+split_keys(struct import *im, char *keys)
+{
+  char *key;
+
+  im->nkeys = 0;
+  while ((key = strsep(&keys, ",")) != NULL) {
+    if (*key == '\0') {
+      warnx("empty field name in upsert key");
+      return -1;
+    }
+    if (im->nkeys == MAXKEYS) {
+      warnx("upsert key has more than %d fields", MAXKEYS);
+      return -1;
+    }
+    im->keys[im->nkeys++] = key;
+  }
+
+  return 0;
+}
+
+/*
+ * Add an insert, replace or update of doc to the current bulk, or in remove and
+ * update mode a removal or update of all documents matching the selector doc.
+ * Create a new bulk if needed.
+ *
+ * return 0 on success, -1 on failure
+ */
+static int
+queue_doc(struct import *im, const bson_t *doc)
+{
+  bson_error_t error;
+  bson_iter_t it;
+  bson_t sel, update, set, opts;
+  int ok;
+
+  bson_init(&sel);
+  if (im->upsert && key_selector(im, doc, &sel) == -1) {
+    bson_destroy(&sel);
+    return -1;
+  }
+
+  if (im->bulk == NULL) {
+    bson_init(&opts);
+    BSON_APPEND_BOOL(&opts, "ordered", false);
+    im->bulk = mongoc_collection_create_bulk_operation_with_opts(im->collection, &opts);
+    bson_destroy(&opts);
+  }
+
+  if (!im->upsert) {
+    if (im->cfg->mode == IMPORTREMOVE)
+      ok = mongoc_bulk_operation_remove_many_with_opts(im->bulk, doc, NULL, &error);
+    else if (im->cfg->mode == IMPORTUPDATE)
+      ok = mongoc_bulk_operation_update_many_with_opts(im->bulk, doc, im->update, NULL, &error);
+    else
+      ok = mongoc_bulk_operation_insert_with_opts(im->bulk, doc, NULL, &error);
+    bson_destroy(&sel);
+    if (!ok) {
+      warnx("line %lld: %d.%d %s", (long long)im->line, error.domain, error.code, error.message);
+      return -1;
+    }
+    im->queued++;
+    return 0;
+  }
+
+  bson_init(&opts);
+  BSON_APPEND_BOOL(&opts, "upsert", true);
+
+  if (im->cfg->replace) {
+    ok = mongoc_bulk_operation_replace_one_with_opts(im->bulk, &sel, doc, &opts, &error);
+  } else {
+    /* _id can't be changed, only set it on insert */
+    bson_init(&update);
+    BSON_APPEND_DOCUMENT_BEGIN(&update, "$set", &set);
+    if (!bson_iter_init(&it, doc))
+      errx(1, "queue_doc");
+    while (bson_iter_next(&it))
+      if (strcmp(bson_iter_key(&it), "_id") != 0)
+        bson_append_iter(&set, NULL, 0, &it);
+    bson_append_document_end(&update, &set);
+
+    if (bson_iter_init_find(&it, doc, "_id")) {
+      BSON_APPEND_DOCUMENT_BEGIN(&update, "$setOnInsert", &set);
+      bson_append_iter(&set, NULL, 0, &it);
+      bson_append_document_end(&update, &set);
+    }
+
+    ok = mongoc_bulk_operation_update_one_with_opts(im->bulk, &sel, &update, &opts, &error);
+    bson_destroy(&update);
+  }
+
+  bson_destroy(&opts);
+  bson_destroy(&sel);
+
+  if (!ok) {
+    warnx("line %lld: %d.%d %s", (long long)im->line, error.domain, error.code, error.message);
+    return -1;
+  }
+
+  im->queued++;
+
+  return 0;
+}
+
+/*
+ * Build a selector in sel that matches the value of every key field in doc.
+ * Field names may use dot notation.
+ *
+ * return 0 on success, -1 if doc lacks a key field
+ */
+static int
+key_selector(struct import *im, const bson_t *doc, bson_t *sel)
+{
+  bson_iter_t it, field;
+  int i;
+
+  for (i = 0; i < im->nkeys; i++) {
+    if (!bson_iter_init(&it, doc) || !bson_iter_find_descendant(&it, im->keys[i], &field)) {
+      warnx("line %lld: missing key field: %s", (long long)im->line, im->keys[i]);
+      return -1;
+    }
+    bson_append_iter(sel, im->keys[i], -1, &field);
+  }
+
+  return 0;
+}
+
+/*
+ * Execute and destroy the current bulk, if any. Write errors of single
+ * documents are counted and the first one is reported.
+ *
+ * return 0 if the server acknowledged the bulk, -1 if it is lost
+ */
+static int
+flush_bulk(struct import *im)
+{
+  bson_error_t error;
+  bson_iter_t it, errs;
+  bson_t reply;
+  int64_t nerrs, written;
+  int ret;
+
+  if (im->bulk == NULL)
+    return 0;
+
+  ret = 0;
+  if (!mongoc_bulk_operation_execute(im->bulk, &reply, &error)) {
+    warnx("bulk write failed: %d.%d %s", error.domain, error.code, error.message);
+    ret = -1;
+  }
+
+  written = bson_lookup_int64(&reply, "nInserted") + bson_lookup_int64(&reply, "nUpserted") +
+      bson_lookup_int64(&reply, "nMatched") + bson_lookup_int64(&reply, "nRemoved");
+  progress_add(&progress.acked, written);
+
+  /*
+   * The bulk is acknowledged if the server reported on single documents. The
+   * driver may split a bulk in batches, so writeErrors of an earlier batch
+   * don't tell that a later one arrived, unless the error is one of the server
+   * or every operation is accounted for.
+   */
+  nerrs = 0;
+  if (bson_iter_init_find(&it, &reply, "writeErrors") && BSON_ITER_HOLDS_ARRAY(&it) &&
+      bson_iter_recurse(&it, &errs))
+    while (bson_iter_next(&errs))
+      nerrs++;
+  if (ret == -1 && nerrs > 0 && (error.domain == MONGOC_ERROR_COMMAND ||
+      error.domain == MONGOC_ERROR_SERVER || written + nerrs >= im->queued))
+    ret = 0;
+  /* a selector can match any number of documents */
+  if (ret == -1)
+    nerrs = written < im->queued ? im->queued - written : 0;
+  progress_add(&progress.errors, nerrs);
+
+  bson_destroy(&reply);
+  mongoc_bulk_operation_destroy(im->bulk);
+  im->bulk = NULL;
+  im->queued = 0;
+
+  return ret;
+}
+
+/*
+ * Read the input offset and line number from a checkpoint file written by
+ * write_checkpoint.
+ *
+ * return 0 on success, -1 on failure
+ */
+static int
+read_checkpoint(const char *file, int64_t *offset, int64_t *line)
+{
+  FILE *fp;
+  long long o, l;
+  int n;
+
+  if ((fp = fopen(file, "r")) == NULL) {
+    warn("%s", file);
+    return -1;
+  }
+  n = fscanf(fp, "%lld %lld", &o, &l);
+  fclose(fp);
+
+  if (n != 2 || o < 0 || l < 0) {
+    warnx("%s: invalid checkpoint", file);
+    return -1;
+  }
+
+  *offset = o;
+  *line = l;
+
+  return 0;
+}
+
+/*
+ * Write the input offset and line number up to which every document is
+ * acknowledged to the checkpoint file, at most once every CHECKPOINTIVAL
+ * unless force is set.
+ *
+ * return 0 on success, -1 on failure
+ */
+static int
+write_checkpoint(struct import *im, int force)
+{
+  char buf[64];
+  int64_t now;
+
+  if (im->cfg->checkpoint == NULL)
+    return 0;
+
+  now = bson_get_monotonic_time();
+  if (!force && now - im->lastcp < CHECKPOINTIVAL)
+    return 0;
+  im->lastcp = now;
+
+  snprintf(buf, sizeof(buf), "%lld %lld", (long long)im->offset, (long long)im->line);
+  return replace_file(im->cfg->checkpoint, buf);
+}
+
+/*
+ * Skip offset bytes of input, seek if possible.
+ *
+ * return 0 on success, -1 on failure
+ */
+static int
+skip_input(FILE *fp, int64_t offset)
+{
+  char buf[BUFSIZ];
+  size_t n;
+
+  if (fseeko(fp, offset, SEEK_CUR) == 0)
+    return 0;
+
+  while (offset > 0) {
+    n = offset < (int64_t)sizeof(buf) ? (size_t)offset : sizeof(buf);
+    if ((n = fread(buf, 1, n, fp)) == 0) {
+      warnx("input ends before the checkpoint");
+      return -1;
+    }
+    offset -= n;
+  }
+
+  return 0;
+}
+
+/*
+ * Read the first n bytes of fd to detect compression, less if the input is
+ * shorter.
+ *
+ * return the number of bytes read or -1 on failure
+ */
+static ssize_t
+read_magic(int fd, unsigned char *buf, size_t n)
+{
+  size_t off;
+  ssize_t r;
+
+  for (off = 0; off < n; off += r) {
+    if ((r = read(fd, buf + off, n - off)) == -1) {
+      if (errno == EINTR) {
+        r = 0;
+        continue;
+      }
+      warn("read");
+      return -1;
+    }
+    if (r == 0)
+      break;
+  }
+
+  return off;
+}
+
+/* return whether c is a blank or line ending, strchr would match the nul too */
+static int
+isblankchar(char c)
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
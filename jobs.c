@@ -0,0 +1,351 @@
+/**
+ * Copyright (c) 2016 Tim Kuijsten
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "mongovi.h"
+
+#define JOBSTACK (16 * 1024 * 1024)   /* exec_* keep large buffers on the stack */
+#define FGPOLL 100000                 /* microseconds between checks of fg */
+
+enum jobstate { JRUNNING, JDONE, JFAILED, JKILLED };
+
+static const char *jobstates[] = { "running", "done", "failed", "killed" };
+
+/* a command running on its own thread and pooled client */
+struct job {
+  int id;                         /* job number, 0 if the slot is free */
+  int cmd;
+  char *cmdline;                  /* command as typed, shown by jobs */
+  char *args;                     /* arguments passed to the command */
+  path_t ns;
+  pthread_t thread;
+  FILE *out;                      /* output, printed by fg */
+  const timing_t *tm;             /* progress while running */
+  timing_t final;                 /* progress when finished */
+  enum jobstate state;
+  int notified;
+  volatile sig_atomic_t cancel;
+  int64_t start;
+  int64_t end;
+};
+
+static pthread_mutex_t jobsmtx = PTHREAD_MUTEX_INITIALIZER;
+static struct job jobs[MAXJOBS];
+static int lastjob = 0;
+
+static void *job_worker(void *arg);
+static struct job *find_job(const char *arg);
+static void print_job(struct job *j);
+static void free_job(struct job *j);
+
+/*
+ * Run cmd with args on collection ns in the background. Output of the command
+ * is kept until the job is brought to the foreground with fg.
+ *
+ * return the job number on success, -1 on failure
+ */
+int
+job_start(int cmd, const path_t *ns, const char *cmdline, const char *args)
+{
+  pthread_attr_t attr;
+  struct job *j;
+  int i;
+
+  j = NULL;
+  for (i = 0; i < MAXJOBS; i++)
+    if (jobs[i].id == 0) {
+      j = &jobs[i];
+      break;
+    }
+
+  if (j == NULL) {
+    warnx("too many jobs");
+    return -1;
+  }
+
+  memset(j, 0, sizeof(*j));
+  j->cmd = cmd;
+  j->ns = *ns;
+  j->state = JRUNNING;
+  if ((j->cmdline = strdup(cmdline)) == NULL)
+    err(1, "job_start");
+  if ((j->args = strdup(args)) == NULL)
+    err(1, "job_start");
+  if ((j->out = tmpfile()) == NULL) {
+    warn("job_start");
+    free(j->cmdline);
+    free(j->args);
+    return -1;
+  }
+
+  if (pthread_attr_init(&attr) != 0)
+    errx(1, "job_start: can't initialize thread attributes");
+  if (pthread_attr_setstacksize(&attr, JOBSTACK) != 0)
+    errx(1, "job_start: can't set stack size");
+
+  /* find the lowest free job number */
+  for (j->id = 1; ; j->id++) {
+    for (i = 0; i < MAXJOBS; i++)
+      if (&jobs[i] != j && jobs[i].id == j->id)
+        break;
+    if (i == MAXJOBS)
+      break;
+  }
+
+  j->start = bson_get_monotonic_time();
+  if (pthread_create(&j->thread, &attr, job_worker, j) != 0) {
+    warnx("job_start: can't create thread");
+    pthread_attr_destroy(&attr);
+    fclose(j->out);
+    free(j->cmdline);
+    free(j->args);
+    j->id = 0;
+    return -1;
+  }
+  pthread_attr_destroy(&attr);
+
+  lastjob = j->id;
+  printf("[%d]\n", j->id);
+
+  return j->id;
+}
+
+static void *
+job_worker(void *arg)
+{
+  struct job *j = arg;
+  mongoc_client_t *client;
+  mongoc_collection_t *coll;
+  int ret;
+
+  thread_init(0);
+  thread_job(j->out, &j->cancel);
+
+  pthread_mutex_lock(&jobsmtx);
+  j->tm = thread_timing();
+  pthread_mutex_unlock(&jobsmtx);
+
+  client = mongoc_client_pool_pop(get_pool());
+  coll = mongoc_client_get_collection(client, j->ns.dbname, j->ns.collname);
+
+  ret = exec_collcmd(&j->ns, coll, j->cmd, j->args, strlen(j->args));
+  fflush(j->out);
+
+  mongoc_collection_destroy(coll);
+  mongoc_client_pool_push(get_pool(), client);
+
+  /* thread local timing is gone after this thread exits */
+  pthread_mutex_lock(&jobsmtx);
+  j->final = *j->tm;
+  read_counts(j->tm, &j->final.docs, &j->final.bytes);
+  j->tm = NULL;
+  j->end = bson_get_monotonic_time();
+  if (j->cancel)
+    j->state = JKILLED;
+  else
+    j->state = ret == 0 ? JDONE : JFAILED;
+  pthread_mutex_unlock(&jobsmtx);
+
+  thread_end();
+
+  return NULL;
+}
+
+/* list all jobs with their progress */
+int
+exec_jobs(void)
+{
+  int i;
+
+  for (i = 0; i < MAXJOBS; i++)
+    if (jobs[i].id)
+      print_job(&jobs[i]);
+
+  return 0;
+}
+
+/*
+ * Wait for a job to finish and print its output. Without arg the most recently
+ * started job is used. ^C stops waiting but leaves the job running.
+ *
+ * return 0 on success, -1 on failure
+ */
+int
+exec_fg(const char *arg)
+{
+  struct job *j;
+  char buf[BUFSIZ];
+  size_t n;
+
+  if ((j = find_job(arg)) == NULL)
+    return -1;
+
+  for (;;) {
+    pthread_mutex_lock(&jobsmtx);
+    if (j->state != JRUNNING) {
+      pthread_mutex_unlock(&jobsmtx);
+      break;
+    }
+    pthread_mutex_unlock(&jobsmtx);
+
+    if (interrupted)
+      return 0;
+    usleep(FGPOLL);
+  }
+
+  /* jobs_notify already joined a job it reported */
+  if (!j->notified)
+    pthread_join(j->thread, NULL);
+
+  rewind(j->out);
+  while ((n = fread(buf, 1, sizeof(buf), j->out)) > 0)
+    fwrite(buf, 1, n, stdout);
+
+  print_job(j);
+  free_job(j);
+
+  return 0;
+}
+
+/*
+ * Stop a job. Cursor loops stop at the next document, a single running server
+ * operation is finished first.
+ *
+ * return 0 on success, -1 on failure
+ */
+int
+exec_kill(const char *arg)
+{
+  struct job *j;
+
+  if (arg == NULL) {
+    warnx("usage: kill %%job");
+    return -1;
+  }
+
+  if ((j = find_job(arg)) == NULL)
+    return -1;
+
+  j->cancel = 1;
+
+  return 0;
+}
+
+/* report jobs that finished since the last call, free those without output */
+void
+jobs_notify(void)
+{
+  struct job *j;
+  int i;
+
+  for (i = 0; i < MAXJOBS; i++) {
+    j = &jobs[i];
+    if (j->id == 0 || j->notified)
+      continue;
+
+    pthread_mutex_lock(&jobsmtx);
+    if (j->state == JRUNNING) {
+      pthread_mutex_unlock(&jobsmtx);
+      continue;
+    }
+    pthread_mutex_unlock(&jobsmtx);
+
+    print_job(j);
+    j->notified = 1;
+
+    pthread_join(j->thread, NULL);
+    if (ftell(j->out) == 0)
+      free_job(j);
+  }
+}
+
+/* stop all jobs and wait for them to finish */
+void
+jobs_end(void)
+{
+  int i;
+
+  for (i = 0; i < MAXJOBS; i++)
+    if (jobs[i].id)
+      jobs[i].cancel = 1;
+
+  for (i = 0; i < MAXJOBS; i++)
+    if (jobs[i].id) {
+      if (!jobs[i].notified)
+        pthread_join(jobs[i].thread, NULL);
+      free_job(&jobs[i]);
+    }
+}
+
+/* find a job by "%n" or "n", or the most recent job if arg is NULL */
+static struct job *
+find_job(const char *arg)
+{
+  char *end;
+  long id;
+  int i;
+
+  if (arg == NULL) {
+    id = lastjob;
+  } else {
+    if (arg[0] == '%')
+      arg++;
+    id = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0') {
+      warnx("illegal job: %s", arg);
+      return NULL;
+    }
+  }
+
+  for (i = 0; i < MAXJOBS; i++)
+    if (jobs[i].id && jobs[i].id == id)
+      return &jobs[i];
+
+  warnx("no such job");
+  return NULL;
+}
+
+static void
+print_job(struct job *j)
+{
+  enum jobstate state;
+  int64_t docs, bytes, end;
+
+  /* the worker is still counting, read_counts locks against it */
+  pthread_mutex_lock(&jobsmtx);
+  state = j->state;
+  if (state == JRUNNING) {
+    docs = 0;
+    if (j->tm)
+      read_counts(j->tm, &docs, &bytes);
+    end = bson_get_monotonic_time();
+  } else {
+    docs = j->final.docs;
+    end = j->end;
+  }
+  pthread_mutex_unlock(&jobsmtx);
+
+  printf("[%d] %-7s %8.1fs %10lld docs  %s\n", j->id, jobstates[state],
+      (end - j->start) / 1e6, (long long)docs, j->cmdline);
+}
+
+static void
+free_job(struct job *j)
+{
+  fclose(j->out);
+  free(j->cmdline);
+  free(j->args);
+  j->id = 0;
+}
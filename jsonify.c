@@ -16,18 +16,22 @@
 
 #include "jsonify.h"
 
-static int sp = 0;
-static int stack[MAXSTACK];
-static char closesym[MAXSTACK];
+/* state is per thread so that documents can be converted concurrently */
+static __thread int sp = 0;
+static __thread int stackbuf[MAXSTACK];
+static __thread int *stack = NULL;      /* stackbuf or, if that is full, malloced */
+static __thread size_t stacksize = 0;
+static __thread char closesym[MAXSTACK];
 
-static unsigned char *out;
-static size_t outsize;
-static size_t outidx = 0;
+static __thread unsigned char *out;
+static __thread size_t outsize;
+static __thread size_t outidx = 0;
 
 static int iterate(const char *src, jsmntok_t *tokens, int nrtokens, int (*iterator)(jsmntok_t *, char *, int, int, char *));
 static int strict_writer(jsmntok_t *tok, char *key, int depth, int ndepth, char *closesym);
 static int human_readable_writer(jsmntok_t *tok, char *key, int depth, int ndepth, char *closesym);
 static int addout(char *src, size_t size);
+static void drop_stack(void);
 static int pop();
 static int push(int val);
 
@@ -127,6 +131,42 @@ relaxed_to_strict(unsigned char *dst, size_t dstsize, const char *src, size_t sr
   return i;
 }
 
+/*
+ * Like relaxed_to_strict on all of src, but parse into the ntokens tokens
+ * provided by the caller instead of at most TOKENS on the stack, so documents
+ * of any size can be converted.
+ *
+ * return srcsize or < 0 on error, see relaxed_to_strict
+ */
+long
+relaxed_to_strict_tokens(unsigned char *dst, size_t dstsize, const char *src, size_t srcsize,
+    jsmntok_t *tokens, unsigned int ntokens)
+{
+  jsmn_parser parser;
+  int nrtokens;
+
+  if (srcsize > LONG_MAX)
+    return -10;
+
+  if (dstsize < 1)
+    return -11;
+
+  jsmn_init(&parser);
+  nrtokens = jsmn_parse(&parser, src, srcsize, tokens, ntokens);
+
+  if (nrtokens <= 0)
+    return nrtokens;
+
+  out = dst;
+  outsize = dstsize;
+  out[0] = '\0';
+  outidx = 0;
+  if (iterate(src, tokens, nrtokens, (int (*)(jsmntok_t *, char *, int, int, char *))strict_writer) == -1)
+    return -11;
+
+  return srcsize;
+}
+
 static int
 iterate(const char *src, jsmntok_t *tokens, int nrtokens, int (*iterator)(jsmntok_t *, char *, int, int, char *))
 {
@@ -136,6 +176,7 @@ iterate(const char *src, jsmntok_t *tokens, int nrtokens, int (*iterator)(jsmnto
   int depth, ndepth;
 
   depth = ndepth = 0;
+  sp = 0;
 
   for (i = 0; i < nrtokens; i++) {
     tok = &tokens[i];
@@ -176,10 +217,12 @@ iterate(const char *src, jsmntok_t *tokens, int nrtokens, int (*iterator)(jsmnto
     if (outidx < outsize) {
       if (iterator(tok, key, depth, ndepth, closesym) < 0) {
         free(key);
+        drop_stack();
         return -1;
       }
     } else {
       free(key);
+      drop_stack();
       return -1;
     }
 
@@ -188,6 +231,8 @@ iterate(const char *src, jsmntok_t *tokens, int nrtokens, int (*iterator)(jsmnto
     free(key);
   }
 
+  drop_stack();
+
   return 0;
 }
 
@@ -339,6 +384,15 @@ addout(char *src, size_t size)
   return 0;
 }
 
+/* free a stack that outgrew stackbuf, only the small one is kept per thread */
+static void
+drop_stack(void)
+{
+  if (stack != stackbuf)
+    free(stack);
+  stack = NULL;
+}
+
 /* pop item from the stack */
 /* return item on the stack on success, -1 on error */
 static int
@@ -354,10 +408,29 @@ pop()
 static int
 push(int val)
 {
+  int *p;
+
   if (val == -1) /* don't support -1 values, reserved for errors */
     return -1;
-  if (sp == MAXSTACK)
-    return -1;
+
+  if (stack == NULL) {
+    stack = stackbuf;
+    stacksize = MAXSTACK;
+  }
+
+  /* every element of an open array or object takes a slot, grow as needed */
+  if ((size_t)sp == stacksize) {
+    if (stacksize > INT_MAX / 2)
+      return -1;
+    if ((p = malloc(stacksize * 2 * sizeof(*stack))) == NULL)
+      return -1;
+    memcpy(p, stack, stacksize * sizeof(*stack));
+    if (stack != stackbuf)
+      free(stack);
+    stack = p;
+    stacksize *= 2;
+  }
+
   stack[sp++] = val;
   return 0;
 }
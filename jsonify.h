@@ -31,5 +31,6 @@
 
 long human_readable(unsigned char *dst, size_t dstsize, const char *src, size_t srcsize);
 long relaxed_to_strict(unsigned char *dst, size_t dstsize, const char *src, size_t srcsize, int firstonly);
+long relaxed_to_strict_tokens(unsigned char *dst, size_t dstsize, const char *src, size_t srcsize, jsmntok_t *tokens, unsigned int ntokens);
 
 #endif
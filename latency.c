@@ -0,0 +1,137 @@
+/**
+ * Copyright (c) 2016 Tim Kuijsten
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "latency.h"
+
+#include <string.h>
+
+void
+latency_init(latency_t *lat)
+{
+  memset(lat, 0, sizeof(*lat));
+}
+
+/*
+ * Record one value, negative values are recorded as 0.
+ */
+void
+latency_add(latency_t *lat, int64_t val)
+{
+  if (val < 0)
+    val = 0;
+
+  lat->counts[latency_bucket(val)]++;
+  lat->n++;
+  lat->sum += val;
+  if (val > lat->max)
+    lat->max = val;
+}
+
+/*
+ * Add all values recorded in src to dst.
+ */
+void
+latency_merge(latency_t *dst, const latency_t *src)
+{
+  int i;
+
+  for (i = 0; i < LATBUCKETS; i++)
+    dst->counts[i] += src->counts[i];
+
+  dst->n += src->n;
+  dst->sum += src->sum;
+  if (src->max > dst->max)
+    dst->max = src->max;
+}
+
+/*
+ * Return the value below which pct percent of all recorded values fall, pct
+ * must be in the range [0, 100]. The returned value is the upper bound of the
+ * bucket that contains the percentile, but never more than the maximum
+ * recorded value. Return 0 if nothing is recorded.
+ */
+int64_t
+latency_pct(const latency_t *lat, double pct)
+{
+  uint64_t rank, seen;
+  int64_t upper;
+  int i;
+
+  if (lat->n == 0)
+    return 0;
+
+  if (pct < 0)
+    pct = 0;
+  if (pct > 100)
+    pct = 100;
+
+  /* rank of the value in the sorted list of values, starting at 1 */
+  rank = (uint64_t)(pct / 100 * lat->n + 0.5);
+  if (rank < 1)
+    rank = 1;
+
+  seen = 0;
+  for (i = 0; i < LATBUCKETS; i++) {
+    seen += lat->counts[i];
+    if (seen >= rank)
+      break;
+  }
+
+  upper = latency_upper(i);
+
+  return upper < lat->max ? upper : lat->max;
+}
+
+/*
+ * Return the bucket index of val, val must be >= 0.
+ *
+ * Values smaller than 2^LATSUBBITS each have their own bucket. Larger values
+ * are put in one of the 2^LATSUBBITS buckets of the power of two they are in.
+ */
+int
+latency_bucket(int64_t val)
+{
+  int e;
+
+  if (val < (1 << LATSUBBITS))
+    return val;
+
+  /* position of the highest bit */
+  for (e = LATSUBBITS; e < 62 && (val >> (e + 1)) > 0; e++)
+    ;
+
+  return ((e - LATSUBBITS + 1) << LATSUBBITS) +
+    ((val >> (e - LATSUBBITS)) & ((1 << LATSUBBITS) - 1));
+}
+
+/*
+ * Return the largest value that is stored in the given bucket.
+ */
+int64_t
+latency_upper(int bucket)
+{
+  int e, sub;
+
+  if (bucket < (1 << LATSUBBITS))
+    return bucket;
+
+  e = (bucket >> LATSUBBITS) + LATSUBBITS - 1;
+  sub = bucket & ((1 << LATSUBBITS) - 1);
+
+  /* lower bound plus bucket width minus one, written so it can't overflow */
+  return ((((int64_t)1 << LATSUBBITS) + sub) << (e - LATSUBBITS)) +
+    (((int64_t)1 << (e - LATSUBBITS)) - 1);
+}
@@ -0,0 +1,44 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+/**
+ * Copyright (c) 2016 Tim Kuijsten
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+
+/*
+ * Log-linear latency histogram. Every power of two is split into 2^LATSUBBITS
+ * linear buckets, so a percentile is accurate to within 1 / 2^LATSUBBITS of
+ * its value.
+ */
+#define LATSUBBITS 4
+#define LATBUCKETS ((64 - LATSUBBITS) << LATSUBBITS)
+
+typedef struct {
+  uint64_t counts[LATBUCKETS];
+  uint64_t n;
+  int64_t max;
+  int64_t sum;
+} latency_t;
+
+void latency_init(latency_t *lat);
+void latency_add(latency_t *lat, int64_t val);
+void latency_merge(latency_t *dst, const latency_t *src);
+int64_t latency_pct(const latency_t *lat, double pct);
+int latency_bucket(int64_t val);
+int64_t latency_upper(int bucket);
+
+#endif
@@ -20,9 +20,13 @@ static char progname[MAXPROG];
 
 static path_t path, prevpath;
 
-/* use as temporary one-time storage while building a query or query results */
+/* use as temporary one-time storage while building a query or query results,
+ * threads other than the main thread get their own buffer, see thread_init */
 static unsigned char tmpdocs[16 * 1024 * 1024];
-static unsigned char *tmpdoc = tmpdocs;
+static __thread unsigned char *tmpdoc = tmpdocs;
+
+/* don't print query results, used by benchmark workers */
+static __thread int quiet = 0;
 
 static user_t user;
 static config_t config;
@@ -30,36 +34,80 @@ static char **list_match = NULL; /* contains all ambiguous prefix_match commands
 
 static char pmpt[MAXPROMPT + 1] = "/> ";
 
+static char connect_url[MAXMONGOURL] = "mongodb://localhost:27017";
+
 static mongoc_client_t *client;
+static mongoc_client_pool_t *pool = NULL; /* lazily created, see get_pool */
+static pthread_mutex_t poolmtx = PTHREAD_MUTEX_INITIALIZER;
+static char appname[MAXAPPNAME]; /* identifies server operations of client */
 static mongoc_collection_t *ccoll = NULL; /* current collection */
 
+/* sort order of ls -l */
+static int lssort = LSNAME;
+static int lsreverse = 0;
+
  /* print human readable or not */
 int hr = 0;
-/* import mode, treat input lines as json documents force insert command */
+/*
+ * import mode, insert every input line as a json document, or remove or update
+ * every input line as a selector, see exec_import
+ */
 int import = 0;
+/* print timing and throughput of every command on stderr */
+int timing = 0;
+
+/* timing of the currently executing command */
+static __thread timing_t tm;
+static pthread_mutex_t tmmtx = PTHREAD_MUTEX_INITIALIZER; /* docs and bytes of tm, read by jobs */
+
+/* output and cancel flag of commands, changed by background jobs */
+static __thread FILE *out = NULL;
+static __thread volatile sig_atomic_t *cancel = &interrupted;
+
+volatile sig_atomic_t interrupted = 0;
+static volatile sig_atomic_t busy = 0; /* a command is executing */
+static int sigpipe[2];                /* SIGINT wakes up cancel_worker */
 
 #define NCMDS (sizeof cmds / sizeof cmds[0])
 #define MAXCMDNAM (sizeof cmds) /* broadly define maximum length of a command name */
 
 const char *cmds[] = {
   "aggregate",    /* AGQUERY */
+  "bench",        /* BENCH */
   "cd",           /* CHCOLL,  change database and/or collection */
   "count",        /* COUNT */
+  "cp",           /* CP */
+  "diff",         /* DIFF */
   "drop",         /* DROP */
+  "explain",      /* EXPLAIN */
+  "fg",           /* FG */
   "find",         /* FIND */
+  "grep",         /* GREP */
   "help",         /* print usage */
   "insert",       /* INSERT */
+  "jobs",         /* JOBS */
+  "kill",         /* KILL */
   "ls",           /* LS */
+  "mv",           /* MV */
   "remove",       /* REMOVE */
+  "stats",        /* STATS */
+  "tail",         /* TAIL */
+  "timing",       /* TIMING */
   "update",       /* UPDATE */
   "upsert",       /* UPSERT */
+  "watch",        /* WATCH */
   NULL            /* nul terminate this list */
 };
 
 void
 usage(void)
 {
-  printf("usage: %s [-psih] [/database/collection]\n", progname);
+  printf("usage: %s [-psih] [-c url] [-t tracefile] [--progress] [--compress[=gzip|zstd]]\n"
+         "          [/database/collection]\n", progname);
+  printf("       %s -i [--upsert-key field[,field ...]] [--replace] [--checkpoint file [--resume]]\n"
+         "          [--progress] [-c url] /database/collection\n", progname);
+  printf("       %s -r | -u update [--checkpoint file [--resume]] [--progress] [-c url]\n"
+         "          /database/collection\n", progname);
   exit(0);
 }
 
@@ -68,15 +116,35 @@ main_init(int argc, char **argv)
 {
   const char *line, **av;
   char linecpy[MAXLINE], *lp;
-  int i, read, status, ac, cmd, ch;
+  int i, read, status, ac, cmd, ch, bg;
+  size_t amp;
+  int64_t start;
+  struct sigaction sa;
+  sigset_t set, oset;
+  pthread_t canceller;
+  const char *tracefile = NULL;
+  const char *url = NULL;
+  import_t importcfg = { IMPORTINSERT, NULL, NULL, 0, NULL, 0 };
+  int ret = 0;
+  int showprogress = 0;
+  int compress = COMPNONE;
+  struct stat st;
+  enum { OPTUPSERTKEY = 256, OPTREPLACE, OPTCHECKPOINT, OPTRESUME, OPTPROGRESS, OPTCOMPRESS };
+  struct option longopts[] = {
+    { "upsert-key", required_argument, NULL, OPTUPSERTKEY },
+    { "replace",    no_argument,       NULL, OPTREPLACE },
+    { "checkpoint", required_argument, NULL, OPTCHECKPOINT },
+    { "resume",     no_argument,       NULL, OPTRESUME },
+    { "progress",   no_argument,       NULL, OPTPROGRESS },
+    { "compress",   optional_argument, NULL, OPTCOMPRESS },
+    { NULL,         0,                 NULL, 0 }
+  };
   EditLine *e;
   History *h;
   HistEvent he;
   Tokenizer *t;
   path_t newpath = { "", "" };
 
-  char connect_url[MAXMONGOURL] = "mongodb://localhost:27017";
-
   if (strlcpy(progname, basename(argv[0]), MAXPROG) > MAXPROG)
     errx(1, "program name too long");
 
@@ -84,7 +152,7 @@ main_init(int argc, char **argv)
   if (isatty(STDIN_FILENO))
     hr = 1;
 
-  while ((ch = getopt(argc, argv, "psih")) != -1)
+  while ((ch = getopt_long(argc, argv, "psihru:c:t:", longopts, NULL)) != -1)
     switch (ch) {
     case 'p':
       hr = 1;
@@ -93,7 +161,42 @@ main_init(int argc, char **argv)
       hr = 0;
       break;
     case 'i':
+    case 'r':
+    case 'u':
+      if (import)
+        errx(1, "-i, -r and -u can't be combined");
       import = 1;
+      if (ch == 'r') {
+        importcfg.mode = IMPORTREMOVE;
+      } else if (ch == 'u') {
+        importcfg.mode = IMPORTUPDATE;
+        importcfg.update = optarg;
+      }
+      break;
+    case 'c':
+      url = optarg;
+      break;
+    case 't':
+      tracefile = optarg;
+      break;
+    case OPTUPSERTKEY:
+      importcfg.upsertkey = optarg;
+      break;
+    case OPTREPLACE:
+      importcfg.replace = 1;
+      break;
+    case OPTCHECKPOINT:
+      importcfg.checkpoint = optarg;
+      break;
+    case OPTRESUME:
+      importcfg.resume = 1;
+      break;
+    case OPTPROGRESS:
+      showprogress = 1;
+      break;
+    case OPTCOMPRESS:
+      if ((compress = parse_compression(optarg)) == -1)
+        errx(1, "unknown compression: %s", optarg);
       break;
     case 'h':
     case '?':
@@ -106,19 +209,38 @@ main_init(int argc, char **argv)
   if (argc > 1)
     usage();
 
+  if ((importcfg.upsertkey != NULL || importcfg.replace || importcfg.checkpoint != NULL ||
+      importcfg.resume) && !import)
+    errx(1, "--upsert-key, --replace, --checkpoint and --resume can only be used in import mode");
+  if ((importcfg.upsertkey != NULL || importcfg.replace) && importcfg.mode != IMPORTINSERT)
+    errx(1, "--upsert-key and --replace can only be used with -i");
+  if (importcfg.resume && importcfg.checkpoint == NULL)
+    errx(1, "--resume needs --checkpoint");
+  if (compress != COMPNONE && (import || isatty(STDIN_FILENO) || isatty(STDOUT_FILENO)))
+    errx(1, "--compress can only be used non-interactively, outside import mode and with stdout "
+        "redirected");
+
   if (PATH_MAX < 20)
     errx(1, "can't determine PATH_MAX");
 
   if (init_user(&user) < 0)
     errx(1, "can't initialize user");
 
-  if ((status = read_config(&user, &config)) < 0)
+  if (url != NULL) {
+    if (strlcpy(connect_url, url, MAXMONGOURL) >= MAXMONGOURL)
+      errx(1, "url too long");
+  } else if ((status = read_config(&user, &config)) < 0) {
     errx(1, "can't read config file");
-  else if (status > 0)
+  } else if (status > 0) {
     if (strlcpy(connect_url, config.url, MAXMONGOURL) > MAXMONGOURL)
       errx(1, "url in config too long");
+  }
   /* else use default */
 
+  /* compress all output, exported documents as well as messages */
+  if (compress != COMPNONE && compress_start(compress) == -1)
+    errx(1, "can't compress output");
+
   if ((e = el_init(progname, stdin, stdout, stderr)) == NULL)
     errx(1, "can't initialize editline");
   if ((h = history_init()) == NULL)
@@ -146,9 +268,43 @@ main_init(int argc, char **argv)
 
   /* setup mongo */
   mongoc_init();
+
+  if (apm_init(tracefile) < 0)
+    err(1, "can't open %s", tracefile);
+
   if ((client = mongoc_client_new(connect_url)) == NULL)
     errx(1, "can't connect to mongo");
 
+  if (apm_set_client(client) < 0)
+    errx(1, "can't set command monitoring callbacks");
+
+  /* a unique appname lets kill_ops find the operations of this shell */
+  snprintf(appname, sizeof(appname), "%s-%d", progname, (int)getpid());
+  if (!mongoc_client_set_appname(client, appname))
+    appname[0] = '\0';
+
+  /* let ^C cancel the running command instead of the interactive shell */
+  if (isatty(STDIN_FILENO)) {
+    if (pipe(sigpipe) == -1)
+      err(1, "pipe");
+    if (fcntl(sigpipe[1], F_SETFL, O_NONBLOCK) == -1)
+      err(1, "fcntl");
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &set, &oset);
+    if (pthread_create(&canceller, NULL, cancel_worker, NULL) != 0)
+      errx(1, "can't start cancel thread");
+    pthread_detach(canceller);
+    pthread_sigmask(SIG_SETMASK, &oset, NULL);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_sigint;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGINT, &sa, NULL) == -1)
+      err(1, "sigaction");
+  }
+
   if (argc == 1) {
     if (parse_path(argv[0], &newpath, NULL, NULL) < 0)
       errx(1, "illegal path spec");
@@ -161,26 +317,61 @@ main_init(int argc, char **argv)
     if (isatty(STDIN_FILENO))
       errx(1, "import mode can only be used non-interactively");
 
-  while ((line = el_gets(e, &read)) != NULL) {
+  /* report progress of imports and exports on SIGUSR1 and --progress */
+  if (!isatty(STDIN_FILENO)) {
+    if (import && fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode))
+      progress_start(showprogress, st.st_size, NULL);
+    else
+      progress_start(showprogress, 0, thread_timing());
+  } else if (showprogress) {
+    errx(1, "--progress can only be used non-interactively");
+  }
+
+  /* documents are sent in bulk, bypass the line editor */
+  if (import) {
+    if (ccoll == NULL)
+      errx(1, "no collection selected");
+    if (exec_import(ccoll, stdin, &importcfg) == -1)
+      ret = 1;
+    read = 0;
+    goto done;
+  }
+
+  for (;;) {
+    jobs_notify();
+
+    interrupted = 0;
+    if ((line = el_gets(e, &read)) == NULL) {
+      /* ^C on the prompt discards the line */
+      if (read == -1 && interrupted) {
+        printf("\n");
+        continue;
+      }
+      break;
+    }
+
     if (read > MAXLINE)
       errx(1, "line too long");
 
     if (read == 0)
       goto done; /* happens on Ubuntu 12.04 without tty */
 
-    /* make room for a copy */
-    linecpy[0] = '\0';
-
-    if (import)
-      if (strlcpy(linecpy, "insert ", MAXLINE) > MAXLINE)
-        errx(1, "MAXLINE too short");
-
-    if (strlcat(linecpy, line, MAXLINE) > MAXLINE)
+    if (strlcpy(linecpy, line, MAXLINE) >= MAXLINE)
       errx(1, "line too long");
 
     /* trim newline if any */
     linecpy[strcspn(linecpy, "\n")] = '\0';
 
+    /* a trailing & runs the command in the background */
+    bg = 0;
+    amp = strlen(linecpy);
+    while (amp > 0 && isspace((unsigned char)linecpy[amp - 1]))
+      amp--;
+    if (amp > 0 && linecpy[amp - 1] == '&') {
+      bg = 1;
+      linecpy[--amp] = '\0';
+    }
+
     /* tokenize */
     tok_reset(t);
     if (tok_str(t, linecpy, &ac, &av) != 0)
@@ -189,8 +380,13 @@ main_init(int argc, char **argv)
     if (ac == 0)
       continue;
 
+    /* keep the & in history */
+    if (bg)
+      linecpy[amp] = '&';
     if (history(h, &he, H_ENTER, linecpy) == -1)
       errx(1, "can't enter history");
+    if (bg)
+      linecpy[amp] = '\0';
 
     cmd = mv_parse_cmd(ac, av, linecpy, &lp);
     switch (cmd) {
@@ -225,17 +421,53 @@ main_init(int argc, char **argv)
       break;
     }
 
+    if (bg) {
+      switch (cmd) {
+      case COUNT:
+      case UPDATE:
+      case UPSERT:
+      case INSERT:
+      case REMOVE:
+      case FIND:
+      case AGQUERY:
+      case EXPLAIN:
+      case TAIL:
+        job_start(cmd, &path, linecpy, lp);
+        break;
+      default:
+        warnx("can't run %s in the background", av[0]);
+      }
+      continue;
+    }
+
+    pthread_mutex_lock(&tmmtx);
+    memset(&tm, 0, sizeof(tm));
+    pthread_mutex_unlock(&tmmtx);
+    start = bson_get_monotonic_time();
+
+    interrupted = 0;
+    busy = 1;
     if (exec_cmd(cmd, av, lp, strlen(lp)) == -1)
       warnx("execution failed");
+    busy = 0;
+
+    if (timing)
+      print_timing(&tm, bson_get_monotonic_time() - start);
   }
 
  done:
   if (read == -1)
     err(1, NULL);
 
+  progress_end();
+  jobs_end();
+
   if (ccoll != NULL)
     mongoc_collection_destroy(ccoll);
   mongoc_client_destroy(client);
+  if (pool != NULL)
+    mongoc_client_pool_destroy(pool);
+  apm_end();
   mongoc_cleanup();
 
   tok_end(t);
@@ -247,7 +479,10 @@ main_init(int argc, char **argv)
   if (isatty(STDIN_FILENO))
     printf("\n");
 
-  return 0;
+  if (compress != COMPNONE && compress_end() == -1)
+    ret = 1;
+
+  return ret;
 }
 
 /*
@@ -297,13 +532,22 @@ complete(EditLine *e, int ch)
     ret = CC_REDISPLAY;
     break;
   case 1: /* on argument, try to complete all commands that support a path parameter */
-    if (strcmp(cmd, "cd") == 0 || strcmp(cmd, "ls") == 0 || strcmp(cmd, "drop") == 0)
+    if (strcmp(cmd, "cd") == 0 || strcmp(cmd, "ls") == 0 || strcmp(cmd, "drop") == 0 ||
+        strcmp(cmd, "cp") == 0 || strcmp(cmd, "mv") == 0 || strcmp(cmd, "diff") == 0)
       if (complete_path(e, ac <= 1 ? "" : av[1], co) < 0) {
         warnx("complete_path error");
         goto cleanup;
       }
     ret = CC_REDISPLAY;
     goto cleanup;
+  case 2: /* on the second argument of a command with two paths */
+    if (strcmp(cmd, "cp") == 0 || strcmp(cmd, "mv") == 0 || strcmp(cmd, "diff") == 0)
+      if (complete_path(e, ac <= 2 ? "" : av[2], co) < 0) {
+        warnx("complete_path error");
+        goto cleanup;
+      }
+    ret = CC_REDISPLAY;
+    goto cleanup;
   default:
     /* ignore subsequent words */
     ret = CC_NORM;
@@ -611,25 +855,46 @@ complete_path(EditLine *e, const char *npath, int cp)
   return 0;
 }
 
+/*
+ * List databases, collections or document ids depending on the path in line.
+ * Supports the following options before the path:
+ *   -l        print document count, data size, storage size, index size and
+ *             average document size of every listed database or collection
+ *   -s key    sort on key, one of name, count, size, storage, index or avgobj,
+ *             implies -l
+ *   -r        reverse sort order
+ *
+ * return 0 on success, -1 on failure
+ */
 int
-exec_ls(const char *npath)
+exec_ls(const char *line)
 {
-  int ret;
+  int ret, longfmt;
+  long offset;
   path_t tmppath;
   mongoc_collection_t *ccoll;
 
+  if ((offset = parse_ls_opts(line, &longfmt, &lssort, &lsreverse)) < 0) {
+    warnx("usage: ls [-lr] [-s name|count|size|storage|index|avgobj] [path]");
+    return -1;
+  }
+  line += offset;
+
   /* copy current context */
   if (strlcpy(tmppath.dbname, path.dbname, MAXDBNAME) > MAXDBNAME)
     return -1;
   if (strlcpy(tmppath.collname, path.collname, MAXCOLLNAME) > MAXCOLLNAME)
     return -1;
 
-  if (parse_path(npath, &tmppath, NULL, NULL) < 0)
+  if (parse_path(line, &tmppath, NULL, NULL) < 0)
     errx(1, "illegal path spec");
 
+  if (longfmt)
+    return exec_lsstats(&tmppath);
+
   if (strlen(tmppath.collname)) { /* print all document ids */
     ccoll = mongoc_client_get_collection(client, tmppath.dbname, tmppath.collname);
-    ret = exec_query(ccoll, "{}", 2, 1);
+    ret = exec_query(&tmppath, ccoll, "{}", 2, 1);
     mongoc_collection_destroy(ccoll);
     return ret;
   } else if (strlen(tmppath.dbname))
@@ -638,6 +903,61 @@ exec_ls(const char *npath)
     return exec_lsdbs(client, NULL);
 }
 
+/*
+ * Parse the options of the ls command. Sets longfmt if -l or -s is given, sets
+ * sortkey to one of enum lssort and reverse to 1 if -r is given.
+ *
+ * Return the offset in line of the first non-option argument or -1 on failure.
+ */
+long
+parse_ls_opts(const char *line, int *longfmt, int *sortkey, int *reverse)
+{
+  const char *keys[] = { "name", "count", "size", "storage", "index", "avgobj", NULL };
+  const char *cp, *key;
+  size_t keylen;
+  int i;
+
+  *longfmt = 0;
+  *sortkey = LSNAME;
+  *reverse = 0;
+
+  cp = line;
+  for (;;) {
+    cp += strspn(cp, " \t");
+    if (cp[0] != '-' || cp[1] == '\0' || cp[1] == ' ' || cp[1] == '\t')
+      break;
+
+    for (cp++; *cp != '\0' && *cp != ' ' && *cp != '\t'; cp++) {
+      switch (*cp) {
+      case 'l':
+        *longfmt = 1;
+        break;
+      case 'r':
+        *reverse = 1;
+        break;
+      case 's':
+        /* sort key is the next word */
+        key = cp + 1;
+        key += strspn(key, " \t");
+        keylen = strcspn(key, " \t");
+        for (i = 0; keys[i] != NULL; i++)
+          if (strlen(keys[i]) == keylen && strncmp(keys[i], key, keylen) == 0)
+            break;
+        if (keys[i] == NULL)
+          return -1;
+        *sortkey = i;
+        *longfmt = 1;
+        cp = key + keylen - 1;
+        break;
+      default:
+        return -1;
+      }
+    }
+  }
+
+  return cp - line;
+}
+
 int
 exec_drop(const char *npath)
 {
@@ -735,12 +1055,14 @@ int idtosel(char *doc, const size_t docsize, const char *sel, const size_t selle
 long parse_selector(unsigned char *doc, const size_t docsize, const char *line, int len)
 {
   long offset;
+  int64_t start;
 
   /* support id only selectors */
   const char *ids; /* id start */
   size_t fnb, snb; /* first and second non-blank characters used for id selection */
 
   offset = 0;
+  start = bson_get_monotonic_time();
 
   /* if first non-blank char is not a "{", use it as a literal and convert to an
      id selector */
@@ -759,6 +1081,8 @@ long parse_selector(unsigned char *doc, const size_t docsize, const char *line,
     }
   }
 
+  tm.parse += bson_get_monotonic_time() - start;
+
   return offset;
 }
 
@@ -913,11 +1237,21 @@ cleanuperr:
 int mv_parse_cmd(int argc, const char *argv[], const char *line, char **lp)
 {
   const char *cmd;
+  int i;
 
   /* check if the first token matches one or more commands */
   if (prefix_match((const char ***)&list_match, cmds, argv[0]) == -1)
     errx(1, "prefix_match error");
 
+  /* keep "f" an abbreviation of find, fg must be spelled out */
+  if (strcmp(argv[0], "fg") != 0)
+    for (i = 0; list_match[i] != NULL; i++)
+      if (strcmp(list_match[i], "fg") == 0) {
+        for (; list_match[i] != NULL; i++)
+          list_match[i] = list_match[i + 1];
+        break;
+      }
+
   /* unknown prefix */
   if (list_match[0] == NULL)
     return UNKNOWN;
@@ -940,19 +1274,67 @@ int mv_parse_cmd(int argc, const char *argv[], const char *line, char **lp)
   } else if (strcmp("help", cmd) == 0) {
     *lp = strstr(line, argv[0]) + strlen(argv[0]);
     return HELP;
-  }
-
-  if (strcmp("ls", cmd) == 0) {
+  } else if (strcmp("stats", cmd) == 0) {
     *lp = strstr(line, argv[0]) + strlen(argv[0]);
     switch (argc) {
     case 1:
+      return STATS;
+    default:
+      return ILLEGAL;
+    }
+  } else if (strcmp("timing", cmd) == 0) {
+    *lp = strstr(line, argv[0]) + strlen(argv[0]);
+    switch (argc) {
+    case 1:
+    case 2:
+      return TIMING;
+    default:
+      return ILLEGAL;
+    }
+  } else if (strcmp("jobs", cmd) == 0) {
+    *lp = strstr(line, argv[0]) + strlen(argv[0]);
+    switch (argc) {
+    case 1:
+      return JOBS;
+    default:
+      return ILLEGAL;
+    }
+  } else if (strcmp("fg", cmd) == 0) {
+    *lp = strstr(line, argv[0]) + strlen(argv[0]);
+    switch (argc) {
+    case 1:
+    case 2:
+      return FG;
+    default:
+      return ILLEGAL;
+    }
+  } else if (strcmp("kill", cmd) == 0) {
+    *lp = strstr(line, argv[0]) + strlen(argv[0]);
+    switch (argc) {
     case 2:
-      return LS;
+      return KILL;
     default:
       return ILLEGAL;
     }
   }
 
+  /* watch the cluster, a database or a collection */
+  if (strcmp("watch", cmd) == 0) {
+    *lp = strstr(line, argv[0]) + strlen(argv[0]);
+    return WATCH;
+  }
+
+  if (strcmp("ls", cmd) == 0) {
+    *lp = strstr(line, argv[0]) + strlen(argv[0]);
+    /* skip options, expect at most one path */
+    for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++)
+      if (strchr(argv[i], 's') != NULL)
+        i++; /* skip sort key */
+    if (argc - i > 1)
+      return ILLEGAL;
+    return LS;
+  }
+
   if (strcmp("drop", cmd) == 0) {
     *lp = strstr(line, argv[0]) + strlen(argv[0]);
     switch (argc) {
@@ -964,6 +1346,38 @@ int mv_parse_cmd(int argc, const char *argv[], const char *line, char **lp)
     }
   }
 
+  /* compare two collections, paths can be absolute */
+  if (strcmp("diff", cmd) == 0) {
+    *lp = strstr(line, argv[0]) + strlen(argv[0]);
+    return argc > 2 ? DIFF : ILLEGAL;
+  }
+
+  /* search collections, the glob can be absolute */
+  if (strcmp("grep", cmd) == 0) {
+    *lp = strstr(line, argv[0]) + strlen(argv[0]);
+    return argc > 1 ? GREP : ILLEGAL;
+  }
+
+  /* copy or move a collection, paths can be absolute */
+  if (strcmp("cp", cmd) == 0 || strcmp("mv", cmd) == 0) {
+    *lp = strstr(line, argv[0]) + strlen(argv[0]);
+    switch (argc) {
+    case 3:
+      return cmd[0] == 'c' ? CP : MV;
+    default:
+      return ILLEGAL;
+    }
+  }
+
+  /* a glob selects the collections of find and count */
+  if (strcmp("find", cmd) == 0 || strcmp("count", cmd) == 0) {
+    i = argc > 3 && strcmp(argv[1], "-p") == 0 ? 3 : 1;
+    if (i < argc && isglob(argv[i])) {
+      *lp = strstr(line, argv[0]) + strlen(argv[0]);
+      return cmd[0] == 'f' ? FIND : COUNT;
+    }
+  }
+
   /* all the other commands need a database and collection to be selected */
   if (!strlen(path.dbname))
     return DBMISSING;
@@ -991,6 +1405,15 @@ int mv_parse_cmd(int argc, const char *argv[], const char *line, char **lp)
   } else if (strcmp("aggregate", cmd) == 0) {
     *lp = strstr(line, argv[0]) + strlen(argv[0]);
     return AGQUERY;
+  } else if (strcmp("bench", cmd) == 0) {
+    *lp = strstr(line, argv[0]) + strlen(argv[0]);
+    return BENCH;
+  } else if (strcmp("explain", cmd) == 0) {
+    *lp = strstr(line, argv[0]) + strlen(argv[0]);
+    return EXPLAIN;
+  } else if (strcmp("tail", cmd) == 0) {
+    *lp = strstr(line, argv[0]) + strlen(argv[0]);
+    return TAIL;
   }
 
   return UNKNOWN;
@@ -1001,7 +1424,7 @@ int mv_parse_cmd(int argc, const char *argv[], const char *line, char **lp)
  */
 int exec_cmd(const int cmd, const char **argv, const char *line, int linelen)
 {
-  path_t tmppath;
+  path_t tmppath, dstpath;
 
   switch (cmd) {
   case LS:
@@ -1026,20 +1449,77 @@ int exec_cmd(const int cmd, const char **argv, const char *line, int linelen)
         return -1;
     }
     return exec_chcoll(client, tmppath);
+  case CP:
+  case MV:
+    /* both paths are relative to the current database and collection */
+    tmppath = dstpath = path;
+    if (parse_path(argv[1], &tmppath, NULL, NULL) < 0 ||
+        parse_path(argv[2], &dstpath, NULL, NULL) < 0) {
+      warnx("illegal path spec");
+      return -1;
+    }
+    return cmd == CP ? exec_cp(&tmppath, &dstpath) : exec_mv(&tmppath, &dstpath);
+  case COUNT:
+  case UPDATE:
+  case UPSERT:
+  case INSERT:
+  case REMOVE:
+  case FIND:
+  case AGQUERY:
+  case EXPLAIN:
+  case TAIL:
+    return exec_collcmd(&path, ccoll, cmd, line, linelen);
+  case JOBS:
+    return exec_jobs();
+  case FG:
+    return exec_fg(argv[1]);
+  case KILL:
+    return exec_kill(argv[1]);
+  case TIMING:
+    return exec_timing(argv[1]);
+  case STATS:
+    apm_print_stats(stdout);
+    return 0;
+  case BENCH:
+    return exec_bench(&path, line);
+  case GREP:
+    return exec_grep(&path, line);
+  case DIFF:
+    return exec_diff(&path, line);
+  case WATCH:
+    return exec_watch(line, linelen);
+  }
+
+  return -1;
+}
+
+/* execute a command that operates on collection, ns is the path of the
+ * collection and is used instead of the current path, which may change while
+ * a background job runs.
+ * return 0 on success, -1 on failure
+ */
+int exec_collcmd(const path_t *ns, mongoc_collection_t *collection, const int cmd, const char *line,
+    int linelen)
+{
+  switch (cmd) {
   case COUNT:
-    return exec_count(ccoll, line, linelen);
+    return exec_count(ns, collection, line, linelen);
   case UPDATE:
-    return exec_update(ccoll, line, 0);
+    return exec_update(collection, line, 0);
   case UPSERT:
-    return exec_update(ccoll, line, 1);
+    return exec_update(collection, line, 1);
   case INSERT:
-    return exec_insert(ccoll, line, linelen);
+    return exec_insert(collection, line, linelen);
   case REMOVE:
-    return exec_remove(ccoll, line, linelen);
+    return exec_remove(collection, line, linelen);
   case FIND:
-    return exec_query(ccoll, line, linelen, 0);
+    return exec_query(ns, collection, line, linelen, 0);
   case AGQUERY:
-    return exec_agquery(ccoll, line, linelen);
+    return exec_agquery(ns, collection, line, linelen);
+  case EXPLAIN:
+    return exec_explain(collection, line, linelen);
+  case TAIL:
+    return exec_tail(collection, line, linelen);
   }
 
   return -1;
@@ -1103,103 +1583,575 @@ int exec_lscolls(mongoc_client_t *client, char *dbname)
 }
 
 /*
- * change dbname and/or collname, set ccoll and update prompt.
+ * Print document count, data size, storage size, index size and average
+ * document size of the collection in ns, or of all collections in the database
+ * if ns has no collection, or of all databases if ns has no database. The
+ * statistics of every namespace are fetched concurrently using the client pool.
+ *
  * return 0 on success, -1 on failure
  */
 int
-exec_chcoll(mongoc_client_t *client, const path_t newpath)
+exec_lsstats(const path_t *ns)
 {
-  /* unset current collection */
-  if (ccoll != NULL) {
-    mongoc_collection_destroy(ccoll);
-    ccoll = NULL;
+  bson_error_t error;
+  mongoc_database_t *db;
+  nsstats_t *stats;
+  char **strv;
+  size_t i, n;
+  int ret;
+
+  if (strlen(ns->collname)) {
+    if ((strv = bson_malloc0(2 * sizeof(*strv))) == NULL)
+      err(1, "exec_lsstats");
+    strv[0] = bson_strdup(ns->collname);
+  } else if (strlen(ns->dbname)) {
+    db = mongoc_client_get_database(client, ns->dbname);
+    strv = mongoc_database_get_collection_names(db, &error);
+    mongoc_database_destroy(db);
+  } else {
+    strv = mongoc_client_get_database_names(client, &error);
   }
 
-  /* if there is a new collection, change to it */
-  if (strlen(newpath.dbname) && strlen(newpath.dbname))
-    ccoll = mongoc_client_get_collection(client, newpath.dbname, newpath.collname);
+  if (strv == NULL) {
+    warnx("cursor failed: %d.%d %s", error.domain, error.code, error.message);
+    return -1;
+  }
 
-  /* update prompt to show whatever we've changed to */
-  set_prompt(newpath.dbname, newpath.collname);
+  for (n = 0; strv[n]; n++)
+    ;
 
-  /* update global references */
-  if (strlcpy(prevpath.dbname, path.dbname, MAXDBNAME) > MAXDBNAME)
-    return -1;
-  if (strlcpy(prevpath.collname, path.collname, MAXCOLLNAME) > MAXCOLLNAME)
-    return -1;
-  if (strlcpy(path.dbname, newpath.dbname, MAXDBNAME) > MAXDBNAME)
-    return -1;
-  if (strlcpy(path.collname, newpath.collname, MAXCOLLNAME) > MAXCOLLNAME)
-    return -1;
+  if ((stats = calloc(n ? n : 1, sizeof(*stats))) == NULL)
+    err(1, "exec_lsstats");
 
-  return 0;
+  for (i = 0; i < n; i++) {
+    if (strlen(ns->dbname)) {
+      if (strlcpy(stats[i].ns.dbname, ns->dbname, MAXDBNAME) >= MAXDBNAME)
+        errx(1, "database name too long");
+      if (strlcpy(stats[i].ns.collname, strv[i], MAXCOLLNAME) >= MAXCOLLNAME)
+        errx(1, "collection name too long");
+    } else {
+      if (strlcpy(stats[i].ns.dbname, strv[i], MAXDBNAME) >= MAXDBNAME)
+        errx(1, "database name too long");
+    }
+  }
+
+  bson_strfreev(strv);
+
+  ret = fanout(fetch_nsstats, stats, n, MAXWORKERS);
+
+  qsort(stats, n, sizeof(*stats), cmp_nsstats);
+
+  if (hr)
+    printf("%12s %12s %12s %12s %8s  %s\n", "count", "size", "storage", "index", "avgobj", "name");
+
+  for (i = 0; i < n; i++) {
+    if (!stats[i].ok)
+      continue;
+    printf("%12lld %12lld %12lld %12lld %8lld  %s\n", (long long)stats[i].count,
+        (long long)stats[i].size, (long long)stats[i].storage,
+        (long long)stats[i].index, (long long)stats[i].avgobj,
+        strlen(stats[i].ns.collname) ? stats[i].ns.collname : stats[i].ns.dbname);
+  }
+
+  free(stats);
+
+  return ret;
 }
 
-/* count number of documents in collection
+/*
+ * Fetch collStats or dbStats, depending on whether a collection name is set,
+ * for the i'th entry in the nsstats_t array arg. Runs on a fanout worker.
+ *
  * return 0 on success, -1 on failure
  */
-int exec_count(mongoc_collection_t *collection, const char *line, int len)
+int
+fetch_nsstats(mongoc_client_t *client, void *arg, size_t i)
 {
   bson_error_t error;
-  int64_t count;
-  bson_t *query;
-
-  if (sizeof(tmpdocs) < 3)
-    errx(1, "exec_count");
-  /* default to all documents */
-  tmpdoc[0] = '{';
-  tmpdoc[1] = '}';
-  tmpdoc[2] = '\0';
+  bson_t *cmd, reply;
+  nsstats_t *st;
+  int iscoll;
 
-  if (parse_selector(tmpdoc, sizeof(tmpdocs), line, len) == -1)
-    return -1;
+  st = (nsstats_t *)arg + i;
+  iscoll = strlen(st->ns.collname) > 0;
 
-  /* try to parse it as json and convert to bson */
-  if ((query = bson_new_from_json(tmpdoc, -1, &error)) == NULL) {
-    warnx("%d.%d %s", error.domain, error.code, error.message);
-    return -1;
-  }
+  if (iscoll)
+    cmd = BCON_NEW("collStats", BCON_UTF8(st->ns.collname));
+  else
+    cmd = BCON_NEW("dbStats", BCON_INT32(1));
 
-  if ((count = mongoc_collection_count(collection, MONGOC_QUERY_NONE, query, 0, 0, NULL, &error)) == -1) {
-    warnx("cursor failed: %d.%d %s", error.domain, error.code, error.message);
-    bson_destroy(query);
+  if (!mongoc_client_command_simple(client, st->ns.dbname, cmd, NULL, &reply, &error)) {
+    warnx("%s%s%s: %d.%d %s", st->ns.dbname, iscoll ? "." : "",
+        st->ns.collname, error.domain, error.code, error.message);
+    bson_destroy(&reply);
+    bson_destroy(cmd);
     return -1;
   }
 
-  printf("%lld\n", count);
+  st->count = bson_lookup_int64(&reply, iscoll ? "count" : "objects");
+  st->size = bson_lookup_int64(&reply, iscoll ? "size" : "dataSize");
+  st->storage = bson_lookup_int64(&reply, "storageSize");
+  st->index = bson_lookup_int64(&reply, iscoll ? "totalIndexSize" : "indexSize");
+  st->avgobj = bson_lookup_int64(&reply, "avgObjSize");
+  st->ok = 1;
 
-  bson_destroy(query);
+  bson_destroy(&reply);
+  bson_destroy(cmd);
 
   return 0;
 }
 
-/* parse update command, expect two json objects, a selector, and an update doc and exec */
-int exec_update(mongoc_collection_t *collection, const char *line, int upsert)
+/*
+ * qsort comparator for nsstats_t, sorts on the global lssort and lsreverse.
+ * Numbers are sorted from large to small, names alphabetically.
+ */
+int
+cmp_nsstats(const void *a, const void *b)
 {
-  long offset;
-  unsigned char update_docs[MAXDOC];
-  unsigned char *update_doc = update_docs;
-  bson_error_t error;
-  bson_t *query, *update;
-
-  int opts = MONGOC_UPDATE_NONE;
-  if (upsert)
-    opts |= MONGOC_UPDATE_UPSERT;
+  const nsstats_t *sa = a, *sb = b;
+  int64_t va, vb;
+  int ret;
 
-  /* read first json object */
-  if ((offset = parse_selector(tmpdoc, sizeof(tmpdocs), line, strlen(line))) == -1)
-    return ILLEGAL;
-  if (offset == 0)
+  switch (lssort) {
+  case LSCOUNT:
+    va = sa->count; vb = sb->count;
+    break;
+  case LSSIZE:
+    va = sa->size; vb = sb->size;
+    break;
+  case LSSTORAGE:
+    va = sa->storage; vb = sb->storage;
+    break;
+  case LSINDEX:
+    va = sa->index; vb = sb->index;
+    break;
+  case LSAVGOBJ:
+    va = sa->avgobj; vb = sb->avgobj;
+    break;
+  default:
+    va = vb = 0;
+  }
+
+  if (va != vb)
+    ret = va > vb ? -1 : 1;
+  else if ((ret = strcmp(sa->ns.dbname, sb->ns.dbname)) == 0)
+    ret = strcmp(sa->ns.collname, sb->ns.collname);
+
+  return lsreverse ? -ret : ret;
+}
+
+/*
+ * Return the value of key in doc as a 64-bit integer or 0 if key is not found
+ * or not numeric.
+ */
+int64_t
+bson_lookup_int64(const bson_t *doc, const char *key)
+{
+  bson_iter_t it;
+
+  if (!bson_iter_init_find(&it, doc, key))
+    return 0;
+
+  switch (bson_iter_type(&it)) {
+  case BSON_TYPE_INT32:
+  case BSON_TYPE_INT64:
+  case BSON_TYPE_DOUBLE:
+    return bson_iter_as_int64(&it);
+  default:
+    return 0;
+  }
+}
+
+/*
+ * Return the client pool, create it on first use. The pool uses the same
+ * connection string as the main client.
+ */
+mongoc_client_pool_t *
+get_pool(void)
+{
+  mongoc_uri_t *uri;
+  char name[MAXAPPNAME];
+
+  pthread_mutex_lock(&poolmtx);
+  if (pool != NULL) {
+    pthread_mutex_unlock(&poolmtx);
+    return pool;
+  }
+
+  if ((uri = mongoc_uri_new(connect_url)) == NULL)
+    errx(1, "can't parse mongo url");
+  if ((pool = mongoc_client_pool_new(uri)) == NULL)
+    errx(1, "can't create client pool");
+  mongoc_uri_destroy(uri);
+
+  if (apm_set_pool(pool) < 0)
+    errx(1, "can't set command monitoring callbacks");
+
+  /* keep operations of pooled clients apart from those of the shell */
+  if (strlen(appname) && snprintf(name, sizeof(name), "%s-pool", appname) < (int)sizeof(name))
+    mongoc_client_pool_set_appname(pool, name);
+
+  pthread_mutex_unlock(&poolmtx);
+
+  return pool;
+}
+
+/*
+ * Prepare a thread other than the main thread for running exec_* functions by
+ * giving it its own temporary document buffer. If q is set, query results are
+ * converted to json but not printed.
+ */
+void
+thread_init(int q)
+{
+  if ((tmpdoc = malloc(sizeof(tmpdocs))) == NULL)
+    err(1, "thread_init");
+  quiet = q;
+}
+
+/* free resources allocated by thread_init */
+void
+thread_end(void)
+{
+  free(tmpdoc);
+  tmpdoc = NULL;
+}
+
+/*
+ * Let the exec_* functions of this thread write to fp instead of stdout and
+ * stop on flag instead of on SIGINT. Used by background jobs.
+ */
+void
+thread_job(FILE *fp, volatile sig_atomic_t *flag)
+{
+  out = fp;
+  cancel = flag;
+}
+
+/* return the timing of the command executing on this thread */
+const timing_t *
+thread_timing(void)
+{
+  return &tm;
+}
+
+/* add to the document and byte counters of the command executing on this thread */
+void
+count_docs(int64_t docs, int64_t bytes)
+{
+  pthread_mutex_lock(&tmmtx);
+  tm.docs += docs;
+  tm.bytes += bytes;
+  pthread_mutex_unlock(&tmmtx);
+}
+
+/* read the document and byte counters of t, which may be of another thread */
+void
+read_counts(const timing_t *t, int64_t *docs, int64_t *bytes)
+{
+  pthread_mutex_lock(&tmmtx);
+  *docs = t->docs;
+  *bytes = t->bytes;
+  pthread_mutex_unlock(&tmmtx);
+}
+
+/* return the stream exec_* functions of this thread write to */
+FILE *
+outfp(void)
+{
+  return out != NULL ? out : stdout;
+}
+
+/* set the interrupted flag and wake up cancel_worker */
+void
+handle_sigint(int sig)
+{
+  int saved_errno = errno;
+  ssize_t n;
+
+  (void)sig;
+
+  interrupted = 1;
+
+  /* a full pipe means a wakeup is pending already */
+  n = write(sigpipe[1], "", 1);
+  (void)n;
+
+  errno = saved_errno;
+}
+
+/*
+ * Wait for SIGINT and kill the operations of a running command on the server.
+ * Loops over cursors stop on the interrupted flag, but a command can block on
+ * a single server operation for a long time, like an aggregation that has to
+ * group a whole collection before returning the first batch.
+ */
+void *
+cancel_worker(void *arg)
+{
+  char c;
+
+  (void)arg;
+
+  for (;;) {
+    if (read(sigpipe[0], &c, 1) != 1) {
+      if (errno == EINTR)
+        continue;
+      warn("cancel_worker");
+      return NULL;
+    }
+
+    if (busy && strlen(appname))
+      kill_ops(appname);
+  }
+}
+
+/*
+ * Kill all operations on the server of clients with appname app.
+ *
+ * return the number of killed operations, -1 on failure
+ */
+int
+kill_ops(const char *app)
+{
+  mongoc_client_t *cl;
+  bson_error_t error;
+  bson_iter_t it, ops, op;
+  bson_t *cmd, reply, kreply;
+  int n;
+
+  cl = mongoc_client_pool_pop(get_pool());
+
+  cmd = BCON_NEW("currentOp", BCON_INT32(1), "appName", BCON_UTF8(app));
+  if (!mongoc_client_command_simple(cl, "admin", cmd, NULL, &reply, &error)) {
+    warnx("currentOp: %d.%d %s", error.domain, error.code, error.message);
+    bson_destroy(cmd);
+    bson_destroy(&reply);
+    mongoc_client_pool_push(get_pool(), cl);
+    return -1;
+  }
+  bson_destroy(cmd);
+
+  n = 0;
+  if (bson_iter_init_find(&it, &reply, "inprog") && BSON_ITER_HOLDS_ARRAY(&it) && bson_iter_recurse(&it, &ops)) {
+    while (bson_iter_next(&ops)) {
+      if (!BSON_ITER_HOLDS_DOCUMENT(&ops) || !bson_iter_recurse(&ops, &op) || !bson_iter_find(&op, "opid"))
+        continue;
+
+      cmd = bson_new();
+      BSON_APPEND_INT32(cmd, "killOp", 1);
+      bson_append_value(cmd, "op", -1, bson_iter_value(&op));
+      if (mongoc_client_command_simple(cl, "admin", cmd, NULL, &kreply, &error))
+        n++;
+      else
+        warnx("killOp: %d.%d %s", error.domain, error.code, error.message);
+      bson_destroy(cmd);
+      bson_destroy(&kreply);
+    }
+  }
+
+  bson_destroy(&reply);
+  mongoc_client_pool_push(get_pool(), cl);
+
+  return n;
+}
+
+/* shared state of the workers of one fanout call */
+struct fanout {
+  pthread_mutex_t mtx;
+  size_t next;
+  size_t n;
+  int failed;
+  int (*fn)(mongoc_client_t *, void *, size_t);
+  void *arg;
+};
+
+/*
+ * Run fn(client, arg, i) for every i in [0, n) on at most maxworkers threads.
+ * Every worker pops its own client from the pool and processes the next
+ * unclaimed index until all are done.
+ *
+ * return 0 if all calls succeeded, -1 if one or more failed
+ */
+int
+fanout(int (*fn)(mongoc_client_t *, void *, size_t), void *arg, size_t n, int maxworkers)
+{
+  struct fanout fo;
+  pthread_t *threads;
+  int i, nthreads;
+
+  if (n == 0)
+    return 0;
+
+  fo.next = 0;
+  fo.n = n;
+  fo.failed = 0;
+  fo.fn = fn;
+  fo.arg = arg;
+  if (pthread_mutex_init(&fo.mtx, NULL) != 0)
+    errx(1, "fanout: can't initialize mutex");
+
+  nthreads = (size_t)maxworkers < n ? maxworkers : (int)n;
+  if ((threads = reallocarray(NULL, nthreads, sizeof(*threads))) == NULL)
+    err(1, "fanout");
+
+  get_pool();
+
+  for (i = 0; i < nthreads; i++)
+    if (pthread_create(&threads[i], NULL, fanout_worker, &fo) != 0)
+      errx(1, "fanout: can't create thread");
+
+  for (i = 0; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+
+  pthread_mutex_destroy(&fo.mtx);
+  free(threads);
+
+  return fo.failed ? -1 : 0;
+}
+
+void *
+fanout_worker(void *arg)
+{
+  struct fanout *fo = arg;
+  mongoc_client_t *c;
+  size_t i;
+
+  c = mongoc_client_pool_pop(pool);
+
+  for (;;) {
+    pthread_mutex_lock(&fo->mtx);
+    i = fo->next++;
+    pthread_mutex_unlock(&fo->mtx);
+
+    if (i >= fo->n)
+      break;
+
+    if (fo->fn(c, fo->arg, i) < 0) {
+      pthread_mutex_lock(&fo->mtx);
+      fo->failed = 1;
+      pthread_mutex_unlock(&fo->mtx);
+    }
+  }
+
+  mongoc_client_pool_push(pool, c);
+
+  return NULL;
+}
+
+/*
+ * change dbname and/or collname, set ccoll and update prompt.
+ * return 0 on success, -1 on failure
+ */
+int
+exec_chcoll(mongoc_client_t *client, const path_t newpath)
+{
+  /* unset current collection */
+  if (ccoll != NULL) {
+    mongoc_collection_destroy(ccoll);
+    ccoll = NULL;
+  }
+
+  /* if there is a new collection, change to it */
+  if (strlen(newpath.dbname) && strlen(newpath.dbname))
+    ccoll = mongoc_client_get_collection(client, newpath.dbname, newpath.collname);
+
+  /* update prompt to show whatever we've changed to */
+  set_prompt(newpath.dbname, newpath.collname);
+
+  /* update global references */
+  if (strlcpy(prevpath.dbname, path.dbname, MAXDBNAME) > MAXDBNAME)
+    return -1;
+  if (strlcpy(prevpath.collname, path.collname, MAXCOLLNAME) > MAXCOLLNAME)
+    return -1;
+  if (strlcpy(path.dbname, newpath.dbname, MAXDBNAME) > MAXDBNAME)
+    return -1;
+  if (strlcpy(path.collname, newpath.collname, MAXCOLLNAME) > MAXCOLLNAME)
+    return -1;
+
+  return 0;
+}
+
+/* count number of documents in collection, a glob is resolved relative to ns
+ * return 0 on success, -1 on failure
+ */
+int exec_count(const path_t *ns, mongoc_collection_t *collection, const char *line, int len)
+{
+  bson_error_t error;
+  int64_t count, start;
+  bson_t *query;
+
+  /* count in every collection that matches a glob */
+  if (glob_arg(line))
+    return exec_globquery(ns, COUNT, line, len);
+
+  if (sizeof(tmpdocs) < 3)
+    errx(1, "exec_count");
+  /* default to all documents */
+  tmpdoc[0] = '{';
+  tmpdoc[1] = '}';
+  tmpdoc[2] = '\0';
+
+  if (parse_selector(tmpdoc, sizeof(tmpdocs), line, len) == -1)
+    return -1;
+
+  /* try to parse it as json and convert to bson */
+  if ((query = bson_new_from_json(tmpdoc, -1, &error)) == NULL) {
+    warnx("%d.%d %s", error.domain, error.code, error.message);
+    return -1;
+  }
+
+  start = bson_get_monotonic_time();
+  count = mongoc_collection_count(collection, MONGOC_QUERY_NONE, query, 0, 0, NULL, &error);
+  tm.server += bson_get_monotonic_time() - start;
+
+  if (count == -1) {
+    warnx("cursor failed: %d.%d %s", error.domain, error.code, error.message);
+    bson_destroy(query);
+    return -1;
+  }
+
+  fprintf(outfp(), "%lld\n", count);
+
+  bson_destroy(query);
+
+  return 0;
+}
+
+/* parse update command, expect two json objects, a selector, and an update doc and exec */
+int exec_update(mongoc_collection_t *collection, const char *line, int upsert)
+{
+  long offset;
+  unsigned char update_docs[MAXDOC];
+  unsigned char *update_doc = update_docs;
+  bson_error_t error;
+  bson_t *query, *update;
+  int64_t start;
+
+  int opts = MONGOC_UPDATE_NONE;
+  if (upsert)
+    opts |= MONGOC_UPDATE_UPSERT;
+
+  /* update in batches if --chunk is given */
+  if (!upsert && strncmp(line + strspn(line, " \t"), "--", 2) == 0)
+    return exec_chunked(collection, UPDATE, line, strlen(line));
+
+  /* read first json object */
+  if ((offset = parse_selector(tmpdoc, sizeof(tmpdocs), line, strlen(line))) == -1)
+    return ILLEGAL;
+  if (offset == 0)
     return ILLEGAL;
 
   /* shorten line */
   line += offset;
 
   /* read second json object */
+  start = bson_get_monotonic_time();
   if ((offset = relaxed_to_strict(update_doc, MAXDOC, line, strlen(line), 1)) < 0) {
     warnx("jsonify error: %ld", offset);
     return ILLEGAL;
   }
+  tm.parse += bson_get_monotonic_time() - start;
   if (offset == 0)
     return ILLEGAL;
 
@@ -1220,6 +2172,7 @@ int exec_update(mongoc_collection_t *collection, const char *line, int upsert)
   }
 
   /* execute update, always try with multi first, and if that fails, without */
+  start = bson_get_monotonic_time();
   if (!mongoc_collection_update(collection, opts | MONGOC_UPDATE_MULTI_UPDATE, query, update, NULL, &error)) {
     /* if error is "multi update only works with $ operators", retry without MULTI */
     if (error.domain == MONGOC_ERROR_COMMAND && error.code == MONGOC_ERROR_CLIENT_TOO_SMALL) {
@@ -1236,6 +2189,7 @@ int exec_update(mongoc_collection_t *collection, const char *line, int upsert)
       return -1;
     }
   }
+  tm.server += bson_get_monotonic_time() - start;
 
   bson_destroy(query);
   bson_destroy(update);
@@ -1243,190 +2197,2143 @@ int exec_update(mongoc_collection_t *collection, const char *line, int upsert)
   return 0;
 }
 
-/* parse insert command, expect one json objects, the insert doc and exec */
+/*
+ * Parse insert command, expect an optional --unordered followed by either an
+ * array of documents or one or more documents, and insert all of them with one
+ * insert_many. Every document that failed is reported.
+ *
+ * return 0 if every document is inserted, -1 otherwise
+ */
 int exec_insert(mongoc_collection_t *collection, const char *line, int len)
 {
   long offset;
   bson_error_t error;
-  bson_t *doc;
+  bson_iter_t it, elems, wit;
+  bson_t *array, **docs, opts, reply, elem;
+  const uint8_t *data;
+  uint32_t datalen;
+  size_t i, ndocs, docssize;
+  int64_t start, inserted, bytes;
+  int unordered, ret;
+
+  /* check for --unordered */
+  unordered = 0;
+  i = strspn(line, " \t");
+  if (strncmp(line + i, "--unordered", 11) == 0 && strchr(" \t", line[i + 11]) != NULL) {
+    unordered = 1;
+    line += i + 11;
+    len -= i + 11;
+  }
 
-  /* read first json object */
-  if ((offset = parse_selector(tmpdoc, sizeof(tmpdocs), line, len)) == -1)
-    return ILLEGAL;
-  if (offset == 0)
-    return ILLEGAL;
+  array = NULL;
+  docs = NULL;
+  ndocs = docssize = 0;
+  ret = -1;
+
+  i = strspn(line, " \t");
+  if (line[i] == '[') {
+    /* the array is the rest of the line, wrap it to get a document */
+    start = bson_get_monotonic_time();
+    strlcpy((char *)tmpdoc, "{\"d\":", sizeof(tmpdocs));
+    if ((offset = relaxed_to_strict(tmpdoc + 5, sizeof(tmpdocs) - 6, line, len, 0)) < 0) {
+      warnx("jsonify error: %ld", offset);
+      return -1;
+    }
+    strlcat((char *)tmpdoc, "}", sizeof(tmpdocs));
+    tm.parse += bson_get_monotonic_time() - start;
 
-  /* try to parse the doc as json and convert to bson */
-  if ((doc = bson_new_from_json(tmpdoc, -1, &error)) == NULL) {
-    warnx("%d.%d %s", error.domain, error.code, error.message);
-    return -1;
+    if ((array = bson_new_from_json(tmpdoc, -1, &error)) == NULL) {
+      warnx("%d.%d %s", error.domain, error.code, error.message);
+      return -1;
+    }
+
+    if (!bson_iter_init_find(&it, array, "d") || !BSON_ITER_HOLDS_ARRAY(&it) ||
+        !bson_iter_recurse(&it, &elems)) {
+      warnx("expected an array of documents");
+      goto cleanup;
+    }
+
+    while (bson_iter_next(&elems)) {
+      if (!BSON_ITER_HOLDS_DOCUMENT(&elems)) {
+        warnx("document %zu: not a document", ndocs);
+        goto cleanup;
+      }
+      if (ndocs == docssize) {
+        docssize = docssize ? docssize * 2 : 64;
+        if ((docs = reallocarray(docs, docssize, sizeof(*docs))) == NULL)
+          err(1, "exec_insert");
+      }
+      bson_iter_document(&elems, &datalen, &data);
+      if ((docs[ndocs] = bson_new_from_data(data, datalen)) == NULL)
+        errx(1, "exec_insert");
+      ndocs++;
+    }
+  } else {
+    /* one or more documents or ids */
+    while (line[strspn(line, " \t")] != '\0') {
+      if ((offset = parse_selector(tmpdoc, sizeof(tmpdocs), line, len)) == -1)
+        goto cleanup;
+      if (offset == 0)
+        break;
+
+      line += offset;
+      len -= offset;
+
+      if (ndocs == docssize) {
+        docssize = docssize ? docssize * 2 : 64;
+        if ((docs = reallocarray(docs, docssize, sizeof(*docs))) == NULL)
+          err(1, "exec_insert");
+      }
+
+      /* try to parse the doc as json and convert to bson */
+      if ((docs[ndocs] = bson_new_from_json(tmpdoc, -1, &error)) == NULL) {
+        warnx("document %zu: %d.%d %s", ndocs, error.domain, error.code, error.message);
+        goto cleanup;
+      }
+      ndocs++;
+    }
+  }
+
+  if (ndocs == 0) {
+    ret = ILLEGAL;
+    goto cleanup;
+  }
+
+  bson_init(&opts);
+  if (unordered)
+    BSON_APPEND_BOOL(&opts, "ordered", false);
+
+  /* execute insert */
+  start = bson_get_monotonic_time();
+  ret = mongoc_collection_insert_many(collection, (const bson_t **)docs, ndocs, &opts, &reply,
+      &error) ? 0 : -1;
+  tm.server += bson_get_monotonic_time() - start;
+  bson_destroy(&opts);
+
+  /* report every document that failed, or the error if none is reported */
+  if (ret == -1) {
+    if (bson_iter_init_find(&it, &reply, "writeErrors") && BSON_ITER_HOLDS_ARRAY(&it) &&
+        bson_iter_recurse(&it, &elems)) {
+      while (bson_iter_next(&elems)) {
+        bson_iter_document(&elems, &datalen, &data);
+        if (!bson_init_static(&elem, data, datalen))
+          continue;
+        warnx("document %lld: %lld %s", (long long)bson_lookup_int64(&elem, "index"),
+            (long long)bson_lookup_int64(&elem, "code"),
+            bson_iter_init_find(&wit, &elem, "errmsg") ? bson_iter_utf8(&wit, NULL) : "");
+      }
+    } else {
+      warnx("%d.%d %s", error.domain, error.code, error.message);
+    }
+  }
+
+  inserted = bson_lookup_int64(&reply, "insertedCount");
+  for (i = 0, bytes = 0; i < ndocs; i++)
+    bytes += docs[i]->len;
+  count_docs(inserted, bytes);
+
+  if (ndocs > 1)
+    fprintf(outfp(), "%lld of %zu documents inserted\n", (long long)inserted, ndocs);
+
+  bson_destroy(&reply);
+
+cleanup:
+  for (i = 0; i < ndocs; i++)
+    bson_destroy(docs[i]);
+  free(docs);
+  if (array)
+    bson_destroy(array);
+
+  return ret;
+}
+
+/* parse remove command, expect one selector */
+int exec_remove(mongoc_collection_t *collection, const char *line, int len)
+{
+  long offset;
+  bson_error_t error;
+  bson_t *doc;
+  int64_t start;
+
+  /* remove in batches if --chunk is given */
+  if (strncmp(line + strspn(line, " \t"), "--", 2) == 0)
+    return exec_chunked(collection, REMOVE, line, len);
+
+  /* read first json object */
+  if ((offset = parse_selector(tmpdoc, sizeof(tmpdocs), line, len)) == -1)
+    return ILLEGAL;
+  if (offset == 0)
+    return ILLEGAL;
+
+  /* try to parse the doc as json and convert to bson */
+  if ((doc = bson_new_from_json(tmpdoc, -1, &error)) == NULL) {
+    warnx("%d.%d %s", error.domain, error.code, error.message);
+    return -1;
+  }
+
+  /* execute remove */
+  start = bson_get_monotonic_time();
+  if (!mongoc_collection_remove(collection, MONGOC_REMOVE_NONE, doc, NULL, &error)) {
+    warnx("%d.%d %s", error.domain, error.code, error.message);
+    bson_destroy(doc);
+    return -1;
+  }
+  tm.server += bson_get_monotonic_time() - start;
+
+  bson_destroy(doc);
+
+  return 0;
+}
+
+/*
+ * Remove or update the documents that match a selector in batches of --chunk
+ * documents. The _ids of every batch are read in index order, starting after
+ * the last _id of the previous batch, and the batch is removed or updated by
+ * _id. If --max-lag is given, the next batch waits until every secondary is at
+ * most that many seconds behind the primary, so the pause grows with the time
+ * the secondaries need to catch up.
+ *
+ * return 0 on success, -1 on failure
+ */
+int
+exec_chunked(mongoc_collection_t *collection, int cmd, const char *line, int len)
+{
+  unsigned char update_docs[MAXDOC];
+  mongoc_client_t *lagclient;
+  mongoc_cursor_t *cursor;
+  bson_error_t error;
+  bson_iter_t it;
+  bson_value_t last;
+  const bson_t *doc;
+  bson_t *sel, *update, query, opts, batch, and, cond, gt, ids, in, reply;
+  char key[16];
+  int64_t start, lag, throttled, affected, batches;
+  long chunk, maxlag, offset;
+  int n, haslast, ret;
+
+  if ((offset = parse_chunk_opts(line, &chunk, &maxlag)) == -1 || chunk == 0) {
+    warnx("usage: %s --chunk n [--max-lag seconds] selector%s", cmd == REMOVE ? "remove" : "update",
+        cmd == REMOVE ? "" : " doc");
+    return -1;
+  }
+  line += offset;
+  len -= offset;
+
+  if ((offset = parse_selector(tmpdoc, sizeof(tmpdocs), line, len)) == -1)
+    return ILLEGAL;
+  if (offset == 0)
+    return ILLEGAL;
+  line += offset;
+  len -= offset;
+
+  if ((sel = bson_new_from_json(tmpdoc, -1, &error)) == NULL) {
+    warnx("%d.%d %s", error.domain, error.code, error.message);
+    return -1;
+  }
+
+  update = NULL;
+  if (cmd == UPDATE) {
+    start = bson_get_monotonic_time();
+    if ((offset = relaxed_to_strict(update_docs, MAXDOC, line, len, 1)) <= 0) {
+      if (offset < 0)
+        warnx("jsonify error: %ld", offset);
+      bson_destroy(sel);
+      return ILLEGAL;
+    }
+    tm.parse += bson_get_monotonic_time() - start;
+
+    if ((update = bson_new_from_json(update_docs, -1, &error)) == NULL) {
+      warnx("%d.%d %s", error.domain, error.code, error.message);
+      bson_destroy(sel);
+      return -1;
+    }
+  }
+
+  /* only _ids are needed, in index order */
+  bson_init(&opts);
+  BSON_APPEND_DOCUMENT_BEGIN(&opts, "projection", &cond);
+  BSON_APPEND_INT32(&cond, "_id", 1);
+  bson_append_document_end(&opts, &cond);
+  BSON_APPEND_DOCUMENT_BEGIN(&opts, "sort", &cond);
+  BSON_APPEND_INT32(&cond, "_id", 1);
+  bson_append_document_end(&opts, &cond);
+  BSON_APPEND_INT64(&opts, "limit", chunk);
+
+  lagclient = maxlag >= 0 ? mongoc_client_pool_pop(get_pool()) : NULL;
+
+  ret = 0;
+  haslast = 0;
+  affected = batches = throttled = 0;
+  while (!*cancel) {
+    /* the selector and, after the first batch, the _ids after the last one */
+    bson_init(&query);
+    bson_append_array_begin(&query, "$and", -1, &and);
+    BSON_APPEND_DOCUMENT(&and, "0", sel);
+    if (haslast) {
+      BSON_APPEND_DOCUMENT_BEGIN(&and, "1", &cond);
+      BSON_APPEND_DOCUMENT_BEGIN(&cond, "_id", &gt);
+      bson_append_value(&gt, "$gt", -1, &last);
+      bson_append_document_end(&cond, &gt);
+      bson_append_document_end(&and, &cond);
+    }
+    bson_append_array_end(&query, &and);
+
+    /* read the _ids of the next batch */
+    bson_init(&batch);
+    bson_append_array_begin(&batch, "$and", -1, &and);
+    BSON_APPEND_DOCUMENT(&and, "0", sel);
+    BSON_APPEND_DOCUMENT_BEGIN(&and, "1", &cond);
+    BSON_APPEND_DOCUMENT_BEGIN(&cond, "_id", &ids);
+    bson_append_array_begin(&ids, "$in", -1, &in);
+
+    start = bson_get_monotonic_time();
+    cursor = mongoc_collection_find_with_opts(collection, &query, &opts, NULL);
+    for (n = 0; mongoc_cursor_next(cursor, &doc); n++) {
+      if (!bson_iter_init_find(&it, doc, "_id"))
+        continue;
+      snprintf(key, sizeof(key), "%d", n);
+      bson_append_value(&in, key, -1, bson_iter_value(&it));
+      if (haslast)
+        bson_value_destroy(&last);
+      bson_value_copy(bson_iter_value(&it), &last);
+      haslast = 1;
+    }
+    if (mongoc_cursor_error(cursor, &error)) {
+      warnx("cursor failed: %d.%d %s", error.domain, error.code, error.message);
+      ret = -1;
+    }
+    mongoc_cursor_destroy(cursor);
+
+    bson_append_array_end(&ids, &in);
+    bson_append_document_end(&cond, &ids);
+    bson_append_document_end(&and, &cond);
+    bson_append_array_end(&batch, &and);
+    bson_destroy(&query);
+
+    if (ret == -1 || n == 0) {
+      tm.server += bson_get_monotonic_time() - start;
+      bson_destroy(&batch);
+      break;
+    }
+
+    /* documents that no longer match the selector are left alone */
+    if (cmd == REMOVE) {
+      if (!mongoc_collection_delete_many(collection, &batch, NULL, &reply, &error))
+        ret = -1;
+      affected += bson_lookup_int64(&reply, "deletedCount");
+    } else {
+      if (!mongoc_collection_update_many(collection, &batch, update, NULL, &reply, &error))
+        ret = -1;
+      affected += bson_lookup_int64(&reply, "modifiedCount");
+    }
+    tm.server += bson_get_monotonic_time() - start;
+    count_docs(n, 0);
+    batches++;
+
+    bson_destroy(&reply);
+    bson_destroy(&batch);
+
+    if (ret == -1) {
+      warnx("%d.%d %s", error.domain, error.code, error.message);
+      break;
+    }
+
+    if (n < chunk)
+      break;
+
+    /* wait for the secondaries to catch up */
+    start = bson_get_monotonic_time();
+    while (lagclient != NULL && !*cancel) {
+      if (replication_lag(lagclient, &lag) == -1) {
+        warnx("can't determine replication lag, not throttling");
+        mongoc_client_pool_push(get_pool(), lagclient);
+        lagclient = NULL;
+        break;
+      }
+      if (lag <= maxlag * 1000)
+        break;
+      usleep(LAGPOLL);
+    }
+    throttled += bson_get_monotonic_time() - start;
+  }
+
+  if (lagclient != NULL)
+    mongoc_client_pool_push(get_pool(), lagclient);
+  if (haslast)
+    bson_value_destroy(&last);
+  bson_destroy(&opts);
+  bson_destroy(sel);
+  if (update)
+    bson_destroy(update);
+
+  fprintf(outfp(), "%lld documents %s in %lld batches", (long long)affected,
+      cmd == REMOVE ? "removed" : "modified", (long long)batches);
+  if (maxlag >= 0)
+    fprintf(outfp(), ", throttled %.1fs", throttled / 1e6);
+  fprintf(outfp(), "\n");
+
+  return ret;
+}
+
+/*
+ * Parse --chunk n and --max-lag seconds. chunk is 0 and maxlag -1 if not given,
+ * a maxlag of 0 waits until every secondary caught up.
+ *
+ * return the number of characters consumed on success, -1 on failure
+ */
+long
+parse_chunk_opts(const char *line, long *chunk, long *maxlag)
+{
+  const char *cp;
+  char *end;
+  long *v;
+  size_t n;
+
+  *chunk = 0;
+  *maxlag = -1;
+
+  cp = line;
+  for (;;) {
+    cp += strspn(cp, " \t");
+    n = strcspn(cp, " \t");
+    if (n == 7 && strncmp(cp, "--chunk", 7) == 0)
+      v = chunk;
+    else if (n == 9 && strncmp(cp, "--max-lag", 9) == 0)
+      v = maxlag;
+    else
+      break;
+
+    cp += n;
+    cp += strspn(cp, " \t");
+    if (*cp < '0' || *cp > '9')
+      return -1;
+    errno = 0;
+    *v = strtol(cp, &end, 10);
+    if (errno || *v > INT_MAX || (*end != '\0' && *end != ' ' && *end != '\t'))
+      return -1;
+    cp = end;
+  }
+
+  return cp - line;
+}
+
+/*
+ * Determine how many milliseconds the furthest behind secondary lags behind
+ * the primary using replSetGetStatus.
+ *
+ * return 0 on success, -1 on failure
+ */
+int
+replication_lag(mongoc_client_t *client, int64_t *lag)
+{
+  bson_error_t error;
+  bson_iter_t it, members, member;
+  bson_t *cmd, reply;
+  const uint8_t *data;
+  uint32_t datalen;
+  bson_t m;
+  int64_t primary, oldest, optime;
+  int state;
+
+  cmd = BCON_NEW("replSetGetStatus", BCON_INT32(1));
+  if (!mongoc_client_command_simple(client, "admin", cmd, NULL, &reply, &error)) {
+    warnx("%d.%d %s", error.domain, error.code, error.message);
+    bson_destroy(cmd);
+    bson_destroy(&reply);
+    return -1;
+  }
+  bson_destroy(cmd);
+
+  primary = oldest = -1;
+  if (bson_iter_init_find(&it, &reply, "members") && BSON_ITER_HOLDS_ARRAY(&it) &&
+      bson_iter_recurse(&it, &members)) {
+    while (bson_iter_next(&members)) {
+      if (!BSON_ITER_HOLDS_DOCUMENT(&members))
+        continue;
+      bson_iter_document(&members, &datalen, &data);
+      if (!bson_init_static(&m, data, datalen))
+        continue;
+      if (!bson_iter_init_find(&member, &m, "optimeDate") || !BSON_ITER_HOLDS_DATE_TIME(&member))
+        continue;
+      optime = bson_iter_date_time(&member);
+      state = bson_lookup_int64(&m, "state");
+      if (state == 1)
+        primary = optime;
+      else if (state == 2 && (oldest == -1 || optime < oldest))
+        oldest = optime;
+    }
+  }
+  bson_destroy(&reply);
+
+  if (primary == -1)
+    return -1;
+
+  *lag = oldest == -1 || oldest > primary ? 0 : primary - oldest;
+
+  return 0;
+}
+
+/* execute a query, a glob is resolved relative to ns
+ * return 0 on success, -1 on failure
+ */
+int exec_query(const path_t *ns, mongoc_collection_t *collection, const char *line, int len,
+    int idsonly)
+{
+  mongoc_cursor_t *cursor;
+  bson_error_t error;
+  const bson_t *doc;
+  bson_t *query, *fields;
+  struct winsize w;
+  int64_t start, now;
+
+  /* query every collection that matches a glob */
+  if (!idsonly && glob_arg(line))
+    return exec_globquery(ns, FIND, line, len);
+
+  if (sizeof(tmpdocs) < 3)
+    errx(1, "exec_query");
+  /* default to all documents */
+  tmpdoc[0] = '{';
+  tmpdoc[1] = '}';
+  tmpdoc[2] = '\0';
+
+  if (parse_selector(tmpdoc, sizeof(tmpdocs), line, len) == -1)
+    return -1;
+
+  /* try to parse it as json and convert to bson */
+  if ((query = bson_new_from_json(tmpdoc, -1, &error)) == NULL) {
+    warnx("%d.%d %s", error.domain, error.code, error.message);
+    return -1;
+  }
+
+  if (idsonly)
+    if ((fields = bson_new_from_json((unsigned char *)"{ \"_id\": true }", -1, &error)) == NULL) {
+      warnx("%d.%d %s", error.domain, error.code, error.message);
+      bson_destroy(query);
+      return -1;
+    }
+
+  cursor = mongoc_collection_find(collection, MONGOC_QUERY_NONE, 0, 0, 0, query, idsonly ? fields : NULL, NULL);
+
+  ioctl(0, TIOCGWINSZ, &w);
+
+  start = bson_get_monotonic_time();
+  while (!*cancel && mongoc_cursor_next(cursor, &doc)) {
+    now = bson_get_monotonic_time();
+    tm.server += now - start;
+    count_docs(1, doc->len);
+
+    if (print_doc(doc, w.ws_col) == -1) {
+      mongoc_cursor_destroy(cursor);
+      bson_destroy(query);
+      if (idsonly)
+        bson_destroy(fields);
+      return -1;
+    }
+
+    start = bson_get_monotonic_time();
+    tm.output += start - now;
+  }
+  tm.server += bson_get_monotonic_time() - start;
+
+  /* destroying the cursor also kills it on the server */
+  if (*cancel || mongoc_cursor_error(cursor, &error)) {
+    if (*cancel)
+      warnx("interrupted");
+    else
+      warnx("cursor failed: %d.%d %s", error.domain, error.code, error.message);
+    mongoc_cursor_destroy(cursor);
+    bson_destroy(query);
+    if (idsonly)
+      bson_destroy(fields);
+    return -1;
+  }
+
+  mongoc_cursor_destroy(cursor);
+
+  bson_destroy(query);
+  if (idsonly)
+    bson_destroy(fields);
+
+  return 0;
+}
+
+/* state shared by the workers of a find or count on many collections */
+struct globquery {
+  int cmd;
+  const path_t *ns;
+  const bson_t *query;
+  FILE *out;                      /* output of the calling thread */
+  volatile sig_atomic_t *cancel;  /* cancel flag of the calling thread */
+  pthread_mutex_t mtx;            /* protects out and the counters */
+  int64_t count;
+  int64_t docs;
+  int64_t bytes;
+};
+
+/* return 1 if word contains glob characters and is not a document, 0 otherwise */
+int
+isglob(const char *word)
+{
+  return word[0] != '{' && strpbrk(word, "*?") != NULL;
+}
+
+/*
+ * Check if the arguments of find or count start with a glob, optionally
+ * preceded by -p n.
+ *
+ * return 1 if so, 0 otherwise
+ */
+int
+glob_arg(const char *line)
+{
+  char word[MAXDBNAME + MAXCOLLNAME + 2];
+  size_t n;
+
+  line += strspn(line, " \t");
+  if (strncmp(line, "-p", 2) == 0 && strchr(" \t", line[2]) != NULL) {
+    line += 2;
+    line += strspn(line, " \t");
+    line += strcspn(line, " \t");
+    line += strspn(line, " \t");
+  }
+
+  if ((n = strcspn(line, " \t")) == 0 || n >= sizeof(word))
+    return 0;
+  memcpy(word, line, n);
+  word[n] = '\0';
+
+  return isglob(word);
+}
+
+/*
+ * Run find or count with the same selector on every collection that matches a
+ * glob, concurrently on at most -p collections. Every document or count is
+ * printed as soon as it arrives, preceded by its namespace. count prints the
+ * total at the end. A relative glob is resolved against cwd.
+ *
+ * return 0 on success, -1 on failure
+ */
+int
+exec_globquery(const path_t *cwd, const int cmd, const char *line, int len)
+{
+  struct globquery gq;
+  mongoc_client_t *c;
+  bson_error_t error;
+  bson_t *query;
+  path_t pattern, *ns;
+  char glob[MAXDBNAME + MAXCOLLNAME + 2], *end;
+  const char *cp;
+  size_t n, wl;
+  long parallel;
+  int64_t start;
+  int ret;
+
+  parallel = GLOBWORKERS;
+  cp = line + strspn(line, " \t");
+  if (strncmp(cp, "-p", 2) == 0 && strchr(" \t", cp[2]) != NULL) {
+    cp += 2;
+    cp += strspn(cp, " \t");
+    parallel = strtol(cp, &end, 10);
+    if (end == cp || parallel < 1 || parallel > MAXWORKERS || strchr(" \t", *end) == NULL) {
+      warnx("usage: %s [-p 1..%d] glob [selector]", cmd == FIND ? "find" : "count", MAXWORKERS);
+      return -1;
+    }
+    cp = end + strspn(end, " \t");
+  }
+
+  if ((wl = strcspn(cp, " \t")) >= sizeof(glob)) {
+    warnx("glob too long");
+    return -1;
+  }
+  memcpy(glob, cp, wl);
+  glob[wl] = '\0';
+  cp += wl;
+  len -= cp - line;
+  line = cp;
+
+  pattern = *cwd;
+  if (parse_path(glob, &pattern, NULL, NULL) < 0 || !strlen(pattern.collname)) {
+    warnx("glob must match collections: %s", glob);
+    return -1;
+  }
+
+  /* default to all documents */
+  strlcpy((char *)tmpdoc, "{}", sizeof(tmpdocs));
+  if (parse_selector(tmpdoc, sizeof(tmpdocs), line, len) == -1)
+    return -1;
+
+  if ((query = bson_new_from_json(tmpdoc, -1, &error)) == NULL) {
+    warnx("%d.%d %s", error.domain, error.code, error.message);
+    return -1;
+  }
+
+  c = mongoc_client_pool_pop(get_pool());
+  ret = match_namespaces(c, &pattern, &ns, &n);
+  mongoc_client_pool_push(get_pool(), c);
+  if (ret == -1) {
+    bson_destroy(query);
+    return -1;
+  }
+
+  if (n == 0)
+    warnx("no collection matches %s", glob);
+
+  gq.cmd = cmd;
+  gq.ns = ns;
+  gq.query = query;
+  gq.out = outfp();
+  gq.cancel = cancel;
+  gq.count = gq.docs = gq.bytes = 0;
+  if (pthread_mutex_init(&gq.mtx, NULL) != 0)
+    errx(1, "exec_globquery: can't initialize mutex");
+
+  start = bson_get_monotonic_time();
+  ret = fanout(globquery_worker, &gq, n, parallel);
+  tm.server += bson_get_monotonic_time() - start;
+  count_docs(gq.docs, gq.bytes);
+
+  if (*cancel) {
+    warnx("interrupted");
+    ret = -1;
+  } else if (cmd == COUNT) {
+    fprintf(gq.out, "%lld\n", (long long)gq.count);
+  }
+
+  pthread_mutex_destroy(&gq.mtx);
+  free(ns);
+  bson_destroy(query);
+
+  return ret;
+}
+
+/*
+ * Run the find or count of the globquery arg on the i'th namespace. Runs on a
+ * fanout worker.
+ *
+ * return 0 on success, -1 on failure
+ */
+int
+globquery_worker(mongoc_client_t *client, void *arg, size_t i)
+{
+  struct globquery *gq = arg;
+  const path_t *ns = &gq->ns[i];
+  mongoc_collection_t *coll;
+  mongoc_cursor_t *cursor;
+  bson_error_t error;
+  const bson_t *doc;
+  int64_t count;
+  char *str;
+  int ret;
+
+  if (*gq->cancel)
+    return -1;
+
+  coll = mongoc_client_get_collection(client, ns->dbname, ns->collname);
+
+  ret = 0;
+  if (gq->cmd == COUNT) {
+    count = mongoc_collection_count(coll, MONGOC_QUERY_NONE, gq->query, 0, 0, NULL, &error);
+    pthread_mutex_lock(&gq->mtx);
+    if (count == -1) {
+      warnx("/%s/%s: %d.%d %s", ns->dbname, ns->collname, error.domain, error.code, error.message);
+      ret = -1;
+    } else {
+      fprintf(gq->out, "/%s/%s %lld\n", ns->dbname, ns->collname, (long long)count);
+      gq->count += count;
+    }
+    pthread_mutex_unlock(&gq->mtx);
+  } else {
+    cursor = mongoc_collection_find_with_opts(coll, gq->query, NULL, NULL);
+    while (!*gq->cancel && mongoc_cursor_next(cursor, &doc)) {
+      str = bson_as_json(doc, NULL);
+      pthread_mutex_lock(&gq->mtx);
+      fprintf(gq->out, "/%s/%s %s\n", ns->dbname, ns->collname, str);
+      gq->docs++;
+      gq->bytes += doc->len;
+      pthread_mutex_unlock(&gq->mtx);
+      bson_free(str);
+    }
+    if (mongoc_cursor_error(cursor, &error)) {
+      warnx("/%s/%s: cursor failed: %d.%d %s", ns->dbname, ns->collname, error.domain,
+          error.code, error.message);
+      ret = -1;
+    }
+    mongoc_cursor_destroy(cursor);
+  }
+
+  mongoc_collection_destroy(coll);
+
+  return ret;
+}
+
+/*
+ * Find every collection whose database and collection name match the globs in
+ * pattern. System collections only match if the collection glob starts with
+ * "system.". ns is allocated and must be freed by the caller.
+ *
+ * return 0 on success, -1 on failure
+ */
+int
+match_namespaces(mongoc_client_t *client, const path_t *pattern, path_t **ns, size_t *n)
+{
+  mongoc_database_t *db;
+  bson_error_t error;
+  char **dbs, **colls;
+  size_t i, j, size;
+  int system;
+
+  if (isglob(pattern->dbname)) {
+    if ((dbs = mongoc_client_get_database_names(client, &error)) == NULL) {
+      warnx("cursor failed: %d.%d %s", error.domain, error.code, error.message);
+      return -1;
+    }
+  } else {
+    if ((dbs = bson_malloc0(2 * sizeof(*dbs))) == NULL)
+      err(1, "match_namespaces");
+    dbs[0] = bson_strdup(pattern->dbname);
+  }
+
+  system = strncmp(pattern->collname, "system.", 7) == 0;
+
+  *ns = NULL;
+  *n = size = 0;
+  for (i = 0; dbs[i]; i++) {
+    if (fnmatch(pattern->dbname, dbs[i], 0) != 0)
+      continue;
+
+    db = mongoc_client_get_database(client, dbs[i]);
+    colls = mongoc_database_get_collection_names(db, &error);
+    mongoc_database_destroy(db);
+    if (colls == NULL) {
+      warnx("/%s: cursor failed: %d.%d %s", dbs[i], error.domain, error.code, error.message);
+      continue;
+    }
+
+    for (j = 0; colls[j]; j++) {
+      if (fnmatch(pattern->collname, colls[j], 0) != 0)
+        continue;
+      if (!system && strncmp(colls[j], "system.", 7) == 0)
+        continue;
+
+      if (*n == size) {
+        size = size ? size * 2 : 64;
+        if ((*ns = reallocarray(*ns, size, sizeof(**ns))) == NULL)
+          err(1, "match_namespaces");
+      }
+      if (strlcpy((*ns)[*n].dbname, dbs[i], MAXDBNAME) >= MAXDBNAME ||
+          strlcpy((*ns)[*n].collname, colls[j], MAXCOLLNAME) >= MAXCOLLNAME)
+        errx(1, "namespace too long");
+      (*n)++;
+    }
+    bson_strfreev(colls);
+  }
+
+  bson_strfreev(dbs);
+
+  return 0;
+}
+
+/*
+ * Print doc as json, in human readable format if it does not fit on a line of
+ * cols characters.
+ *
+ * return 0 on success, -1 on failure
+ */
+int
+print_doc(const bson_t *doc, size_t cols)
+{
+  char *str;
+  size_t rlen;
+  long i;
+
+  str = bson_as_json(doc, &rlen);
+  if (hr && rlen > cols) {
+    if ((i = human_readable(tmpdoc, sizeof(tmpdocs), str, rlen)) < 0) {
+      warnx("jsonify error: %ld", i);
+      bson_free(str);
+      return -1;
+    }
+    if (!quiet)
+      fprintf(outfp(), "%s\n", tmpdoc);
+  } else if (!quiet) {
+    fprintf(outfp(), "%s\n", str);
+  }
+  bson_free(str);
+
+  return 0;
+}
+
+/*
+ * Print the last documents of a collection in natural order, optionally
+ * starting at an oplog timestamp. If follow is set, keep printing documents
+ * as they are added to the capped collection using a tailable cursor.
+ *
+ * return 0 on success, -1 on failure
+ */
+int
+exec_tail(mongoc_collection_t *collection, const char *line, int len)
+{
+  mongoc_cursor_t *cursor;
+  bson_error_t error;
+  const bson_t *doc;
+  bson_t *query, *opts, *last, *bound, and, cond, gte;
+  bson_iter_t it;
+  struct winsize w;
+  int64_t start, now, seen, count, skip;
+  uint32_t ts, inc;
+  long n, off;
+  int i, follow, await, failed;
+  char *json, awaitopts[100];
+
+  if ((off = parse_tail_opts(line, &follow, &n, &await, &ts, &inc)) == -1) {
+    warnx("usage: tail [-f] [-n count] [-w ms] [-t secs[:inc]] [selector]");
+    return -1;
+  }
+  line += off;
+  len -= off;
+
+  if (sizeof(tmpdocs) < 3)
+    errx(1, "exec_tail");
+  /* default to all documents */
+  tmpdoc[0] = '{';
+  tmpdoc[1] = '}';
+  tmpdoc[2] = '\0';
+
+  if (parse_selector(tmpdoc, sizeof(tmpdocs), line, len) == -1)
+    return -1;
+
+  /* start at a timestamp, the server can seek to it in the oplog */
+  if (ts || inc)
+    json = bson_strdup_printf("{ \"$and\": [ %s, { \"ts\": { \"$gte\": "
+        "{ \"$timestamp\": { \"t\": %u, \"i\": %u } } } } ] }", tmpdoc, ts, inc);
+  else
+    json = bson_strdup_printf("%s", tmpdoc);
+
+  query = bson_new_from_json((unsigned char *)json, -1, &error);
+  bson_free(json);
+  if (query == NULL) {
+    warnx("%d.%d %s", error.domain, error.code, error.message);
+    return -1;
+  }
+
+  /*
+   * Otherwise start at the last n documents. In the oplog read them backwards
+   * and start at the ts of the oldest, so the server can seek to it. Other
+   * capped collections have no field that follows natural order, so skip all
+   * but the last n there. With n 0 start after the last document.
+   */
+  skip = 0;
+  if (!ts && !inc && strncmp(mongoc_collection_get_name(collection), "oplog.", 6) == 0) {
+    start = bson_get_monotonic_time();
+    last = find_nth_last(collection, query, n > 0 ? n : 1, &error);
+    tm.server += bson_get_monotonic_time() - start;
+    if (last == NULL && error.code != 0) {
+      warnx("cursor failed: %d.%d %s", error.domain, error.code, error.message);
+      bson_destroy(query);
+      return -1;
+    }
+
+    if (last != NULL && bson_iter_init_find(&it, last, "ts") && BSON_ITER_HOLDS_TIMESTAMP(&it)) {
+      bson_iter_timestamp(&it, &ts, &inc);
+      bound = bson_new();
+      bson_append_array_begin(bound, "$and", -1, &and);
+      BSON_APPEND_DOCUMENT(&and, "0", query);
+      bson_append_document_begin(&and, "1", -1, &cond);
+      bson_append_document_begin(&cond, "ts", -1, &gte);
+      bson_append_iter(&gte, n > 0 ? "$gte" : "$gt", -1, &it);
+      bson_append_document_end(&cond, &gte);
+      bson_append_document_end(&and, &cond);
+      bson_append_array_end(bound, &and);
+      bson_destroy(query);
+      query = bound;
+    }
+    if (last != NULL)
+      bson_destroy(last);
+  } else if (!ts && !inc) {
+    start = bson_get_monotonic_time();
+    count = mongoc_collection_count_documents(collection, query, NULL, NULL, NULL, &error);
+    tm.server += bson_get_monotonic_time() - start;
+    if (count < 0) {
+      warnx("%d.%d %s", error.domain, error.code, error.message);
+      bson_destroy(query);
+      return -1;
+    }
+    if (count > n)
+      skip = count - n;
+  }
+
+  if (follow)
+    snprintf(awaitopts, sizeof(awaitopts), ", \"tailable\": true, "
+        "\"awaitData\": true, \"maxAwaitTimeMS\": %d", await);
+  else
+    awaitopts[0] = '\0';
+
+  json = bson_strdup_printf("{ \"sort\": { \"$natural\": 1 }, \"skip\": %lld%s%s }",
+      (long long)skip, awaitopts, (ts || inc) ? ", \"oplogReplay\": true" : "");
+  opts = bson_new_from_json((unsigned char *)json, -1, &error);
+  bson_free(json);
+  if (opts == NULL) {
+    warnx("%d.%d %s", error.domain, error.code, error.message);
+    bson_destroy(query);
+    return -1;
+  }
+
+  ioctl(0, TIOCGWINSZ, &w);
+
+  seen = 0;
+  failed = 0;
+  cursor = mongoc_collection_find_with_opts(collection, query, opts, NULL);
+
+  start = bson_get_monotonic_time();
+  for (;;) {
+    while (!*cancel && mongoc_cursor_next(cursor, &doc)) {
+      now = bson_get_monotonic_time();
+      tm.server += now - start;
+      count_docs(1, doc->len);
+      seen++;
+
+      if (print_doc(doc, w.ws_col) == -1) {
+        failed = 1;
+        break;
+      }
+
+      start = bson_get_monotonic_time();
+      tm.output += start - now;
+    }
+    tm.server += bson_get_monotonic_time() - start;
+
+    /* show every batch as soon as it arrives */
+    fflush(outfp());
+
+    if (failed || *cancel || mongoc_cursor_error(cursor, &error) || !follow)
+      break;
+
+    /*
+     * The server closes a tailable cursor if there was nothing to return when
+     * it was opened. After that it is only closed if the capped collection
+     * wrapped around before all documents were read.
+     */
+    if (!mongoc_cursor_more(cursor)) {
+      if (seen) {
+        warnx("tailable cursor closed by the server");
+        failed = 1;
+        break;
+      }
+      mongoc_cursor_destroy(cursor);
+      for (i = 0; i < await && !*cancel; i += 100)
+        usleep(100000);
+      cursor = mongoc_collection_find_with_opts(collection, query, opts, NULL);
+    }
+
+    start = bson_get_monotonic_time();
+  }
+
+  /* destroying the cursor also kills it on the server */
+  if (!failed && (*cancel || mongoc_cursor_error(cursor, &error))) {
+    if (*cancel)
+      warnx("interrupted");
+    else
+      warnx("cursor failed: %d.%d %s", error.domain, error.code, error.message);
+    failed = 1;
+  }
+
+  mongoc_cursor_destroy(cursor);
+  bson_destroy(opts);
+  bson_destroy(query);
+
+  return failed ? -1 : 0;
+}
+
+/*
+ * Return a copy of the n'th last document in natural order that matches query,
+ * or the first if there are less than n. The collection is read backwards, so
+ * only the last n documents are scanned. The copy must be freed by the caller.
+ *
+ * return the document on success, NULL if there is none or on failure, in which
+ * case error.code is set
+ */
+bson_t *
+find_nth_last(mongoc_collection_t *collection, const bson_t *query, long n, bson_error_t *error)
+{
+  mongoc_cursor_t *cursor;
+  const bson_t *doc;
+  bson_t *opts, *ret;
+
+  memset(error, 0, sizeof(*error));
+  opts = BCON_NEW("sort", "{", "$natural", BCON_INT32(-1), "}", "limit", BCON_INT64(n));
+
+  /* doc is only valid until the next call of mongoc_cursor_next */
+  ret = NULL;
+  cursor = mongoc_collection_find_with_opts(collection, query, opts, NULL);
+  while (!*cancel && mongoc_cursor_next(cursor, &doc)) {
+    if (ret != NULL)
+      bson_destroy(ret);
+    ret = bson_copy(doc);
+  }
+
+  if (mongoc_cursor_error(cursor, error) && ret != NULL) {
+    bson_destroy(ret);
+    ret = NULL;
+  }
+
+  mongoc_cursor_destroy(cursor);
+  bson_destroy(opts);
+
+  return ret;
+}
+
+/*
+ * Parse the options of tail. The number of documents to print is stored in n,
+ * the time a tailable cursor waits for new documents in await and the start
+ * time in ts and inc.
+ *
+ * return the number of characters consumed on success, -1 on failure
+ */
+long
+parse_tail_opts(const char *line, int *follow, long *n, int *await, uint32_t *ts, uint32_t *inc)
+{
+  const char *cp, *arg;
+  char *end;
+  unsigned long v;
+
+  *follow = 0;
+  *n = TAILDOCS;
+  *await = TAILAWAIT;
+  *ts = 0;
+  *inc = 0;
+
+  cp = line;
+  for (;;) {
+    cp += strspn(cp, " \t");
+    if (cp[0] != '-' || cp[1] == '\0' || cp[1] == ' ' || cp[1] == '\t')
+      break;
+
+    for (cp++; *cp != '\0' && *cp != ' ' && *cp != '\t'; cp++) {
+      if (*cp == 'f') {
+        *follow = 1;
+        continue;
+      }
+
+      /* all other options take a number as the next word */
+      arg = cp + 1;
+      arg += strspn(arg, " \t");
+      if (*arg < '0' || *arg > '9')
+        return -1;
+      errno = 0;
+      v = strtoul(arg, &end, 10);
+      if (errno || v > INT_MAX)
+        return -1;
+
+      switch (*cp) {
+      case 'n':
+        *n = v;
+        break;
+      case 'w':
+        *await = v;
+        break;
+      case 't':
+        *ts = v;
+        if (*end == ':') {
+          arg = end + 1;
+          if (*arg < '0' || *arg > '9')
+            return -1;
+          v = strtoul(arg, &end, 10);
+          if (errno || v > INT_MAX)
+            return -1;
+          *inc = v;
+        }
+        break;
+      default:
+        return -1;
+      }
+
+      if (*end != '\0' && *end != ' ' && *end != '\t')
+        return -1;
+      cp = end - 1;
+    }
+  }
+
+  return cp - line;
+}
+
+/*
+ * Print the change events of the current collection, database or, if no
+ * database is selected, of the whole cluster until interrupted. If resumefile
+ * is set, the last resume token is kept in it and a restarted watch continues
+ * after the last event that was seen.
+ *
+ * return 0 on success, -1 on failure
+ */
+int
+exec_watch(const char *line, int len)
+{
+  mongoc_change_stream_t *stream;
+  mongoc_database_t *db;
+  bson_error_t error;
+  const bson_t *doc, *reply;
+  bson_t *pipeline, *opts, *resume;
+  struct winsize w;
+  int64_t start, now, lastsave;
+  char resumefile[PATH_MAX], *lasttok;
+  size_t n;
+  long i;
+  int failed;
+
+  /* check for --resume-file */
+  resumefile[0] = '\0';
+  i = strspn(line, " \t");
+  if (strncmp(line + i, "--resume-file", 13) == 0 && strchr(" \t", line[i + 13]) != NULL) {
+    line += i + 13;
+    len -= i + 13;
+    i = strspn(line, " \t");
+    n = strcspn(line + i, " \t");
+    if (n == 0 || n >= sizeof(resumefile)) {
+      warnx("usage: watch [--resume-file file] [pipeline]");
+      return -1;
+    }
+    memcpy(resumefile, line + i, n);
+    resumefile[n] = '\0';
+    line += i + n;
+    len -= i + n;
+  }
+
+  /* default to an empty pipeline */
+  start = bson_get_monotonic_time();
+  if ((i = relaxed_to_strict(tmpdoc, sizeof(tmpdocs), line, len, 1)) < 0) {
+    warnx("jsonify error: %ld", i);
+    return -1;
+  }
+  if (i == 0 && strlcpy((char *)tmpdoc, "[]", sizeof(tmpdocs)) >= sizeof(tmpdocs))
+    return -1;
+  tm.parse += bson_get_monotonic_time() - start;
+
+  if ((pipeline = bson_new_from_json(tmpdoc, -1, &error)) == NULL) {
+    warnx("%d.%d %s", error.domain, error.code, error.message);
+    return -1;
+  }
+
+  resume = NULL;
+  if (strlen(resumefile) && load_resume_token(resumefile, &resume) == -1) {
+    bson_destroy(pipeline);
+    return -1;
+  }
+
+  opts = BCON_NEW("maxAwaitTimeMS", BCON_INT32(TAILAWAIT));
+  if (resume != NULL)
+    BSON_APPEND_DOCUMENT(opts, "resumeAfter", resume);
+
+  /* watch as much as the current path selects */
+  db = NULL;
+  if (strlen(path.collname)) {
+    stream = mongoc_collection_watch(ccoll, pipeline, opts);
+  } else if (strlen(path.dbname)) {
+    db = mongoc_client_get_database(client, path.dbname);
+    stream = mongoc_database_watch(db, pipeline, opts);
+  } else {
+    stream = mongoc_client_watch(client, pipeline, opts);
+  }
+
+  ioctl(0, TIOCGWINSZ, &w);
+
+  lasttok = NULL;
+  lastsave = 0;
+  failed = 0;
+
+  start = bson_get_monotonic_time();
+  while (!interrupted && !failed) {
+    /* returns false if nothing happened within maxAwaitTimeMS */
+    while (!interrupted && mongoc_change_stream_next(stream, &doc)) {
+      now = bson_get_monotonic_time();
+      tm.server += now - start;
+      count_docs(1, doc->len);
+
+      if (print_doc(doc, w.ws_col) == -1) {
+        failed = 1;
+        break;
+      }
+
+      /* events may keep coming, save the token while they do */
+      if (strlen(resumefile) && save_resume_token(stream, resumefile, &lasttok, &lastsave,
+          0) == -1) {
+        failed = 1;
+        break;
+      }
+
+      start = bson_get_monotonic_time();
+      tm.output += start - now;
+    }
+    tm.server += bson_get_monotonic_time() - start;
+
+    fflush(outfp());
+
+    if (mongoc_change_stream_error_document(stream, &error, &reply)) {
+      warnx("change stream failed: %d.%d %s", error.domain, error.code, error.message);
+      failed = 1;
+    }
+
+    /* the token also advances on filtered events and without any event */
+    if (strlen(resumefile) && save_resume_token(stream, resumefile, &lasttok, &lastsave,
+        1) == -1)
+      failed = 1;
+
+    start = bson_get_monotonic_time();
+  }
+
+  if (interrupted)
+    warnx("interrupted");
+
+  bson_free(lasttok);
+  mongoc_change_stream_destroy(stream);
+  if (db != NULL)
+    mongoc_database_destroy(db);
+  if (resume != NULL)
+    bson_destroy(resume);
+  bson_destroy(opts);
+  bson_destroy(pipeline);
+
+  return failed || interrupted ? -1 : 0;
+}
+
+/*
+ * Read a resume token from file. A file that does not exist yet is not an
+ * error, in that case token is set to NULL.
+ *
+ * return 0 on success, -1 on failure
+ */
+int
+load_resume_token(const char *file, bson_t **token)
+{
+  bson_error_t error;
+  FILE *fp;
+  char buf[MAXRESUMETOKEN];
+
+  *token = NULL;
+
+  if ((fp = fopen(file, "r")) == NULL) {
+    if (errno == ENOENT)
+      return 0;
+    warn("%s", file);
+    return -1;
+  }
+
+  if (fgets(buf, sizeof(buf), fp) == NULL) {
+    fclose(fp);
+    return 0;
+  }
+  fclose(fp);
+
+  if ((*token = bson_new_from_json((unsigned char *)buf, -1, &error)) == NULL) {
+    warnx("%s: %d.%d %s", file, error.domain, error.code, error.message);
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Write the current resume token of stream to file if it differs from last, at
+ * most once every RESUMEIVAL unless force is set. Everything printed so far is
+ * flushed first, so the token never points past output that might be lost.
+ * last and lastsave keep the token and the time of the last write.
+ *
+ * return 0 on success, -1 on failure
+ */
+int
+save_resume_token(mongoc_change_stream_t *stream, const char *file, char **last,
+    int64_t *lastsave, int force)
+{
+  const bson_t *token;
+  char *tokstr;
+  int64_t now;
+
+  now = bson_get_monotonic_time();
+  if (!force && now - *lastsave < RESUMEIVAL)
+    return 0;
+
+  if ((token = mongoc_change_stream_get_resume_token(stream)) == NULL)
+    return 0;
+
+  tokstr = bson_as_json(token, NULL);
+  if (*last != NULL && strcmp(tokstr, *last) == 0) {
+    bson_free(tokstr);
+    return 0;
+  }
+
+  fflush(outfp());
+  if (replace_file(file, tokstr) == -1) {
+    bson_free(tokstr);
+    return -1;
+  }
+
+  *lastsave = now;
+  bson_free(*last);
+  *last = tokstr;
+
+  return 0;
+}
+
+/*
+ * Replace the contents of file with line. The line is written to a temporary
+ * file first so an interrupted write never loses the previous contents.
+ *
+ * return 0 on success, -1 on failure
+ */
+int
+replace_file(const char *file, const char *line)
+{
+  FILE *fp;
+  char tmpname[PATH_MAX];
+
+  if (snprintf(tmpname, sizeof(tmpname), "%s.tmp", file) >= (int)sizeof(tmpname)) {
+    warnx("%s: name too long", file);
+    return -1;
+  }
+
+  if ((fp = fopen(tmpname, "w")) == NULL) {
+    warn("%s", tmpname);
+    return -1;
+  }
+
+  if (fprintf(fp, "%s\n", line) < 0 || fflush(fp) == EOF || fsync(fileno(fp)) == -1) {
+    warn("%s", tmpname);
+    fclose(fp);
+    return -1;
+  }
+
+  if (fclose(fp) == EOF || rename(tmpname, file) == -1) {
+    warn("%s", file);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* execute an aggregation pipeline, optionally followed by an options document
+ * that is passed to the aggregate command. A "readPreference" field in the
+ * options is used as the read preference mode. If the last stage is $out or
+ * $merge, no documents are printed but only the size of the target collection.
+ * If the pipeline is preceded by "--preview", run exec_agpreview instead.
+ * ns is the path of collection.
+ * return 0 on success, -1 on failure
+ */
+int exec_agquery(const path_t *ns, mongoc_collection_t *collection, const char *line, int len)
+{
+  long i;
+  mongoc_cursor_t *cursor;
+  mongoc_read_prefs_t *prefs;
+  bson_error_t error;
+  const bson_t *doc;
+  char *str;
+  unsigned char opts_docs[MAXDOC];
+  bson_t *aggr_query, *opts;
+  path_t target;
+  int64_t start, now, loopstart;
+  int preview, ret;
+
+  /* check for --preview */
+  preview = 0;
+  i = strspn(line, " \t");
+  if (strncmp(line + i, "--preview", 9) == 0 && strchr(" \t", line[i + 9]) != NULL) {
+    preview = 1;
+    line += i + 9;
+    len -= i + 9;
+  }
+
+  /* try to parse as relaxed json and convert to strict json */
+  start = bson_get_monotonic_time();
+  if ((i = relaxed_to_strict(tmpdoc, sizeof(tmpdocs), line, len, 1)) < 0) {
+    warnx("jsonify error: %ld", i);
+    return -1;
+  }
+  if (i == 0) {
+    warnx("no pipeline given");
+    return -1;
+  }
+  tm.parse += bson_get_monotonic_time() - start;
+
+  /* shorten line */
+  line += i;
+  len -= i;
+
+  if (strlcpy(target.dbname, ns->dbname, MAXDBNAME) >= MAXDBNAME)
+    return -1;
+  target.collname[0] = '\0';
+
+  opts = NULL;
+  prefs = NULL;
+
+  /* read optional options document */
+  if (len > 0 && line[strspn(line, " \t")] != '\0') {
+    if ((i = relaxed_to_strict(opts_docs, MAXDOC, line, len, 1)) < 0) {
+      warnx("jsonify error: %ld", i);
+      return -1;
+    }
+    if (parse_agopts(opts_docs, &opts, &prefs) < 0)
+      return -1;
+  }
+
+  /* try to parse it as json and convert to bson */
+  if ((aggr_query = bson_new_from_json(tmpdoc, -1, &error)) == NULL) {
+    warnx("%d.%d %s", error.domain, error.code, error.message);
+    if (opts)
+      bson_destroy(opts);
+    if (prefs)
+      mongoc_read_prefs_destroy(prefs);
+    return -1;
+  }
+
+  if (preview) {
+    ret = exec_agpreview(collection, aggr_query, opts, prefs);
+    bson_destroy(aggr_query);
+    if (opts)
+      bson_destroy(opts);
+    if (prefs)
+      mongoc_read_prefs_destroy(prefs);
+    return ret;
+  }
+
+  /* use the current database if the target is in the same database */
+  pipeline_target(aggr_query, &target);
+
+  start = bson_get_monotonic_time();
+
+  cursor = mongoc_collection_aggregate(collection, MONGOC_QUERY_NONE, aggr_query, opts, prefs);
+
+  loopstart = bson_get_monotonic_time();
+  while (!*cancel && mongoc_cursor_next(cursor, &doc)) {
+    now = bson_get_monotonic_time();
+    tm.server += now - loopstart;
+    count_docs(1, doc->len);
+
+    if (!strlen(target.collname)) {
+      str = bson_as_json(doc, NULL);
+      if (!quiet)
+        fprintf(outfp(), "%s\n", str);
+      bson_free(str);
+    }
+
+    loopstart = bson_get_monotonic_time();
+    tm.output += loopstart - now;
   }
+  tm.server += bson_get_monotonic_time() - loopstart;
 
-  /* execute insert */
-  if (!mongoc_collection_insert(collection, MONGOC_INSERT_NONE, doc, NULL, &error)) {
-    warnx("%d.%d %s", error.domain, error.code, error.message);
-    bson_destroy(doc);
+  if (*cancel || mongoc_cursor_error(cursor, &error)) {
+    if (*cancel)
+      warnx("interrupted");
+    else
+      warnx("cursor failed: %d.%d %s", error.domain, error.code, error.message);
+    mongoc_cursor_destroy(cursor);
+    bson_destroy(aggr_query);
+    if (opts)
+      bson_destroy(opts);
+    if (prefs)
+      mongoc_read_prefs_destroy(prefs);
     return -1;
   }
 
-  bson_destroy(doc);
+  mongoc_cursor_destroy(cursor);
+
+  if (strlen(target.collname))
+    print_target_stats(&target, bson_get_monotonic_time() - start);
+
+  bson_destroy(aggr_query);
+  if (opts)
+    bson_destroy(opts);
+  if (prefs)
+    mongoc_read_prefs_destroy(prefs);
 
   return 0;
 }
 
-/* parse remove command, expect one selector */
-int exec_remove(mongoc_collection_t *collection, const char *line, int len)
+/*
+ * Parse the strict json options document of an aggregate command. Everything
+ * except "readPreference" is set in a new bson document in opts. If
+ * "readPreference" is set, prefs is set to a newly allocated read preference.
+ *
+ * Return 0 on success or -1 on failure.
+ */
+int
+parse_agopts(const unsigned char *json, bson_t **opts, mongoc_read_prefs_t **prefs)
 {
-  long offset;
+  const char *modes[] = { "primary", "primaryPreferred", "secondary", "secondaryPreferred", "nearest", NULL };
+  const mongoc_read_mode_t rmodes[] = { MONGOC_READ_PRIMARY, MONGOC_READ_PRIMARY_PREFERRED, MONGOC_READ_SECONDARY, MONGOC_READ_SECONDARY_PREFERRED, MONGOC_READ_NEAREST };
   bson_error_t error;
+  bson_iter_t it;
   bson_t *doc;
+  const char *mode;
+  int i;
 
-  /* read first json object */
-  if ((offset = parse_selector(tmpdoc, sizeof(tmpdocs), line, len)) == -1)
-    return ILLEGAL;
-  if (offset == 0)
-    return ILLEGAL;
-
-  /* try to parse the doc as json and convert to bson */
-  if ((doc = bson_new_from_json(tmpdoc, -1, &error)) == NULL) {
+  if ((doc = bson_new_from_json(json, -1, &error)) == NULL) {
     warnx("%d.%d %s", error.domain, error.code, error.message);
     return -1;
   }
 
-  /* execute remove */
-  if (!mongoc_collection_remove(collection, MONGOC_REMOVE_NONE, doc, NULL, &error)) {
-    warnx("%d.%d %s", error.domain, error.code, error.message);
-    bson_destroy(doc);
-    return -1;
+  *prefs = NULL;
+  if (bson_iter_init_find(&it, doc, "readPreference")) {
+    if (!BSON_ITER_HOLDS_UTF8(&it)) {
+      warnx("readPreference must be a string");
+      bson_destroy(doc);
+      return -1;
+    }
+    mode = bson_iter_utf8(&it, NULL);
+    for (i = 0; modes[i] != NULL; i++)
+      if (strcmp(modes[i], mode) == 0)
+        break;
+    if (modes[i] == NULL) {
+      warnx("unknown readPreference: %s", mode);
+      bson_destroy(doc);
+      return -1;
+    }
+    *prefs = mongoc_read_prefs_new(rmodes[i]);
   }
 
+  *opts = bson_new();
+  bson_copy_to_excluding_noinit(doc, *opts, "readPreference", NULL);
   bson_destroy(doc);
 
   return 0;
 }
 
-/* execute a query
+/*
+ * Run every cumulative prefix of pipeline, stage 1, stages 1-2 and so on, with
+ * a $limit of PREVIEWINPUT documents injected after an initial $sample, or else
+ * right after the first $match, or else at the start of the prefix. For every
+ * prefix print the number of resulting documents, the time it took and the
+ * first PREVIEWDOCS documents. Stops before an $out or $merge stage.
+ *
  * return 0 on success, -1 on failure
  */
-int exec_query(mongoc_collection_t *collection, const char *line, int len, int idsonly)
+int
+exec_agpreview(mongoc_collection_t *collection, const bson_t *pipeline, const bson_t *opts, const mongoc_read_prefs_t *prefs)
 {
-  long i;
   mongoc_cursor_t *cursor;
   bson_error_t error;
-  size_t rlen;
+  bson_iter_t stages, stage;
   const bson_t *doc;
+  bson_t *prefix, previewdocs[PREVIEWDOCS];
+  const char *name;
   char *str;
-  bson_t *query, *fields;
-  struct winsize w;
-
-  if (sizeof(tmpdocs) < 3)
-    errx(1, "exec_query");
-  /* default to all documents */
-  tmpdoc[0] = '{';
-  tmpdoc[1] = '}';
-  tmpdoc[2] = '\0';
+  int64_t start, usec;
+  long ndocs;
+  int i, n;
 
-  if (parse_selector(tmpdoc, sizeof(tmpdocs), line, len) == -1)
-    return -1;
-
-  /* try to parse it as json and convert to bson */
-  if ((query = bson_new_from_json(tmpdoc, -1, &error)) == NULL) {
-    warnx("%d.%d %s", error.domain, error.code, error.message);
+  if (pipeline_stages(pipeline, &stages) < 0) {
+    warnx("pipeline must be an array");
     return -1;
   }
 
-  if (idsonly)
-    if ((fields = bson_new_from_json((unsigned char *)"{ \"_id\": true }", -1, &error)) == NULL) {
-      warnx("%d.%d %s", error.domain, error.code, error.message);
-      bson_destroy(query);
+  for (n = 1; bson_iter_next(&stages); n++) {
+    if (!BSON_ITER_HOLDS_DOCUMENT(&stages) || !bson_iter_recurse(&stages, &stage) || !bson_iter_next(&stage)) {
+      warnx("stage %d is not a document", n);
       return -1;
     }
 
-  cursor = mongoc_collection_find(collection, MONGOC_QUERY_NONE, 0, 0, 0, query, idsonly ? fields : NULL, NULL);
+    name = bson_iter_key(&stage);
+    if (strcmp(name, "$out") == 0 || strcmp(name, "$merge") == 0) {
+      fprintf(outfp(), "%d %s: skipped\n", n, name);
+      break;
+    }
 
-  ioctl(0, TIOCGWINSZ, &w);
+    prefix = pipeline_prefix(pipeline, n, PREVIEWINPUT);
 
-  while (mongoc_cursor_next(cursor, &doc)) {
-    str = bson_as_json(doc, &rlen);
-    if (hr && rlen > w.ws_col) {
-      if ((i = human_readable(tmpdoc, sizeof(tmpdocs), str, rlen)) < 0) {
-        warnx("jsonify error: %ld", i);
-        bson_destroy(query);
-        if (idsonly)
-          bson_destroy(fields);
-        return -1;
+    start = bson_get_monotonic_time();
+    cursor = mongoc_collection_aggregate(collection, MONGOC_QUERY_NONE, prefix, opts, prefs);
+
+    /* fetch all results so the time includes the whole prefix */
+    ndocs = 0;
+    while (!*cancel && mongoc_cursor_next(cursor, &doc))
+      if (ndocs++ < PREVIEWDOCS)
+        bson_copy_to(doc, &previewdocs[ndocs - 1]);
+
+    usec = bson_get_monotonic_time() - start;
+
+    if (*cancel || mongoc_cursor_error(cursor, &error)) {
+      if (*cancel)
+        warnx("%d %s: interrupted", n, name);
+      else
+        warnx("%d %s: cursor failed: %d.%d %s", n, name, error.domain, error.code, error.message);
+      mongoc_cursor_destroy(cursor);
+      bson_destroy(prefix);
+      for (i = 0; i < ndocs && i < PREVIEWDOCS; i++)
+        bson_destroy(&previewdocs[i]);
+      return -1;
+    }
+
+    fprintf(outfp(), "%d %s: %ld documents, %.3fs\n", n, name, ndocs, usec / 1e6);
+    for (i = 0; i < ndocs && i < PREVIEWDOCS; i++) {
+      str = bson_as_json(&previewdocs[i], NULL);
+      fprintf(outfp(), "  %s\n", str);
+      bson_free(str);
+      bson_destroy(&previewdocs[i]);
+    }
+
+    mongoc_cursor_destroy(cursor);
+    bson_destroy(prefix);
+  }
+
+  return 0;
+}
+
+/*
+ * Create a new pipeline array with the first n stages of pipeline and a $limit
+ * stage of limit documents. The $limit is put after an initial $sample, or else
+ * right after the first $match within the first n stages, or else at the start.
+ *
+ * Return a newly allocated pipeline that should be freed by the caller.
+ */
+bson_t *
+pipeline_prefix(const bson_t *pipeline, int n, int limit)
+{
+  bson_iter_t stages, stage;
+  bson_t *prefix, lstage;
+  const char *key, *name;
+  char buf[16];
+  int i, j, at;
+
+  /* determine the position of the $limit stage */
+  at = 0;
+  if (pipeline_stages(pipeline, &stages) == 0)
+    for (i = 0; i < n && bson_iter_next(&stages); i++) {
+      if (!bson_iter_recurse(&stages, &stage) || !bson_iter_next(&stage))
+        continue;
+      name = bson_iter_key(&stage);
+      if ((i == 0 && strcmp(name, "$sample") == 0) || strcmp(name, "$match") == 0) {
+        at = i + 1;
+        break;
       }
-      printf ("%s\n", tmpdoc);
-    } else {
-      printf ("%s\n", str);
     }
-    bson_free(str);
+
+  prefix = bson_new();
+  pipeline_stages(pipeline, &stages);
+
+  for (i = 0, j = 0; i <= n; i++) {
+    if (i == at) {
+      bson_uint32_to_string(j++, &key, buf, sizeof(buf));
+      bson_append_document_begin(prefix, key, -1, &lstage);
+      bson_append_int32(&lstage, "$limit", -1, limit);
+      bson_append_document_end(prefix, &lstage);
+    }
+    if (i < n && bson_iter_next(&stages)) {
+      bson_uint32_to_string(j++, &key, buf, sizeof(buf));
+      bson_append_iter(prefix, key, -1, &stages);
+    }
   }
 
-  if (mongoc_cursor_error(cursor, &error)) {
-    warnx("cursor failed: %d.%d %s", error.domain, error.code, error.message);
-    mongoc_cursor_destroy(cursor);
-    bson_destroy(query);
-    if (idsonly)
-      bson_destroy(fields);
+  return prefix;
+}
+
+/*
+ * Init stages to iterate over the stages of pipeline, which is either an array
+ * or a document with a "pipeline" array.
+ *
+ * Return 0 on success or -1 on failure.
+ */
+int
+pipeline_stages(const bson_t *pipeline, bson_iter_t *stages)
+{
+  bson_iter_t it;
+
+  if (bson_iter_init_find(&it, pipeline, "pipeline")) {
+    if (!BSON_ITER_HOLDS_ARRAY(&it) || !bson_iter_recurse(&it, stages))
+      return -1;
+  } else if (!bson_iter_init(stages, pipeline)) {
     return -1;
   }
 
-  mongoc_cursor_destroy(cursor);
+  return 0;
+}
 
-  bson_destroy(query);
-  if (idsonly)
-    bson_destroy(fields);
+/*
+ * Check if the last stage of pipeline is an $out or $merge stage and if so,
+ * set the target database and collection in target. The pipeline is either an
+ * array or a document with a "pipeline" array. The database in target is left
+ * untouched if the stage does not name one.
+ *
+ * Return 1 if the pipeline writes to a collection, 0 otherwise.
+ */
+int
+pipeline_target(const bson_t *pipeline, path_t *target)
+{
+  bson_iter_t it, stages, stage, spec;
+  const char *key;
+  int found;
 
-  return 0;
+  if (pipeline_stages(pipeline, &stages) < 0)
+    return 0;
+
+  /* find last stage */
+  found = 0;
+  while (bson_iter_next(&stages))
+    if (BSON_ITER_HOLDS_DOCUMENT(&stages)) {
+      memcpy(&it, &stages, sizeof(it));
+      found = 1;
+    }
+
+  if (!found || !bson_iter_recurse(&it, &stage) || !bson_iter_next(&stage))
+    return 0;
+
+  key = bson_iter_key(&stage);
+  if (strcmp(key, "$out") != 0 && strcmp(key, "$merge") != 0)
+    return 0;
+
+  if (BSON_ITER_HOLDS_UTF8(&stage)) {
+    if (strlcpy(target->collname, bson_iter_utf8(&stage, NULL), MAXCOLLNAME) >= MAXCOLLNAME)
+      return 0;
+    return 1;
+  }
+
+  if (!BSON_ITER_HOLDS_DOCUMENT(&stage) || !bson_iter_recurse(&stage, &spec))
+    return 0;
+
+  /* { $merge: { into: ... } } can have a string or a db/coll document */
+  if (strcmp(key, "$merge") == 0) {
+    if (!bson_iter_find(&spec, "into"))
+      return 0;
+    if (BSON_ITER_HOLDS_UTF8(&spec)) {
+      if (strlcpy(target->collname, bson_iter_utf8(&spec, NULL), MAXCOLLNAME) >= MAXCOLLNAME)
+        return 0;
+      return 1;
+    }
+    if (!BSON_ITER_HOLDS_DOCUMENT(&spec) || !bson_iter_recurse(&spec, &it))
+      return 0;
+    memcpy(&spec, &it, sizeof(spec));
+  }
+
+  /* { db: ..., coll: ... } */
+  while (bson_iter_next(&spec)) {
+    if (!BSON_ITER_HOLDS_UTF8(&spec))
+      continue;
+    if (strcmp(bson_iter_key(&spec), "db") == 0) {
+      if (strlcpy(target->dbname, bson_iter_utf8(&spec, NULL), MAXDBNAME) >= MAXDBNAME)
+        return 0;
+    } else if (strcmp(bson_iter_key(&spec), "coll") == 0) {
+      if (strlcpy(target->collname, bson_iter_utf8(&spec, NULL), MAXCOLLNAME) >= MAXCOLLNAME)
+        return 0;
+    }
+  }
+
+  return strlen(target->collname) > 0;
+}
+
+/*
+ * Print the number of documents in the target collection of an $out or $merge
+ * stage and the time it took in microseconds. Counts with a client from the
+ * pool because it may run on the thread of a background job.
+ */
+void
+print_target_stats(const path_t *target, int64_t usec)
+{
+  mongoc_client_t *pclient;
+  mongoc_collection_t *coll;
+  bson_error_t error;
+  int64_t count;
+
+  pclient = mongoc_client_pool_pop(get_pool());
+  coll = mongoc_client_get_collection(pclient, target->dbname, target->collname);
+  count = mongoc_collection_count(coll, MONGOC_QUERY_NONE, NULL, 0, 0, NULL, &error);
+  mongoc_collection_destroy(coll);
+  mongoc_client_pool_push(get_pool(), pclient);
+
+  if (count == -1)
+    fprintf(outfp(), "/%s/%s: done in %.3fs\n", target->dbname, target->collname, usec / 1e6);
+  else
+    fprintf(outfp(), "/%s/%s: %lld documents, done in %.3fs\n", target->dbname,
+        target->collname, (long long)count, usec / 1e6);
 }
 
-/* execute an aggregation pipeline
+/*
+ * Explain a find, count or aggregate command and print a summary of the winning
+ * plan and, depending on the verbosity, the execution statistics. The command
+ * is of the form:
+ *   [queryPlanner|executionStats|allPlansExecution] find|count|aggregate ...
+ * where find and count take an optional selector and aggregate a pipeline.
+ *
  * return 0 on success, -1 on failure
  */
-int exec_agquery(mongoc_collection_t *collection, const char *line, int len)
+int
+exec_explain(mongoc_collection_t *collection, const char *line, int len)
 {
-  long i;
-  mongoc_cursor_t *cursor;
+  const char *verbosities[] = { "allPlansExecution", "executionStats", "queryPlanner", NULL };
+  const char *ecmds[] = { "aggregate", "count", "find", NULL };
+  const char **match = NULL;
+  const char *verbosity, *ecmd, *word;
+  char buf[32];
   bson_error_t error;
-  const bson_t *doc;
-  char *str;
-  bson_t *aggr_query;
+  bson_iter_t it;
+  bson_t *arg, *cmd, reply, pipeline;
+  const uint8_t *data;
+  uint32_t datalen;
+  size_t wordlen;
+  long i;
+  int ret;
 
-  /* try to parse as relaxed json and convert to strict json */
-  if ((i = relaxed_to_strict(tmpdoc, sizeof(tmpdocs), line, len, 0)) < 0) {
-    warnx("jsonify error: %ld", i);
+  /* optional verbosity */
+  verbosity = "queryPlanner";
+  word = line + strspn(line, " \t");
+  wordlen = strcspn(word, " \t");
+  for (i = 0; verbosities[i] != NULL; i++)
+    if (strlen(verbosities[i]) == wordlen && strncmp(verbosities[i], word, wordlen) == 0) {
+      verbosity = verbosities[i];
+      word += wordlen;
+      word += strspn(word, " \t");
+      wordlen = strcspn(word, " \t");
+      break;
+    }
+
+  /* explained command, may be abbreviated */
+  if (wordlen == 0 || wordlen >= sizeof(buf)) {
+    warnx("usage: explain [queryPlanner|executionStats|allPlansExecution] find|count|aggregate ...");
     return -1;
   }
+  memcpy(buf, word, wordlen);
+  buf[wordlen] = '\0';
 
-  /* try to parse it as json and convert to bson */
-  if ((aggr_query = bson_new_from_json(tmpdoc, -1, &error)) == NULL) {
-    warnx("%d.%d %s", error.domain, error.code, error.message);
+  if (prefix_match(&match, ecmds, buf) == -1)
+    errx(1, "prefix_match error");
+  if (match[0] == NULL || match[1] != NULL) {
+    warnx("can only explain find, count or aggregate");
+    free(match);
     return -1;
   }
+  ecmd = match[0];
+  free(match);
 
-  cursor = mongoc_collection_aggregate(collection, MONGOC_QUERY_NONE, aggr_query, NULL, NULL);
+  len -= word + wordlen - line;
+  line = word + wordlen;
 
-  while (mongoc_cursor_next(cursor, &doc)) {
-    str = bson_as_json(doc, NULL);
-    printf ("%s\n", str);
-    bson_free(str);
+  if (strcmp(ecmd, "aggregate") == 0) {
+    if ((i = relaxed_to_strict(tmpdoc, sizeof(tmpdocs), line, len, 1)) < 0) {
+      warnx("jsonify error: %ld", i);
+      return -1;
+    }
+    if (i == 0) {
+      warnx("no pipeline given");
+      return -1;
+    }
+  } else {
+    /* default to all documents */
+    strlcpy((char *)tmpdoc, "{}", sizeof(tmpdocs));
+    if (parse_selector(tmpdoc, sizeof(tmpdocs), line, len) == -1)
+      return -1;
   }
 
-  if (mongoc_cursor_error(cursor, &error)) {
-    warnx("cursor failed: %d.%d %s", error.domain, error.code, error.message);
-    mongoc_cursor_destroy(cursor);
-    bson_destroy(aggr_query);
+  if ((arg = bson_new_from_json(tmpdoc, -1, &error)) == NULL) {
+    warnx("%d.%d %s", error.domain, error.code, error.message);
     return -1;
   }
 
-  mongoc_cursor_destroy(cursor);
+  /* aggregate needs an array, unwrap { pipeline: [...] } */
+  if (strcmp(ecmd, "aggregate") == 0 && bson_iter_init_find(&it, arg, "pipeline") &&
+      BSON_ITER_HOLDS_ARRAY(&it)) {
+    bson_iter_array(&it, &datalen, &data);
+    if (!bson_init_static(&pipeline, data, datalen)) {
+      warnx("illegal pipeline");
+      bson_destroy(arg);
+      return -1;
+    }
+  } else {
+    bson_init_static(&pipeline, bson_get_data(arg), arg->len);
+  }
 
-  bson_destroy(aggr_query);
+  if (strcmp(ecmd, "aggregate") == 0)
+    cmd = BCON_NEW("explain", "{",
+        "aggregate", BCON_UTF8(mongoc_collection_get_name(collection)),
+        "pipeline", BCON_ARRAY(&pipeline),
+        "cursor", "{", "}",
+      "}",
+      "verbosity", BCON_UTF8(verbosity));
+  else if (strcmp(ecmd, "count") == 0)
+    cmd = BCON_NEW("explain", "{",
+        "count", BCON_UTF8(mongoc_collection_get_name(collection)),
+        "query", BCON_DOCUMENT(arg),
+      "}",
+      "verbosity", BCON_UTF8(verbosity));
+  else
+    cmd = BCON_NEW("explain", "{",
+        "find", BCON_UTF8(mongoc_collection_get_name(collection)),
+        "filter", BCON_DOCUMENT(arg),
+      "}",
+      "verbosity", BCON_UTF8(verbosity));
+
+  ret = 0;
+  if (!mongoc_collection_command_simple(collection, cmd, NULL, &reply, &error)) {
+    warnx("%d.%d %s", error.domain, error.code, error.message);
+    ret = -1;
+  } else {
+    print_explain(&reply);
+  }
+
+  bson_destroy(&reply);
+  bson_destroy(cmd);
+  bson_destroy(arg);
+
+  return ret;
+}
+
+/*
+ * Print a summary of the reply of an explain command: the stages of the
+ * winning plan, the index used, and if available the number of keys examined,
+ * documents examined, documents returned and execution time.
+ */
+void
+print_explain(const bson_t *reply)
+{
+  bson_t planner, plan, stats;
+  bson_iter_t it;
+  const uint8_t *data;
+  uint32_t datalen;
+  char index[MAXCOLLNAME];
+
+  index[0] = '\0';
+
+  if (bson_find_doc(reply, "queryPlanner", &planner) &&
+      bson_find_doc(&planner, "winningPlan", &plan)) {
+    /* since 6.0 plans that run in SBE are nested in queryPlan */
+    if (bson_iter_init_find(&it, &plan, "queryPlan") && BSON_ITER_HOLDS_DOCUMENT(&it)) {
+      bson_iter_document(&it, &datalen, &data);
+      bson_init_static(&plan, data, datalen);
+    }
+    fprintf(outfp(), "winning plan:\n");
+    print_plan(&plan, 1, index, sizeof(index));
+    fprintf(outfp(), "index:          %s\n", strlen(index) ? index : "none");
+  } else {
+    fprintf(outfp(), "winning plan:   unknown\n");
+  }
+
+  if (!bson_find_doc(reply, "executionStats", &stats))
+    return;
+
+  fprintf(outfp(), "keys examined:  %lld\n", (long long)bson_lookup_int64(&stats, "totalKeysExamined"));
+  fprintf(outfp(), "docs examined:  %lld\n", (long long)bson_lookup_int64(&stats, "totalDocsExamined"));
+  fprintf(outfp(), "docs returned:  %lld\n", (long long)bson_lookup_int64(&stats, "nReturned"));
+  if (bson_iter_init_find(&it, &stats, "executionTimeMillis"))
+    fprintf(outfp(), "time:           %lldms\n", (long long)bson_iter_as_int64(&it));
+}
+
+/*
+ * Print the stage of a plan and recurse into its input stages, indented by two
+ * spaces per depth. Set index to the name of the first index that is used.
+ */
+void
+print_plan(const bson_t *plan, int depth, char *index, size_t indexsize)
+{
+  bson_iter_t it, child;
+  bson_t input;
+  const uint8_t *data;
+  uint32_t datalen;
+  const char *name;
+
+  fprintf(outfp(), "%*s", depth * 2, "");
+
+  if (bson_iter_init_find(&it, plan, "stage") && BSON_ITER_HOLDS_UTF8(&it))
+    fprintf(outfp(), "%s", bson_iter_utf8(&it, NULL));
+  else
+    fprintf(outfp(), "?");
+
+  if (bson_iter_init_find(&it, plan, "indexName") && BSON_ITER_HOLDS_UTF8(&it)) {
+    name = bson_iter_utf8(&it, NULL);
+    fprintf(outfp(), " %s", name);
+    if (!strlen(index))
+      strlcpy(index, name, indexsize);
+  }
+  fprintf(outfp(), "\n");
+
+  if (bson_iter_init_find(&it, plan, "inputStage") && BSON_ITER_HOLDS_DOCUMENT(&it)) {
+    bson_iter_document(&it, &datalen, &data);
+    if (bson_init_static(&input, data, datalen))
+      print_plan(&input, depth + 1, index, indexsize);
+  }
+
+  if (bson_iter_init_find(&it, plan, "inputStages") && BSON_ITER_HOLDS_ARRAY(&it) &&
+      bson_iter_recurse(&it, &child))
+    while (bson_iter_next(&child))
+      if (BSON_ITER_HOLDS_DOCUMENT(&child)) {
+        bson_iter_document(&child, &datalen, &data);
+        if (bson_init_static(&input, data, datalen))
+          print_plan(&input, depth + 1, index, indexsize);
+      }
+}
+
+/*
+ * Search doc depth-first for the first sub-document with the given key and
+ * init found as a read-only view on it.
+ *
+ * Return 1 if found, 0 otherwise.
+ */
+int
+bson_find_doc(const bson_t *doc, const char *key, bson_t *found)
+{
+  bson_iter_t it;
+  bson_t child;
+  const uint8_t *data;
+  uint32_t datalen;
+
+  if (!bson_iter_init(&it, doc))
+    return 0;
+
+  while (bson_iter_next(&it)) {
+    if (BSON_ITER_HOLDS_DOCUMENT(&it))
+      bson_iter_document(&it, &datalen, &data);
+    else if (BSON_ITER_HOLDS_ARRAY(&it))
+      bson_iter_array(&it, &datalen, &data);
+    else
+      continue;
+
+    if (!bson_init_static(&child, data, datalen))
+      continue;
+
+    if (BSON_ITER_HOLDS_DOCUMENT(&it) && strcmp(bson_iter_key(&it), key) == 0)
+      return bson_init_static(found, data, datalen);
+
+    if (bson_find_doc(&child, key, found))
+      return 1;
+  }
+
+  return 0;
+}
+
+/*
+ * Turn timing on or off, or print the current setting if arg is NULL.
+ * return 0 on success, -1 on failure
+ */
+int
+exec_timing(const char *arg)
+{
+  if (arg == NULL) {
+    printf("timing %s\n", timing ? "on" : "off");
+    return 0;
+  }
+
+  if (strcmp(arg, "on") == 0)
+    timing = 1;
+  else if (strcmp(arg, "off") == 0)
+    timing = 0;
+  else {
+    warnx("usage: timing [on|off]");
+    return -1;
+  }
 
   return 0;
 }
 
+/*
+ * Print the wall time of a command split into the time spent on parsing json,
+ * waiting on the server and formatting and writing the output, together with
+ * the number of documents and bytes transferred. Print on stderr so that stdout
+ * can be used in a pipeline.
+ */
+void
+print_timing(const timing_t *t, int64_t total)
+{
+  fprintf(stderr, "%.3fs: parse %.3fs, server %.3fs, output %.3fs, other %.3fs; "
+      "%lld docs, %lld bytes, %.0f docs/s\n",
+      total / 1e6, t->parse / 1e6, t->server / 1e6, t->output / 1e6,
+      (total - t->parse - t->server - t->output) / 1e6,
+      (long long)t->docs, (long long)t->bytes,
+      total > 0 ? t->docs * 1e6 / total : 0.0);
+}
+
 char *prompt()
 {
   return pmpt;
@@ -17,6 +17,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include "apm.h"
 #include "jsonify.h"
 #include "shorten.h"
 #include "prefix_match.h"
@@ -26,12 +27,17 @@
 
 #include <err.h>
 #include <errno.h>
+#include <ctype.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <getopt.h>
 #include <unistd.h>
 #include <histedit.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -50,7 +56,19 @@
                          if MAXPROMPT = 12 then "/dbname/collname> " would
                          become "/d..e/c..e> " */
 #define MAXPROG 10
+#define MAXAPPNAME 128              /* maximum length of the client metadata appname */
 #define MAXDOC 16 * 100 * 1024      /* maximum size of a json document */
+#define MAXWORKERS 16               /* maximum number of concurrent pool clients */
+#define MAXJOBS 16                  /* maximum number of background jobs */
+#define PREVIEWINPUT 1000           /* $limit injected by aggregate --preview */
+#define PREVIEWDOCS 3               /* documents shown per aggregate --preview stage */
+#define TAILDOCS 10                 /* documents printed by tail */
+#define TAILAWAIT 1000              /* maxAwaitTimeMS of tail -f and watch */
+#define MAXRESUMETOKEN 4096         /* maximum length of a change stream resume token */
+#define RESUMEIVAL 1000000          /* minimum microseconds between resume token writes of watch */
+#define IMPORTBULK 1000             /* operations per bulk write in import mode */
+#define LAGPOLL 500000              /* microseconds between replication lag checks */
+#define GLOBWORKERS 4               /* default concurrent collections of a glob find or count */
 
 #ifndef PATH_MAX
 #define PATH_MAX 1024
@@ -67,13 +85,62 @@ typedef struct {
   char collname[MAXCOLLNAME];
 } path_t;
 
+/* statistics of a database or collection as printed by ls -l */
+typedef struct {
+  path_t ns;
+  int64_t count;
+  int64_t size;
+  int64_t storage;
+  int64_t index;
+  int64_t avgobj;
+  int ok;
+} nsstats_t;
+
+/* time spent per phase of a command in microseconds and amount of data */
+typedef struct {
+  int64_t parse;    /* converting json to bson */
+  int64_t server;   /* waiting on the server, including all getMores */
+  int64_t output;   /* formatting and writing documents */
+  int64_t docs;
+  int64_t bytes;
+} timing_t;
+
+/* options of import mode */
+typedef struct {
+  int mode;               /* insert documents or remove or update selectors */
+  const char *update;     /* update document of IMPORTUPDATE */
+  const char *upsertkey;  /* comma separated fields to match documents on */
+  int replace;            /* replace matched documents instead of updating */
+  const char *checkpoint; /* file to keep the acknowledged input offset in */
+  int resume;             /* skip input up to the offset in checkpoint */
+} import_t;
+
+/* counters of an import, see progress.c */
+typedef struct {
+  int64_t bytes;      /* input read */
+  int64_t compressed; /* compressed input read, 0 if not compressed */
+  int64_t skipped;    /* input skipped by --resume */
+  int64_t parsed;     /* documents converted to bson */
+  int64_t acked;      /* documents acknowledged by the server */
+  int64_t errors;
+} progress_t;
+
 /* mongo specific db info */
 typedef struct {
   char url[MAXMONGOURL];
 } config_t;
 
-enum cmd { ILLEGAL = -1, UNKNOWN, AMBIGUOUS, DROP, LS, CHCOLL, COUNT, UPDATE, UPSERT, INSERT, REMOVE, FIND, AGQUERY, HELP };
+enum cmd { ILLEGAL = -1, UNKNOWN, AMBIGUOUS, DROP, LS, CHCOLL, COUNT, UPDATE, UPSERT, INSERT, REMOVE, FIND, AGQUERY, EXPLAIN, TAIL, WATCH, CP, MV, DIFF, GREP, TIMING, STATS, BENCH, JOBS, FG, KILL, HELP };
 enum errors { DBMISSING = 256, COLLMISSING };
+enum importmode { IMPORTINSERT, IMPORTREMOVE, IMPORTUPDATE };
+enum compression { COMPNONE, COMPGZIP, COMPZSTD };
+enum lssort { LSNAME, LSCOUNT, LSSIZE, LSSTORAGE, LSINDEX, LSAVGOBJ };
+
+/* set by SIGINT, checked by every loop over a cursor */
+extern volatile sig_atomic_t interrupted;
+
+extern int import;
+extern progress_t progress;
 
 void usage(void);
 int main_init(int argc, char **argv);
@@ -90,16 +157,85 @@ int parse_path(const char *paths, path_t *newpath, int *dbstart, int *collstart)
 int mv_parse_file(FILE *fp, config_t *cfg);
 int mv_parse_cmd(int argc, const char *argv[], const char *line, char **lp);
 int exec_cmd(const int cmd, const char **argv, const char *line, int linelen);
+int exec_collcmd(const path_t *ns, mongoc_collection_t *collection, const int cmd, const char *line, int linelen);
 int exec_drop(const char *npath);
-int exec_ls(const char *npath);
+int exec_cp(const path_t *src, const path_t *dst);
+int exec_mv(const path_t *src, const path_t *dst);
+int exec_ls(const char *line);
+long parse_ls_opts(const char *line, int *longfmt, int *sortkey, int *reverse);
 int exec_lsdbs(mongoc_client_t *client, const char *prefix);
 int exec_lscolls(mongoc_client_t *client, char *dbname);
+int exec_lsstats(const path_t *ns);
+int fetch_nsstats(mongoc_client_t *client, void *arg, size_t i);
+int cmp_nsstats(const void *a, const void *b);
+int64_t bson_lookup_int64(const bson_t *doc, const char *key);
+mongoc_client_pool_t *get_pool(void);
+void thread_init(int q);
+void thread_end(void);
+void thread_job(FILE *fp, volatile sig_atomic_t *flag);
+const timing_t *thread_timing(void);
+void count_docs(int64_t docs, int64_t bytes);
+void read_counts(const timing_t *t, int64_t *docs, int64_t *bytes);
+FILE *outfp(void);
+void handle_sigint(int sig);
+void *cancel_worker(void *arg);
+int kill_ops(const char *app);
+int fanout(int (*fn)(mongoc_client_t *, void *, size_t), void *arg, size_t n, int maxworkers);
+void *fanout_worker(void *arg);
 int exec_chcoll(mongoc_client_t *client, const path_t newpath);
-int exec_count(mongoc_collection_t *collection, const char *line, int len);
+int exec_count(const path_t *ns, mongoc_collection_t *collection, const char *line, int len);
 int exec_update(mongoc_collection_t *collection, const char *line, int upsert);
 int exec_insert(mongoc_collection_t *collection, const char *line, int len);
 int exec_remove(mongoc_collection_t *collection, const char *line, int len);
-int exec_query(mongoc_collection_t *collection, const char *line, int len, int idsonly);
-int exec_agquery(mongoc_collection_t *collection, const char *line, int len);
+int exec_chunked(mongoc_collection_t *collection, int cmd, const char *line, int len);
+long parse_chunk_opts(const char *line, long *chunk, long *maxlag);
+int replication_lag(mongoc_client_t *client, int64_t *lag);
+int exec_query(const path_t *ns, mongoc_collection_t *collection, const char *line, int len, int idsonly);
+int isglob(const char *word);
+int glob_arg(const char *line);
+int exec_globquery(const path_t *cwd, const int cmd, const char *line, int len);
+int globquery_worker(mongoc_client_t *client, void *arg, size_t i);
+int match_namespaces(mongoc_client_t *client, const path_t *pattern, path_t **ns, size_t *n);
+int print_doc(const bson_t *doc, size_t cols);
+bson_t *find_nth_last(mongoc_collection_t *collection, const bson_t *query, long n, bson_error_t *error);
+int exec_tail(mongoc_collection_t *collection, const char *line, int len);
+long parse_tail_opts(const char *line, int *follow, long *n, int *await, uint32_t *ts, uint32_t *inc);
+int exec_watch(const char *line, int len);
+int load_resume_token(const char *file, bson_t **token);
+int save_resume_token(mongoc_change_stream_t *stream, const char *file, char **last, int64_t *lastsave, int force);
+int replace_file(const char *file, const char *line);
+int exec_agquery(const path_t *ns, mongoc_collection_t *collection, const char *line, int len);
+int exec_agpreview(mongoc_collection_t *collection, const bson_t *pipeline, const bson_t *opts, const mongoc_read_prefs_t *prefs);
+bson_t *pipeline_prefix(const bson_t *pipeline, int n, int limit);
+int pipeline_stages(const bson_t *pipeline, bson_iter_t *stages);
+int exec_explain(mongoc_collection_t *collection, const char *line, int len);
+void print_explain(const bson_t *reply);
+void print_plan(const bson_t *plan, int depth, char *index, size_t indexsize);
+int bson_find_doc(const bson_t *doc, const char *key, bson_t *found);
+int exec_bench(const path_t *ns, const char *line);
+int exec_grep(const path_t *cwd, const char *line);
+int exec_diff(const path_t *cwd, const char *line);
+int exec_timing(const char *arg);
+void print_timing(const timing_t *t, int64_t total);
+int parse_agopts(const unsigned char *json, bson_t **opts, mongoc_read_prefs_t **prefs);
+int pipeline_target(const bson_t *pipeline, path_t *target);
+void print_target_stats(const path_t *target, int64_t usec);
+int exec_import(mongoc_collection_t *collection, FILE *fp, const import_t *cfg);
+int detect_compression(const unsigned char *magic, size_t n);
+int parse_compression(const char *name);
+int decompress_start(int fd, int method, const unsigned char *prefix, size_t prefixlen);
+int decompress_end(void);
+int compress_start(int method);
+int compress_end(void);
+void progress_start(int statusline, int64_t size, const timing_t *tm);
+void progress_end(void);
+void progress_add(int64_t *counter, int64_t n);
+void handle_sigusr1(int sig);
+int job_start(int cmd, const path_t *ns, const char *cmdline, const char *args);
+int exec_jobs(void);
+int exec_fg(const char *arg);
+int exec_kill(const char *arg);
+void jobs_notify(void);
+void jobs_end(void);
 
 #endif
@@ -0,0 +1,251 @@
+/**
+ * Copyright (c) 2016 Tim Kuijsten
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "mongovi.h"
+
+#include <poll.h>
+
+#define PROGRESSIVAL 1000   /* milliseconds between redraws of the status line */
+
+/*
+ * Counters of the running import, written with progress_add by the importing
+ * and decompressing threads and read by the progress thread under progressmtx.
+ */
+progress_t progress;
+static pthread_mutex_t progressmtx = PTHREAD_MUTEX_INITIALIZER;
+
+static const timing_t *exptm;   /* counters of the exporting thread */
+static int redraw;              /* redraw a status line every second */
+static int drawn;               /* a status line is on the screen */
+static int64_t total;           /* size of the input if known */
+static int64_t started;
+static int64_t lastcount, lasttime;
+
+static int usr1pipe[2];         /* SIGUSR1 and progress_end wake up the thread */
+static pthread_t thread;
+static int running = 0;
+
+static void *progress_worker(void *arg);
+static void print_progress(int statusline);
+static int fmt_duration(char *dst, size_t dstsize, int64_t sec);
+
+/*
+ * Start reporting progress on stderr on SIGUSR1 and, if statusline is set,
+ * every second. Import counters are read from progress, those of an export
+ * from tm. size is the size of the input in bytes or 0 if unknown.
+ */
+void
+progress_start(int statusline, int64_t size, const timing_t *tm)
+{
+  struct sigaction sa;
+  sigset_t set, oset;
+
+  redraw = statusline;
+  total = size;
+  exptm = tm;
+  started = lasttime = bson_get_monotonic_time();
+
+  if (pipe(usr1pipe) == -1)
+    err(1, "pipe");
+  if (fcntl(usr1pipe[1], F_SETFL, O_NONBLOCK) == -1)
+    err(1, "fcntl");
+
+  /* keep signals on the main thread */
+  sigfillset(&set);
+  pthread_sigmask(SIG_BLOCK, &set, &oset);
+  if (pthread_create(&thread, NULL, progress_worker, NULL) != 0)
+    errx(1, "can't start progress thread");
+  pthread_sigmask(SIG_SETMASK, &oset, NULL);
+  running = 1;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_sigusr1;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGUSR1, &sa, NULL) == -1)
+    err(1, "sigaction");
+}
+
+/* stop the progress thread and finish the status line */
+void
+progress_end(void)
+{
+  ssize_t n;
+
+  if (!running)
+    return;
+
+  signal(SIGUSR1, SIG_IGN);
+
+  n = write(usr1pipe[1], "q", 1);
+  (void)n;
+  pthread_join(thread, NULL);
+  running = 0;
+
+  if (drawn) {
+    print_progress(1);
+    fprintf(stderr, "\n");
+  }
+
+  close(usr1pipe[0]);
+  close(usr1pipe[1]);
+}
+
+/* add n to counter, which is a field of progress */
+void
+progress_add(int64_t *counter, int64_t n)
+{
+  pthread_mutex_lock(&progressmtx);
+  *counter += n;
+  pthread_mutex_unlock(&progressmtx);
+}
+
+/* wake up progress_worker */
+void
+handle_sigusr1(int sig)
+{
+  int saved_errno = errno;
+  ssize_t n;
+
+  (void)sig;
+
+  n = write(usr1pipe[1], "u", 1);
+  (void)n;
+
+  errno = saved_errno;
+}
+
+static void *
+progress_worker(void *arg)
+{
+  struct pollfd pfd;
+  char c;
+  int r;
+
+  (void)arg;
+
+  pfd.fd = usr1pipe[0];
+  pfd.events = POLLIN;
+
+  for (;;) {
+    if ((r = poll(&pfd, 1, redraw ? PROGRESSIVAL : -1)) == -1) {
+      if (errno == EINTR)
+        continue;
+      warn("progress_worker");
+      return NULL;
+    }
+
+    if (r == 0) {
+      print_progress(1);
+      continue;
+    }
+
+    if (read(usr1pipe[0], &c, 1) != 1)
+      continue;
+    if (c == 'q')
+      return NULL;
+    print_progress(0);
+  }
+}
+
+/*
+ * Print the counters, either as a status line that is overwritten by the next
+ * one, or as a line of its own.
+ */
+static void
+print_progress(int statusline)
+{
+  progress_t p;
+  char line[256], eta[32];
+  int64_t now, count, bytes, in;
+  double rate, avg;
+  int n;
+
+  now = bson_get_monotonic_time();
+
+  pthread_mutex_lock(&progressmtx);
+  p = progress;
+  pthread_mutex_unlock(&progressmtx);
+
+  count = bytes = 0;
+  if (import) {
+    count = p.acked;
+    bytes = p.bytes;
+  } else if (exptm) {
+    read_counts(exptm, &count, &bytes);
+  }
+
+  /* rate since the previous report */
+  rate = now > lasttime ? (count - lastcount) * 1e6 / (now - lasttime) : 0;
+  lastcount = count;
+  lasttime = now;
+
+  if (import) {
+    n = snprintf(line, sizeof(line), "%lld bytes read, %lld parsed, %lld acknowledged, "
+        "%lld errors, %.0f docs/s", (long long)bytes, (long long)p.parsed,
+        (long long)count, (long long)p.errors, rate);
+
+    /*
+     * Estimate the remaining time from the average read speed. The size of
+     * compressed input is compared with the compressed bytes read, which
+     * includes any skipped input.
+     */
+    if (p.compressed > 0) {
+      in = p.compressed;
+      avg = now > started ? in * 1e6 / (now - started) : 0;
+    } else {
+      in = bytes;
+      avg = now > started ? (bytes - p.skipped) * 1e6 / (now - started) : 0;
+    }
+    if (total > 0 && n > 0 && (size_t)n < sizeof(line)) {
+      if (avg > 0 && in < total && fmt_duration(eta, sizeof(eta), (total - in) / avg) == 0)
+        snprintf(line + n, sizeof(line) - n, ", %.1f%%, eta %s", in * 100.0 / total, eta);
+      else
+        snprintf(line + n, sizeof(line) - n, ", %.1f%%", in * 100.0 / total);
+    }
+  } else {
+    snprintf(line, sizeof(line), "%lld docs, %lld bytes received, %.0f docs/s",
+        (long long)count, (long long)bytes, rate);
+  }
+
+  if (statusline) {
+    fprintf(stderr, "\r%s\033[K", line);
+    drawn = 1;
+  } else {
+    fprintf(stderr, "%s%s\n", drawn ? "\r\033[K" : "", line);
+  }
+  fflush(stderr);
+}
+
+/*
+ * Format sec as hours, minutes and seconds.
+ *
+ * return 0 on success, -1 on failure
+ */
+static int
+fmt_duration(char *dst, size_t dstsize, int64_t sec)
+{
+  int r;
+
+  if (sec >= 3600)
+    r = snprintf(dst, dstsize, "%lldh%02lldm", (long long)sec / 3600, (long long)sec % 3600 / 60);
+  else if (sec >= 60)
+    r = snprintf(dst, dstsize, "%lldm%02llds", (long long)sec / 60, (long long)sec % 60);
+  else
+    r = snprintf(dst, dstsize, "%llds", (long long)sec);
+
+  return r < 0 || (size_t)r >= dstsize ? -1 : 0;
+}
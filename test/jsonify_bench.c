@@ -0,0 +1,193 @@
+/*
+ * Benchmark human_readable and relaxed_to_strict over generated documents of
+ * different shapes and sizes. Output is one tab separated line per case so
+ * results of different versions can be compared with standard tools.
+ *
+ * usage: jsonify-bench [-t seconds]
+ */
+
+#include <err.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* count the allocations done by jsonify */
+static long allocs = 0;
+
+static char *
+counting_strndup(const char *s, size_t n)
+{
+  allocs++;
+  return strndup(s, n);
+}
+
+#define strndup counting_strndup
+#include "../jsonify.c"
+#undef strndup
+
+#define FIRSTONLYMAX 64 * 1024  /* firstonly reparses every prefix, skip larger documents */
+
+enum shape { FLAT, NESTED, ARRAY, STRINGS };
+enum func { HUMAN, STRICT, FIRSTONLY };
+
+static const char *shapes[] = { "flat", "nested", "array", "strings" };
+static const char *funcs[] = { "human_readable", "relaxed_to_strict", "relaxed_to_strict_firstonly" };
+static const size_t sizes[] = { 1024, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024 };
+
+static double mintime = 0.5;
+
+size_t gen(char *buf, size_t size, int shape, int quote);
+void run(int func, int shape, const char *src, size_t len);
+double now(void);
+
+int main(int argc, char **argv)
+{
+  size_t i, len, bufsize;
+  char *buf;
+  int ch, shape, func;
+
+  while ((ch = getopt(argc, argv, "t:")) != -1)
+    switch (ch) {
+    case 't':
+      mintime = strtod(optarg, NULL);
+      break;
+    default:
+      fprintf(stderr, "usage: jsonify-bench [-t seconds]\n");
+      exit(1);
+    }
+
+  bufsize = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1] + 64 * 1024;
+  if ((buf = malloc(bufsize)) == NULL)
+    err(1, NULL);
+
+  printf("func\tshape\tbytes\ttokens\titerations\tMB/s\tns/token\tallocs/doc\tstatus\n");
+
+  for (func = HUMAN; func <= FIRSTONLY; func++)
+    for (shape = FLAT; shape <= STRINGS; shape++)
+      for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        /* human_readable gets server output, the others get user input */
+        len = gen(buf, sizes[i], shape, func == HUMAN);
+        run(func, shape, buf, len);
+      }
+
+  free(buf);
+
+  return 0;
+}
+
+/*
+ * Generate a document of about size bytes in buf, which must be at least
+ * size + 64 KB. Keys are quoted if quote is set.
+ *
+ * return the length of the document
+ */
+size_t
+gen(char *buf, size_t size, int shape, int quote)
+{
+  const char *q = quote ? "\"" : "";
+  char *p;
+  int i, j;
+
+  p = buf;
+  p += sprintf(p, "{ ");
+  for (i = 0; (size_t)(p - buf) < size; i++) {
+    if (i > 0)
+      p += sprintf(p, ", ");
+
+    switch (shape) {
+    case FLAT:
+      p += sprintf(p, "%sf%d%s: %d, %sg%d%s: \"value %d\"", q, i, q, i, q, i, q, i);
+      break;
+    case NESTED:
+      p += sprintf(p, "%sn%d%s: ", q, i, q);
+      for (j = 0; j < 32; j++)
+        p += sprintf(p, "{ %sa%s: ", q, q);
+      p += sprintf(p, "{ %sv%s: %d }", q, q, i);
+      for (j = 0; j < 32; j++)
+        p += sprintf(p, " }");
+      break;
+    case ARRAY:
+      p += sprintf(p, "%sa%d%s: [", q, i, q);
+      for (j = 0; j < 100; j++)
+        p += sprintf(p, j ? ", %d" : "%d", j);
+      p += sprintf(p, "]");
+      break;
+    case STRINGS:
+      p += sprintf(p, "%ss%d%s: \"", q, i, q);
+      memset(p, 'x', 4096);
+      p += 4096;
+      p += sprintf(p, "\"");
+      break;
+    }
+  }
+  p += sprintf(p, " }");
+
+  return p - buf;
+}
+
+/* time func on src until mintime has passed and print the results */
+void
+run(int func, int shape, const char *src, size_t len)
+{
+  unsigned char *dst;
+  jsmn_parser parser;
+  double start, elapsed;
+  long iterations, r;
+  size_t dstsize;
+  int tokens;
+
+  jsmn_init(&parser);
+  tokens = jsmn_parse(&parser, src, len, NULL, 0);
+
+  printf("%s\t%s\t%zu\t%d\t", funcs[func], shapes[shape], len, tokens);
+
+  if (tokens > TOKENS) {
+    printf("0\t0\t0\t0\ttoo many tokens\n");
+    return;
+  }
+  if (func == FIRSTONLY && len > FIRSTONLYMAX) {
+    printf("0\t0\t0\t0\tskipped\n");
+    return;
+  }
+
+  /* human readable output is indented */
+  dstsize = func == HUMAN ? 16 * len + 4096 : 2 * len + 4096;
+  if ((dst = malloc(dstsize)) == NULL)
+    err(1, NULL);
+
+  allocs = 0;
+  iterations = 0;
+  start = now();
+  do {
+    if (func == HUMAN)
+      r = human_readable(dst, dstsize, src, len);
+    else
+      r = relaxed_to_strict(dst, dstsize, src, len, func == FIRSTONLY);
+    iterations++;
+  } while (r >= 0 && (elapsed = now() - start) < mintime);
+
+  free(dst);
+
+  if (r < 0) {
+    printf("0\t0\t0\t0\terror %ld\n", r);
+    return;
+  }
+
+  printf("%ld\t%.1f\t%.1f\t%.1f\tok\n", iterations,
+         (double)len * iterations / elapsed / (1024 * 1024),
+         elapsed * 1e9 / iterations / tokens,
+         (double)allocs / iterations);
+  fflush(stdout);
+}
+
+double
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,108 @@
+#include "../latency.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int test_bucket(int64_t val, const char *msg);
+int test_pct(const latency_t *lat, double pct, int64_t exp, const char *msg);
+
+int main()
+{
+  latency_t lat, lat2;
+  int failed = 0;
+  int64_t i;
+
+  printf("test latency_bucket:\n");
+  failed += test_bucket(0, "");
+  failed += test_bucket(1, "");
+  failed += test_bucket(15, "");
+  failed += test_bucket(16, "");
+  failed += test_bucket(17, "");
+  failed += test_bucket(31, "");
+  failed += test_bucket(32, "");
+  failed += test_bucket(1000, "");
+  failed += test_bucket(123456789, "");
+  failed += test_bucket(INT64_MAX, "");
+  printf("\n");
+
+  printf("test latency_pct:\n");
+  latency_init(&lat);
+  failed += test_pct(&lat, 50, 0, "empty");
+
+  latency_add(&lat, 7);
+  failed += test_pct(&lat, 0, 7, "single value");
+  failed += test_pct(&lat, 50, 7, "single value");
+  failed += test_pct(&lat, 100, 7, "single value");
+
+  latency_init(&lat);
+  for (i = 1; i <= 10; i++)
+    latency_add(&lat, i);
+  failed += test_pct(&lat, 50, 5, "small exact values");
+  failed += test_pct(&lat, 90, 9, "small exact values");
+  failed += test_pct(&lat, 100, 10, "small exact values");
+
+  latency_init(&lat);
+  for (i = 0; i < 99; i++)
+    latency_add(&lat, 1000);
+  latency_add(&lat, 1000000);
+  failed += test_pct(&lat, 50, 1023, "bucket upper bound");
+  failed += test_pct(&lat, 99, 1023, "bucket upper bound");
+  failed += test_pct(&lat, 100, 1000000, "max is exact");
+
+  latency_init(&lat);
+  latency_add(&lat, -5);
+  failed += test_pct(&lat, 50, 0, "negative values are 0");
+  printf("\n");
+
+  printf("test latency_merge:\n");
+  latency_init(&lat);
+  latency_init(&lat2);
+  for (i = 1; i <= 5; i++)
+    latency_add(&lat, i);
+  for (i = 6; i <= 10; i++)
+    latency_add(&lat2, i);
+  latency_merge(&lat, &lat2);
+  failed += test_pct(&lat, 50, 5, "merged");
+  failed += test_pct(&lat, 100, 10, "merged");
+
+  return failed;
+}
+
+// return 0 if test passes, 1 if test fails
+int test_bucket(int64_t val, const char *msg)
+{
+  int b;
+  int64_t upper, lower;
+
+  b = latency_bucket(val);
+  upper = latency_upper(b);
+  lower = b > 0 ? latency_upper(b - 1) + 1 : 0;
+
+  if (b < 0 || b >= LATBUCKETS || val < lower || val > upper) {
+    fprintf(stderr, "FAIL: %lld in bucket %d [%lld, %lld]\t%s\n", (long long)val, b, (long long)lower, (long long)upper, msg);
+    return 1;
+  }
+
+  /* the width of a bucket is at most 1 / 2^LATSUBBITS of its values */
+  if (val >= (1 << LATSUBBITS) && (upper - lower) > (lower >> LATSUBBITS)) {
+    fprintf(stderr, "FAIL: %lld in bucket %d [%lld, %lld] too wide\t%s\n", (long long)val, b, (long long)lower, (long long)upper, msg);
+    return 1;
+  }
+
+  printf("PASS: %lld in bucket %d [%lld, %lld]\t%s\n", (long long)val, b, (long long)lower, (long long)upper, msg);
+  return 0;
+}
+
+// return 0 if test passes, 1 if test fails
+int test_pct(const latency_t *lat, double pct, int64_t exp, const char *msg)
+{
+  int64_t val;
+
+  if ((val = latency_pct(lat, pct)) != exp) {
+    fprintf(stderr, "FAIL: p%g = %lld instead of %lld\t%s\n", pct, (long long)val, (long long)exp, msg);
+    return 1;
+  }
+
+  printf("PASS: p%g = %lld\t%s\n", pct, (long long)val, msg);
+  return 0;
+}
@@ -0,0 +1,2704 @@
+/**
+ * Copyright (c) 2016 Tim Kuijsten
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Stand-in for mongod that keeps all data in memory and speaks just enough of
+ * the wire protocol for tests and benchmarks of mongovi: the handshake over
+ * OP_QUERY and the find, getMore, killCursors, count, insert, update, delete,
+ * aggregate, list, drop, renameCollection, stats and dbHash commands over
+ * OP_MSG.
+ * Every collection only has the index on _id.
+ *
+ * Documents of a collection are kept sorted on _id so that lookups and range
+ * scans on _id use a binary search. Queries support equality, $eq, $ne, $gt,
+ * $gte, $lt, $lte, $in, $nin, $exists, $and, $or and $nor on top-level and
+ * dotted fields. Updates support replacement documents, $set, $unset, $inc
+ * and $setOnInsert on top-level fields. Aggregation supports $match, $skip,
+ * $limit, $sort, $project, $count, $sample and $out. explain of find answers
+ * with the queryPlan of servers that use SBE.
+ */
+
+#include "../compat/compat.h"
+
+#include <bson.h>
+
+#include <arpa/inet.h>
+#include <err.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define OP_REPLY 1
+#define OP_QUERY 2004
+#define OP_MSG 2013
+
+#define MAXMSG 48000000                 /* maxMessageSizeBytes */
+#define MAXBSON 16 * 1024 * 1024        /* maxBsonObjectSize */
+#define MAXBATCH (MAXBSON - 16 * 1024)  /* bytes of documents per reply */
+#define DEFBATCH 101                    /* default size of a first batch */
+#define MAXNAME 200
+#define MAXNS (2 * MAXNAME + 2)
+#define MAXERR 256
+
+/* error codes as returned by mongod */
+#define EBADVALUE 2
+#define EFAILEDTOPARSE 9
+#define ETYPEMISMATCH 14
+#define ENSNOTFOUND 26
+#define ECURSORNOTFOUND 43
+#define ENSEXISTS 48
+#define ECOMMANDNOTFOUND 59
+#define EIMMUTABLEFIELD 66
+#define EDUPKEY 11000
+#define EUNKNOWNSTAGE 40324
+
+struct coll {
+  char db[MAXNAME];
+  char name[MAXNAME];
+  bson_t **docs;    /* sorted on _id */
+  size_t ndocs;
+  size_t cap;
+  int64_t size;     /* sum of the document sizes */
+};
+
+struct cursor {
+  int64_t id;       /* 0 until registered */
+  char ns[MAXNS];
+  bson_t **docs;
+  size_t ndocs;
+  size_t cap;
+  size_t pos;
+  struct cursor *next;
+};
+
+struct command {
+  const char *name;
+  void (*fn)(const char *db, const bson_t *cmd, bson_t *reply);
+};
+
+static void usage(void);
+static void *serve(void *arg);
+static int readall(int fd, void *buf, size_t len);
+static int writeall(int fd, const void *buf, size_t len);
+static int32_t get32(const uint8_t *p);
+static void put32(uint8_t *p, int32_t v);
+static int handle_msg(int fd, int32_t reqid, int32_t respto, const uint8_t *msg, size_t len);
+static int handle_query(int fd, int32_t reqid, int32_t respto, const uint8_t *msg, size_t len);
+static int send_reply(int fd, int32_t reqid, int32_t respto, int32_t opcode, const uint8_t *pre, size_t prelen, const bson_t *doc);
+static void run_command(const char *db, const bson_t *cmd, bson_t *reply);
+static void cmd_ok(bson_t *reply);
+static void cmd_error(bson_t *reply, int code, const char *fmt, ...);
+static int cmd_doc(const bson_t *cmd, const char *key, bson_t *doc);
+static int64_t cmd_int64(const bson_t *cmd, const char *key, int64_t def);
+static int cmd_bool(const bson_t *cmd, const char *key, int def);
+static const char *cmd_collname(const bson_t *cmd, bson_t *reply);
+
+static void cmd_hello(const char *db, const bson_t *cmd, bson_t *reply);
+static void cmd_ping(const char *db, const bson_t *cmd, bson_t *reply);
+static void cmd_buildinfo(const char *db, const bson_t *cmd, bson_t *reply);
+static void cmd_currentop(const char *db, const bson_t *cmd, bson_t *reply);
+static void cmd_find(const char *db, const bson_t *cmd, bson_t *reply);
+static void cmd_getmore(const char *db, const bson_t *cmd, bson_t *reply);
+static void cmd_killcursors(const char *db, const bson_t *cmd, bson_t *reply);
+static void cmd_count(const char *db, const bson_t *cmd, bson_t *reply);
+static void cmd_insert(const char *db, const bson_t *cmd, bson_t *reply);
+static void cmd_update(const char *db, const bson_t *cmd, bson_t *reply);
+static void cmd_delete(const char *db, const bson_t *cmd, bson_t *reply);
+static void cmd_aggregate(const char *db, const bson_t *cmd, bson_t *reply);
+static void cmd_explain(const char *db, const bson_t *cmd, bson_t *reply);
+static void cmd_listdatabases(const char *db, const bson_t *cmd, bson_t *reply);
+static void cmd_listcollections(const char *db, const bson_t *cmd, bson_t *reply);
+static void cmd_listindexes(const char *db, const bson_t *cmd, bson_t *reply);
+static void cmd_create(const char *db, const bson_t *cmd, bson_t *reply);
+static void cmd_drop(const char *db, const bson_t *cmd, bson_t *reply);
+static void cmd_renamecollection(const char *db, const bson_t *cmd, bson_t *reply);
+static void cmd_dropdatabase(const char *db, const bson_t *cmd, bson_t *reply);
+static void cmd_collstats(const char *db, const bson_t *cmd, bson_t *reply);
+static void cmd_dbhash(const char *db, const bson_t *cmd, bson_t *reply);
+static void cmd_dbstats(const char *db, const bson_t *cmd, bson_t *reply);
+
+static struct coll *get_coll(const char *db, const char *name, int create);
+static void hash_coll(const struct coll *c, char *hex, size_t hexsize);
+static void drop_coll(struct coll *c);
+static int coll_insert(struct coll *c, bson_t *doc);
+static void coll_remove(struct coll *c, size_t i);
+static size_t id_bound(const struct coll *c, const bson_iter_t *id, int after);
+static void id_range(const struct coll *c, const bson_t *query, size_t *lo, size_t *hi);
+static int doc_id(const bson_t *doc, bson_iter_t *id);
+static bson_t *with_id(const bson_t *doc);
+
+static int typeclass(bson_type_t t);
+static int cmp_iter(const bson_iter_t *a, const bson_iter_t *b);
+static int lookup(const bson_t *doc, const char *key, bson_iter_t *it);
+static int is_opdoc(const bson_iter_t *it);
+static int match(const bson_t *doc, const bson_t *query);
+static int match_list(const bson_t *doc, const bson_iter_t *list, int any);
+static int match_field(const bson_t *doc, const char *key, const char *op, const bson_iter_t *arg);
+static int match_cond(const bson_iter_t *val, const char *op, const bson_iter_t *arg);
+
+static bson_t *project(const bson_t *doc, const bson_t *proj);
+static int cmp_docs(const void *a, const void *b);
+static bson_t *apply_update(const bson_t *doc, const bson_t *u, int *code, const char **msg);
+static bson_t *upsert_doc(const bson_t *q, const bson_t *u, int *code, const char **msg);
+static void append_sum(bson_t *b, const char *key, const bson_iter_t *x, const bson_iter_t *y);
+static void write_error(bson_t *errs, int *nerr, int index, int code, const char *msg);
+
+static struct cursor *cursor_new(const char *db, const char *name);
+static int cursor_add(struct cursor *cur, bson_t *doc);
+static void cursor_free(struct cursor *cur);
+static void cursor_slice(struct cursor *cur, int64_t skip, int64_t limit);
+static int cursor_collect(struct cursor *cur, const struct coll *c, const bson_t *query, int64_t max);
+static void cursor_reply(bson_t *reply, struct cursor *cur, const char *field, int64_t n, int single);
+static int run_stage(struct cursor *cur, const char *db, const bson_iter_t *stage, char *errmsg, size_t errsize);
+
+static const struct command commands[] = {
+  { "aggregate", cmd_aggregate },
+  { "buildInfo", cmd_buildinfo },
+  { "collStats", cmd_collstats },
+  { "count", cmd_count },
+  { "create", cmd_create },
+  { "currentOp", cmd_currentop },
+  { "dbHash", cmd_dbhash },
+  { "dbStats", cmd_dbstats },
+  { "delete", cmd_delete },
+  { "drop", cmd_drop },
+  { "dropDatabase", cmd_dropdatabase },
+  { "endSessions", cmd_ping },
+  { "explain", cmd_explain },
+  { "find", cmd_find },
+  { "getLastError", cmd_ping },
+  { "getMore", cmd_getmore },
+  { "hello", cmd_hello },
+  { "insert", cmd_insert },
+  { "isMaster", cmd_hello },
+  { "killCursors", cmd_killcursors },
+  { "killOp", cmd_ping },
+  { "listCollections", cmd_listcollections },
+  { "listDatabases", cmd_listdatabases },
+  { "listIndexes", cmd_listindexes },
+  { "ping", cmd_ping },
+  { "renameCollection", cmd_renamecollection },
+  { "update", cmd_update },
+};
+
+#define NCOMMANDS (sizeof commands / sizeof commands[0])
+
+static pthread_mutex_t storelock = PTHREAD_MUTEX_INITIALIZER;
+static struct coll **colls = NULL;
+static size_t ncolls = 0;
+static struct cursor *cursors = NULL;
+static int64_t lastcursor = 0;
+static const bson_t *sortspec; /* used by cmp_docs, protected by storelock */
+
+static struct timespec latency = { 0, 0 };
+static int verbose = 0;
+
+static void
+usage(void)
+{
+  fprintf(stderr, "usage: standin [-dv] [-a address] [-p port] [-l latency]\n");
+  exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+  struct sockaddr_in sin;
+  pthread_attr_t attr;
+  pthread_t thr;
+  const char *addr = "127.0.0.1";
+  pid_t pid;
+  double ms;
+  long port = 27019;
+  int fd, cfd, ch, on = 1, daemonize = 0;
+
+  while ((ch = getopt(argc, argv, "a:dl:p:v")) != -1)
+    switch (ch) {
+    case 'a':
+      addr = optarg;
+      break;
+    case 'd':
+      daemonize = 1;
+      break;
+    case 'l':
+      if ((ms = strtod(optarg, NULL)) < 0)
+        usage();
+      latency.tv_sec = (time_t)(ms / 1000);
+      latency.tv_nsec = (long)((ms - latency.tv_sec * 1000.0) * 1000000);
+      break;
+    case 'p':
+      if ((port = strtol(optarg, NULL, 10)) <= 0 || port > 65535)
+        usage();
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    default:
+      usage();
+    }
+  if (optind != argc)
+    usage();
+
+  signal(SIGPIPE, SIG_IGN);
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons((uint16_t)port);
+  if (inet_pton(AF_INET, addr, &sin.sin_addr) != 1)
+    errx(1, "illegal address: %s", addr);
+
+  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+    err(1, "socket");
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1)
+    err(1, "setsockopt");
+  if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == -1)
+    err(1, "bind %s:%ld", addr, port);
+  if (listen(fd, 128) == -1)
+    err(1, "listen");
+
+  if (verbose)
+    fprintf(stderr, "listening on %s:%ld\n", addr, port);
+
+  /* with -d the parent exits once the socket accepts connections */
+  if (daemonize) {
+    if ((pid = fork()) == -1)
+      err(1, "fork");
+    if (pid > 0) {
+      printf("%ld\n", (long)pid);
+      exit(0);
+    }
+    fclose(stdout);
+  }
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  for (;;) {
+    if ((cfd = accept(fd, NULL, NULL)) == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      err(1, "accept");
+    }
+    setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (pthread_create(&thr, &attr, serve, (void *)(intptr_t)cfd) != 0) {
+      warnx("can't start connection thread");
+      close(cfd);
+    }
+  }
+}
+
+/* handle all messages on one connection */
+static void *
+serve(void *arg)
+{
+  uint8_t hdr[16], *msg;
+  int32_t len, reqid, opcode, lastid;
+  int fd, ret;
+
+  fd = (int)(intptr_t)arg;
+  lastid = 0;
+
+  while (readall(fd, hdr, sizeof(hdr)) == 0) {
+    len = get32(hdr);
+    reqid = get32(hdr + 4);
+    opcode = get32(hdr + 12);
+
+    if (len < 16 || len > MAXMSG)
+      break;
+    if ((msg = malloc(len)) == NULL)
+      break;
+    memcpy(msg, hdr, sizeof(hdr));
+    if (readall(fd, msg + sizeof(hdr), len - sizeof(hdr)) < 0) {
+      free(msg);
+      break;
+    }
+
+    switch (opcode) {
+    case OP_MSG:
+      ret = handle_msg(fd, ++lastid, reqid, msg, len);
+      break;
+    case OP_QUERY:
+      ret = handle_query(fd, ++lastid, reqid, msg, len);
+      break;
+    default:
+      warnx("unsupported opcode: %d", opcode);
+      ret = -1;
+    }
+    free(msg);
+
+    if (ret < 0)
+      break;
+  }
+
+  close(fd);
+  return NULL;
+}
+
+static int
+readall(int fd, void *buf, size_t len)
+{
+  uint8_t *p = buf;
+  ssize_t n;
+
+  while (len > 0) {
+    if ((n = read(fd, p, len)) <= 0) {
+      if (n == -1 && errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+static int
+writeall(int fd, const void *buf, size_t len)
+{
+  const uint8_t *p = buf;
+  ssize_t n;
+
+  while (len > 0) {
+    if ((n = write(fd, p, len)) == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+/* decode a little-endian int32 */
+static int32_t
+get32(const uint8_t *p)
+{
+  return (int32_t)((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+}
+
+/* encode a little-endian int32 */
+static void
+put32(uint8_t *p, int32_t v)
+{
+  p[0] = (uint32_t)v & 0xff;
+  p[1] = ((uint32_t)v >> 8) & 0xff;
+  p[2] = ((uint32_t)v >> 16) & 0xff;
+  p[3] = ((uint32_t)v >> 24) & 0xff;
+}
+
+/*
+ * Handle an OP_MSG. The body section is the command, document sequence
+ * sections are appended to it as arrays. No reply is sent if the client set
+ * moreToCome.
+ *
+ * return 0 on success, -1 if the message is malformed or can't be answered
+ */
+static int
+handle_msg(int fd, int32_t reqid, int32_t respto, const uint8_t *msg, size_t len)
+{
+  const uint8_t *p, *end, *q, *seqend;
+  const char *ident, *key;
+  bson_t body, cmd, seqs, arr, doc, reply;
+  bson_iter_t it;
+  char db[MAXNAME], buf[16];
+  uint8_t flags[5] = { 0, 0, 0, 0, 0 }; /* flagBits and section kind 0 */
+  uint32_t flagbits;
+  int32_t size, dsize;
+  int havebody, ret;
+  size_t identlen;
+  uint32_t i;
+
+  if (len < 21)
+    return -1;
+
+  flagbits = (uint32_t)get32(msg + 16);
+  p = msg + 20;
+  end = msg + len;
+  if (flagbits & 1) /* checksumPresent */
+    end -= 4;
+
+  havebody = 0;
+  bson_init(&seqs);
+  while (p < end) {
+    if (end - p < 5)
+      goto bad;
+    size = get32(p + 1);
+    if (size < 5 || size > end - p - 1)
+      goto bad;
+
+    switch (*p) {
+    case 0:
+      if (havebody || !bson_init_static(&body, p + 1, size))
+        goto bad;
+      havebody = 1;
+      break;
+    case 1:
+      ident = (const char *)p + 5;
+      identlen = strnlen(ident, size - 4);
+      if (identlen == (size_t)size - 4)
+        goto bad;
+      q = p + 5 + identlen + 1;
+      seqend = p + 1 + size;
+
+      bson_append_array_begin(&seqs, ident, -1, &arr);
+      for (i = 0; q < seqend; i++) {
+        if (seqend - q < 5)
+          goto bad;
+        dsize = get32(q);
+        if (dsize < 5 || dsize > seqend - q || !bson_init_static(&doc, q, dsize))
+          goto bad;
+        bson_uint32_to_string(i, &key, buf, sizeof(buf));
+        bson_append_document(&arr, key, -1, &doc);
+        q += dsize;
+      }
+      bson_append_array_end(&seqs, &arr);
+      break;
+    default:
+      goto bad;
+    }
+    p += 1 + size;
+  }
+
+  if (!havebody)
+    goto bad;
+
+  bson_init(&cmd);
+  bson_concat(&cmd, &body);
+  bson_concat(&cmd, &seqs);
+  bson_destroy(&seqs);
+
+  db[0] = '\0';
+  if (bson_iter_init_find(&it, &cmd, "$db") && BSON_ITER_HOLDS_UTF8(&it))
+    snprintf(db, sizeof(db), "%s", bson_iter_utf8(&it, NULL));
+
+  run_command(db, &cmd, &reply);
+  bson_destroy(&cmd);
+
+  ret = 0;
+  if ((flagbits & 2) == 0) /* moreToCome */
+    ret = send_reply(fd, reqid, respto, OP_MSG, flags, sizeof(flags), &reply);
+  bson_destroy(&reply);
+
+  return ret;
+
+bad:
+  bson_destroy(&seqs);
+  warnx("malformed OP_MSG");
+  return -1;
+}
+
+/*
+ * Handle an OP_QUERY, which is only used by drivers for the handshake and for
+ * commands on the "$cmd" collection.
+ *
+ * return 0 on success, -1 if the message is malformed or can't be answered
+ */
+static int
+handle_query(int fd, int32_t reqid, int32_t respto, const uint8_t *msg, size_t len)
+{
+  uint8_t pre[20];
+  const char *ns;
+  const uint8_t *p;
+  bson_t query, cmd, reply;
+  bson_iter_t it;
+  char db[MAXNAME];
+  size_t nslen;
+  int32_t size;
+  int ret;
+
+  if (len < 20)
+    return -1;
+
+  ns = (const char *)msg + 20;
+  nslen = strnlen(ns, len - 20);
+  p = msg + 20 + nslen + 1 + 8; /* skip numberToSkip and numberToReturn */
+  if (nslen == len - 20 || p + 5 > msg + len)
+    goto bad;
+  size = get32(p);
+  if (size < 5 || size > msg + len - p || !bson_init_static(&query, p, size))
+    goto bad;
+
+  memset(pre, 0, sizeof(pre));
+
+  if (nslen < 5 || strcmp(ns + nslen - 5, ".$cmd") != 0 || nslen - 5 >= sizeof(db)) {
+    put32(pre, 2); /* QueryFailure */
+    put32(pre + 16, 1);
+    bson_init(&reply);
+    BSON_APPEND_UTF8(&reply, "$err", "only commands are supported over OP_QUERY");
+    BSON_APPEND_INT32(&reply, "code", ECOMMANDNOTFOUND);
+    ret = send_reply(fd, reqid, respto, OP_REPLY, pre, sizeof(pre), &reply);
+    bson_destroy(&reply);
+    return ret;
+  }
+
+  memcpy(db, ns, nslen - 5);
+  db[nslen - 5] = '\0';
+
+  /* commands with a read preference are wrapped in $query */
+  if (bson_iter_init_find(&it, &query, "$query") && BSON_ITER_HOLDS_DOCUMENT(&it)) {
+    if (!cmd_doc(&query, "$query", &cmd))
+      goto bad;
+  } else {
+    bson_init_static(&cmd, bson_get_data(&query), query.len);
+  }
+
+  run_command(db, &cmd, &reply);
+
+  put32(pre + 16, 1); /* numberReturned */
+  ret = send_reply(fd, reqid, respto, OP_REPLY, pre, sizeof(pre), &reply);
+  bson_destroy(&reply);
+
+  return ret;
+
+bad:
+  warnx("malformed OP_QUERY");
+  return -1;
+}
+
+/* send doc after the message header and the opcode specific prefix pre */
+static int
+send_reply(int fd, int32_t reqid, int32_t respto, int32_t opcode, const uint8_t *pre, size_t prelen, const bson_t *doc)
+{
+  uint8_t hdr[16 + 20];
+
+  if (prelen > sizeof(hdr) - 16)
+    return -1;
+
+  put32(hdr, (int32_t)(16 + prelen + doc->len));
+  put32(hdr + 4, reqid);
+  put32(hdr + 8, respto);
+  put32(hdr + 12, opcode);
+  memcpy(hdr + 16, pre, prelen);
+
+  if (latency.tv_sec || latency.tv_nsec)
+    nanosleep(&latency, NULL);
+
+  if (writeall(fd, hdr, 16 + prelen) < 0)
+    return -1;
+  if (writeall(fd, bson_get_data(doc), doc->len) < 0)
+    return -1;
+
+  return 0;
+}
+
+/* initialize reply and run the command cmd on database db */
+static void
+run_command(const char *db, const bson_t *cmd, bson_t *reply)
+{
+  bson_iter_t it;
+  const char *name;
+  char *str;
+  size_t i;
+
+  bson_init(reply);
+
+  if (!bson_iter_init(&it, cmd) || !bson_iter_next(&it)) {
+    cmd_error(reply, EFAILEDTOPARSE, "empty command");
+    return;
+  }
+  name = bson_iter_key(&it);
+
+  if (verbose) {
+    str = bson_as_json(cmd, NULL);
+    fprintf(stderr, "%s %s\n", db, str);
+    bson_free(str);
+  }
+
+  for (i = 0; i < NCOMMANDS; i++)
+    if (strcasecmp(commands[i].name, name) == 0) {
+      pthread_mutex_lock(&storelock);
+      commands[i].fn(db, cmd, reply);
+      pthread_mutex_unlock(&storelock);
+      return;
+    }
+
+  cmd_error(reply, ECOMMANDNOTFOUND, "no such command: '%s'", name);
+}
+
+static void
+cmd_ok(bson_t *reply)
+{
+  BSON_APPEND_DOUBLE(reply, "ok", 1.0);
+}
+
+static void
+cmd_error(bson_t *reply, int code, const char *fmt, ...)
+{
+  char msg[MAXERR];
+  va_list ap;
+
+  va_start(ap, fmt);
+  vsnprintf(msg, sizeof(msg), fmt, ap);
+  va_end(ap);
+
+  BSON_APPEND_DOUBLE(reply, "ok", 0.0);
+  BSON_APPEND_UTF8(reply, "errmsg", msg);
+  BSON_APPEND_INT32(reply, "code", code);
+}
+
+/*
+ * Initialize doc as a read-only view of the document or array in field key of
+ * cmd.
+ *
+ * return 1 if the field exists and is a document or array, 0 otherwise
+ */
+static int
+cmd_doc(const bson_t *cmd, const char *key, bson_t *doc)
+{
+  bson_iter_t it;
+  const uint8_t *data;
+  uint32_t len;
+
+  if (!bson_iter_init_find(&it, cmd, key))
+    return 0;
+
+  if (BSON_ITER_HOLDS_DOCUMENT(&it))
+    bson_iter_document(&it, &len, &data);
+  else if (BSON_ITER_HOLDS_ARRAY(&it))
+    bson_iter_array(&it, &len, &data);
+  else
+    return 0;
+
+  return bson_init_static(doc, data, len);
+}
+
+static int64_t
+cmd_int64(const bson_t *cmd, const char *key, int64_t def)
+{
+  bson_iter_t it;
+
+  if (!bson_iter_init_find(&it, cmd, key) || !BSON_ITER_HOLDS_NUMBER(&it))
+    return def;
+
+  return bson_iter_as_int64(&it);
+}
+
+static int
+cmd_bool(const bson_t *cmd, const char *key, int def)
+{
+  bson_iter_t it;
+
+  if (!bson_iter_init_find(&it, cmd, key))
+    return def;
+
+  return bson_iter_as_bool(&it);
+}
+
+/* return the collection name in the first field of cmd, or NULL with an error in reply */
+static const char *
+cmd_collname(const bson_t *cmd, bson_t *reply)
+{
+  bson_iter_t it;
+  const char *name;
+
+  if (!bson_iter_init(&it, cmd) || !bson_iter_next(&it) || !BSON_ITER_HOLDS_UTF8(&it)) {
+    cmd_error(reply, EBADVALUE, "collection name must be a string");
+    return NULL;
+  }
+
+  name = bson_iter_utf8(&it, NULL);
+  if (strlen(name) == 0 || strlen(name) >= MAXNAME) {
+    cmd_error(reply, EBADVALUE, "invalid collection name");
+    return NULL;
+  }
+
+  return name;
+}
+
+static void
+cmd_hello(const char *db, const bson_t *cmd, bson_t *reply)
+{
+  struct timespec now;
+
+  (void)db;
+  (void)cmd;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  BSON_APPEND_BOOL(reply, "ismaster", 1);
+  BSON_APPEND_BOOL(reply, "isWritablePrimary", 1);
+  BSON_APPEND_INT32(reply, "maxBsonObjectSize", MAXBSON);
+  BSON_APPEND_INT32(reply, "maxMessageSizeBytes", MAXMSG);
+  BSON_APPEND_INT32(reply, "maxWriteBatchSize", 100000);
+  BSON_APPEND_DATE_TIME(reply, "localTime", (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+  BSON_APPEND_INT32(reply, "minWireVersion", 0);
+  BSON_APPEND_INT32(reply, "maxWireVersion", 6); /* OP_MSG, no sessions */
+  BSON_APPEND_BOOL(reply, "readOnly", 0);
+  cmd_ok(reply);
+}
+
+static void
+cmd_ping(const char *db, const bson_t *cmd, bson_t *reply)
+{
+  (void)db;
+  (void)cmd;
+
+  cmd_ok(reply);
+}
+
+static void
+cmd_buildinfo(const char *db, const bson_t *cmd, bson_t *reply)
+{
+  bson_t arr;
+
+  (void)db;
+  (void)cmd;
+
+  BSON_APPEND_UTF8(reply, "version", "3.6.0-standin");
+  bson_append_array_begin(reply, "versionArray", -1, &arr);
+  BSON_APPEND_INT32(&arr, "0", 3);
+  BSON_APPEND_INT32(&arr, "1", 6);
+  BSON_APPEND_INT32(&arr, "2", 0);
+  BSON_APPEND_INT32(&arr, "3", 0);
+  bson_append_array_end(reply, &arr);
+  BSON_APPEND_INT32(reply, "maxBsonObjectSize", MAXBSON);
+  cmd_ok(reply);
+}
+
+/* every command is answered before the next is read, so nothing is ever in progress */
+static void
+cmd_currentop(const char *db, const bson_t *cmd, bson_t *reply)
+{
+  bson_t arr;
+
+  (void)db;
+  (void)cmd;
+
+  bson_append_array_begin(reply, "inprog", -1, &arr);
+  bson_append_array_end(reply, &arr);
+  cmd_ok(reply);
+}
+
+static void
+cmd_find(const char *db, const bson_t *cmd, bson_t *reply)
+{
+  struct cursor *cur;
+  struct coll *c;
+  bson_t filter, proj, sort;
+  const char *name;
+  int64_t skip, limit, batch, max;
+  size_t i;
+  bson_t *doc;
+  int single;
+
+  if ((name = cmd_collname(cmd, reply)) == NULL)
+    return;
+
+  if (!cmd_doc(cmd, "filter", &filter))
+    bson_init(&filter);
+
+  skip = cmd_int64(cmd, "skip", 0);
+  limit = cmd_int64(cmd, "limit", 0);
+  batch = cmd_int64(cmd, "batchSize", DEFBATCH);
+  single = cmd_bool(cmd, "singleBatch", 0);
+  if (limit < 0) {
+    limit = -limit;
+    single = 1;
+  }
+
+  if ((cur = cursor_new(db, name)) == NULL)
+    err(1, "cmd_find");
+
+  /* without a sort the scan can stop as soon as the limit is reached */
+  max = 0;
+  if (limit > 0 && !cmd_doc(cmd, "sort", &sort))
+    max = skip + limit;
+
+  c = get_coll(db, name, 0);
+  if (c != NULL && cursor_collect(cur, c, &filter, max) < 0) {
+    cursor_free(cur);
+    cmd_error(reply, EBADVALUE, "unsupported query operator");
+    return;
+  }
+
+  if (cmd_doc(cmd, "sort", &sort)) {
+    sortspec = &sort;
+    qsort(cur->docs, cur->ndocs, sizeof(*cur->docs), cmp_docs);
+  }
+
+  cursor_slice(cur, skip, limit);
+
+  if (cmd_doc(cmd, "projection", &proj))
+    for (i = 0; i < cur->ndocs; i++) {
+      doc = project(cur->docs[i], &proj);
+      bson_destroy(cur->docs[i]);
+      cur->docs[i] = doc;
+    }
+
+  cursor_reply(reply, cur, "firstBatch", batch, single);
+}
+
+static void
+cmd_getmore(const char *db, const bson_t *cmd, bson_t *reply)
+{
+  struct cursor *cur;
+  bson_iter_t it;
+  int64_t id;
+
+  (void)db;
+
+  if (!bson_iter_init(&it, cmd) || !bson_iter_next(&it) || !BSON_ITER_HOLDS_NUMBER(&it)) {
+    cmd_error(reply, ETYPEMISMATCH, "cursor id must be a number");
+    return;
+  }
+  id = bson_iter_as_int64(&it);
+
+  for (cur = cursors; cur != NULL; cur = cur->next)
+    if (cur->id == id)
+      break;
+
+  if (cur == NULL) {
+    cmd_error(reply, ECURSORNOTFOUND, "cursor id %lld not found", (long long)id);
+    return;
+  }
+
+  cursor_reply(reply, cur, "nextBatch", cmd_int64(cmd, "batchSize", 0), 0);
+}
+
+static void
+cmd_killcursors(const char *db, const bson_t *cmd, bson_t *reply)
+{
+  struct cursor **cp, *cur;
+  bson_t ids, killed, notfound;
+  bson_iter_t it;
+  int64_t id;
+
+  (void)db;
+
+  if (!cmd_doc(cmd, "cursors", &ids)) {
+    cmd_error(reply, EFAILEDTOPARSE, "cursors must be an array");
+    return;
+  }
+
+  bson_init(&killed);
+  bson_init(&notfound);
+
+  bson_iter_init(&it, &ids);
+  while (bson_iter_next(&it)) {
+    id = bson_iter_as_int64(&it);
+    for (cp = &cursors; *cp != NULL; cp = &(*cp)->next)
+      if ((*cp)->id == id)
+        break;
+
+    if ((cur = *cp) != NULL) {
+      *cp = cur->next;
+      cursor_free(cur);
+      BSON_APPEND_INT64(&killed, bson_iter_key(&it), id);
+    } else {
+      BSON_APPEND_INT64(&notfound, bson_iter_key(&it), id);
+    }
+  }
+
+  BSON_APPEND_ARRAY(reply, "cursorsKilled", &killed);
+  BSON_APPEND_ARRAY(reply, "cursorsNotFound", &notfound);
+  cmd_ok(reply);
+
+  bson_destroy(&killed);
+  bson_destroy(&notfound);
+}
+
+static void
+cmd_count(const char *db, const bson_t *cmd, bson_t *reply)
+{
+  struct coll *c;
+  bson_t query;
+  const char *name;
+  int64_t n, skip, limit;
+  size_t i, lo, hi;
+  int r;
+
+  if ((name = cmd_collname(cmd, reply)) == NULL)
+    return;
+
+  if (!cmd_doc(cmd, "query", &query))
+    bson_init(&query);
+
+  skip = cmd_int64(cmd, "skip", 0);
+  limit = cmd_int64(cmd, "limit", 0);
+  if (limit < 0)
+    limit = -limit;
+
+  n = 0;
+  if ((c = get_coll(db, name, 0)) != NULL) {
+    id_range(c, &query, &lo, &hi);
+    for (i = lo; i < hi; i++) {
+      if ((r = match(c->docs[i], &query)) < 0) {
+        cmd_error(reply, EBADVALUE, "unsupported query operator");
+        return;
+      }
+      n += r;
+    }
+  }
+
+  n -= skip;
+  if (n < 0)
+    n = 0;
+  if (limit > 0 && n > limit)
+    n = limit;
+
+  BSON_APPEND_INT64(reply, "n", n);
+  cmd_ok(reply);
+}
+
+static void
+cmd_insert(const char *db, const bson_t *cmd, bson_t *reply)
+{
+  struct coll *c;
+  bson_t docs, doc, errs;
+  bson_iter_t it;
+  const uint8_t *data;
+  const char *name;
+  char msg[MAXERR];
+  uint32_t len;
+  bson_t *d;
+  int n, nerr, ordered, index;
+
+  if ((name = cmd_collname(cmd, reply)) == NULL)
+    return;
+
+  if (!cmd_doc(cmd, "documents", &docs)) {
+    cmd_error(reply, EFAILEDTOPARSE, "documents must be an array");
+    return;
+  }
+
+  ordered = cmd_bool(cmd, "ordered", 1);
+
+  if ((c = get_coll(db, name, 1)) == NULL)
+    err(1, "cmd_insert");
+
+  n = nerr = 0;
+  bson_init(&errs);
+  bson_iter_init(&it, &docs);
+  for (index = 0; bson_iter_next(&it); index++) {
+    if (!BSON_ITER_HOLDS_DOCUMENT(&it)) {
+      write_error(&errs, &nerr, index, ETYPEMISMATCH, "document must be an object");
+    } else {
+      bson_iter_document(&it, &len, &data);
+      bson_init_static(&doc, data, len);
+      if ((d = with_id(&doc)) == NULL)
+        err(1, "cmd_insert");
+      if (coll_insert(c, d) == 0) {
+        n++;
+        continue;
+      }
+      bson_destroy(d);
+      snprintf(msg, sizeof(msg), "E11000 duplicate key error collection: %s.%s index: _id_", db, name);
+      write_error(&errs, &nerr, index, EDUPKEY, msg);
+    }
+    if (ordered)
+      break;
+  }
+
+  BSON_APPEND_INT32(reply, "n", n);
+  if (nerr)
+    BSON_APPEND_ARRAY(reply, "writeErrors", &errs);
+  cmd_ok(reply);
+
+  bson_destroy(&errs);
+}
+
+static void
+cmd_update(const char *db, const bson_t *cmd, bson_t *reply)
+{
+  struct coll *c;
+  bson_t updates, spec, q, u, errs, upserted, up;
+  bson_iter_t it, id;
+  const uint8_t *data;
+  const char *name, *msg, *key;
+  char buf[16];
+  uint32_t len;
+  bson_t *out;
+  size_t j, lo, hi;
+  int n, nmod, nerr, nup, ordered, index, matched, multi, code, r;
+
+  if ((name = cmd_collname(cmd, reply)) == NULL)
+    return;
+
+  if (!cmd_doc(cmd, "updates", &updates)) {
+    cmd_error(reply, EFAILEDTOPARSE, "updates must be an array");
+    return;
+  }
+
+  ordered = cmd_bool(cmd, "ordered", 1);
+
+  if ((c = get_coll(db, name, 1)) == NULL)
+    err(1, "cmd_update");
+
+  n = nmod = nerr = nup = 0;
+  bson_init(&errs);
+  bson_init(&upserted);
+  bson_iter_init(&it, &updates);
+  for (index = 0; bson_iter_next(&it); index++) {
+    if (!BSON_ITER_HOLDS_DOCUMENT(&it)) {
+      write_error(&errs, &nerr, index, ETYPEMISMATCH, "update must be an object");
+      if (ordered)
+        break;
+      continue;
+    }
+    bson_iter_document(&it, &len, &data);
+    bson_init_static(&spec, data, len);
+
+    if (!cmd_doc(&spec, "q", &q) || !cmd_doc(&spec, "u", &u)) {
+      write_error(&errs, &nerr, index, EFAILEDTOPARSE, "q and u must be objects");
+      if (ordered)
+        break;
+      continue;
+    }
+    multi = cmd_bool(&spec, "multi", 0);
+
+    code = 0;
+    msg = NULL;
+    matched = 0;
+    id_range(c, &q, &lo, &hi);
+    for (j = lo; j < hi; j++) {
+      if ((r = match(c->docs[j], &q)) < 0) {
+        code = EBADVALUE;
+        msg = "unsupported query operator";
+        break;
+      }
+      if (r == 0)
+        continue;
+
+      matched++;
+      if ((out = apply_update(c->docs[j], &u, &code, &msg)) == NULL)
+        break;
+
+      /* the _id can't change so the document keeps its position */
+      if (out->len != c->docs[j]->len || memcmp(bson_get_data(out), bson_get_data(c->docs[j]), out->len) != 0) {
+        c->size += (int64_t)out->len - c->docs[j]->len;
+        bson_destroy(c->docs[j]);
+        c->docs[j] = out;
+        nmod++;
+      } else {
+        bson_destroy(out);
+      }
+
+      if (!multi)
+        break;
+    }
+
+    if (code == 0 && matched == 0 && cmd_bool(&spec, "upsert", 0)) {
+      if ((out = upsert_doc(&q, &u, &code, &msg)) != NULL) {
+        if (coll_insert(c, out) == 0) {
+          doc_id(out, &id);
+          bson_uint32_to_string(nup, &key, buf, sizeof(buf));
+          bson_append_document_begin(&upserted, key, -1, &up);
+          BSON_APPEND_INT32(&up, "index", index);
+          bson_append_iter(&up, "_id", -1, &id);
+          bson_append_document_end(&upserted, &up);
+          nup++;
+        } else {
+          bson_destroy(out);
+          code = EDUPKEY;
+          msg = "E11000 duplicate key error index: _id_";
+        }
+      }
+    }
+
+    n += matched;
+
+    if (code != 0) {
+      write_error(&errs, &nerr, index, code, msg);
+      if (ordered)
+        break;
+    }
+  }
+
+  BSON_APPEND_INT32(reply, "n", n + nup);
+  BSON_APPEND_INT32(reply, "nModified", nmod);
+  if (nup)
+    BSON_APPEND_ARRAY(reply, "upserted", &upserted);
+  if (nerr)
+    BSON_APPEND_ARRAY(reply, "writeErrors", &errs);
+  cmd_ok(reply);
+
+  bson_destroy(&upserted);
+  bson_destroy(&errs);
+}
+
+static void
+cmd_delete(const char *db, const bson_t *cmd, bson_t *reply)
+{
+  struct coll *c;
+  bson_t deletes, spec, q, errs;
+  bson_iter_t it;
+  const uint8_t *data;
+  const char *name;
+  uint32_t len;
+  size_t j, lo, hi;
+  int n, nerr, ordered, index, limit, r;
+
+  if ((name = cmd_collname(cmd, reply)) == NULL)
+    return;
+
+  if (!cmd_doc(cmd, "deletes", &deletes)) {
+    cmd_error(reply, EFAILEDTOPARSE, "deletes must be an array");
+    return;
+  }
+
+  ordered = cmd_bool(cmd, "ordered", 1);
+  c = get_coll(db, name, 0);
+
+  n = nerr = 0;
+  bson_init(&errs);
+  bson_iter_init(&it, &deletes);
+  for (index = 0; bson_iter_next(&it); index++) {
+    r = 0;
+    if (BSON_ITER_HOLDS_DOCUMENT(&it)) {
+      bson_iter_document(&it, &len, &data);
+      bson_init_static(&spec, data, len);
+      r = cmd_doc(&spec, "q", &q);
+    }
+    if (!r) {
+      write_error(&errs, &nerr, index, EFAILEDTOPARSE, "q must be an object");
+      if (ordered)
+        break;
+      continue;
+    }
+
+    if (c == NULL)
+      continue;
+
+    limit = (int)cmd_int64(&spec, "limit", 0);
+    id_range(c, &q, &lo, &hi);
+    for (j = lo; j < hi; ) {
+      if ((r = match(c->docs[j], &q)) < 0)
+        break;
+      if (r == 0) {
+        j++;
+        continue;
+      }
+      coll_remove(c, j);
+      hi--;
+      n++;
+      if (limit == 1)
+        break;
+    }
+
+    if (r < 0) {
+      write_error(&errs, &nerr, index, EBADVALUE, "unsupported query operator");
+      if (ordered)
+        break;
+    }
+  }
+
+  BSON_APPEND_INT32(reply, "n", n);
+  if (nerr)
+    BSON_APPEND_ARRAY(reply, "writeErrors", &errs);
+  cmd_ok(reply);
+
+  bson_destroy(&errs);
+}
+
+static void
+cmd_aggregate(const char *db, const bson_t *cmd, bson_t *reply)
+{
+  struct cursor *cur;
+  struct coll *c;
+  bson_t pipeline, cursoropts, query;
+  bson_iter_t it, stage;
+  const uint8_t *data;
+  const char *name;
+  char msg[MAXERR];
+  uint32_t len;
+  int code, first;
+
+  if ((name = cmd_collname(cmd, reply)) == NULL)
+    return;
+
+  if (!cmd_doc(cmd, "pipeline", &pipeline)) {
+    cmd_error(reply, EFAILEDTOPARSE, "pipeline must be an array");
+    return;
+  }
+
+  if ((cur = cursor_new(db, name)) == NULL)
+    err(1, "cmd_aggregate");
+
+  /* an initial $match is used to select the input documents */
+  first = 0;
+  if (bson_iter_init(&it, &pipeline) && bson_iter_next(&it) && BSON_ITER_HOLDS_DOCUMENT(&it) &&
+      bson_iter_recurse(&it, &stage) && bson_iter_next(&stage) &&
+      strcmp(bson_iter_key(&stage), "$match") == 0 && BSON_ITER_HOLDS_DOCUMENT(&stage)) {
+    bson_iter_document(&stage, &len, &data);
+    bson_init_static(&query, data, len);
+    first = 1;
+  } else {
+    bson_init(&query);
+  }
+
+  c = get_coll(db, name, 0);
+  if (c != NULL && cursor_collect(cur, c, &query, 0) < 0) {
+    cursor_free(cur);
+    cmd_error(reply, EBADVALUE, "unsupported query operator");
+    return;
+  }
+
+  bson_iter_init(&it, &pipeline);
+  if (first)
+    bson_iter_next(&it);
+  while (bson_iter_next(&it)) {
+    if ((code = run_stage(cur, db, &it, msg, sizeof(msg))) != 0) {
+      cursor_free(cur);
+      cmd_error(reply, code, "%s", msg);
+      return;
+    }
+  }
+
+  if (!cmd_doc(cmd, "cursor", &cursoropts))
+    bson_init(&cursoropts);
+
+  cursor_reply(reply, cur, "firstBatch", cmd_int64(&cursoropts, "batchSize", DEFBATCH), 0);
+}
+
+/*
+ * Apply one aggregation stage to the documents in cur.
+ *
+ * return 0 on success or an error code with errmsg set
+ */
+static int
+run_stage(struct cursor *cur, const char *db, const bson_iter_t *stage, char *errmsg, size_t errsize)
+{
+  struct coll *c;
+  bson_t spec;
+  bson_iter_t it;
+  const uint8_t *data;
+  const char *name;
+  uint32_t len;
+  bson_t *doc;
+  size_t i, j;
+  int64_t n;
+  int r;
+
+  if (!BSON_ITER_HOLDS_DOCUMENT(stage) || !bson_iter_recurse(stage, &it) || !bson_iter_next(&it)) {
+    snprintf(errmsg, errsize, "a pipeline stage must be an object with one field");
+    return EFAILEDTOPARSE;
+  }
+  name = bson_iter_key(&it);
+
+  if (BSON_ITER_HOLDS_DOCUMENT(&it)) {
+    bson_iter_document(&it, &len, &data);
+    bson_init_static(&spec, data, len);
+  } else {
+    bson_init(&spec);
+  }
+
+  if (strcmp(name, "$match") == 0) {
+    for (i = j = 0; i < cur->ndocs; i++) {
+      if ((r = match(cur->docs[i], &spec)) < 0) {
+        snprintf(errmsg, errsize, "unsupported query operator");
+        return EBADVALUE;
+      }
+      if (r)
+        cur->docs[j++] = cur->docs[i];
+      else
+        bson_destroy(cur->docs[i]);
+    }
+    cur->ndocs = j;
+  } else if (strcmp(name, "$skip") == 0) {
+    cursor_slice(cur, bson_iter_as_int64(&it), 0);
+  } else if (strcmp(name, "$limit") == 0) {
+    cursor_slice(cur, 0, bson_iter_as_int64(&it));
+  } else if (strcmp(name, "$sort") == 0) {
+    sortspec = &spec;
+    qsort(cur->docs, cur->ndocs, sizeof(*cur->docs), cmp_docs);
+  } else if (strcmp(name, "$project") == 0) {
+    for (i = 0; i < cur->ndocs; i++) {
+      doc = project(cur->docs[i], &spec);
+      bson_destroy(cur->docs[i]);
+      cur->docs[i] = doc;
+    }
+  } else if (strcmp(name, "$sample") == 0) {
+    n = cmd_int64(&spec, "size", 0);
+    for (i = 0; i < cur->ndocs && (int64_t)i < n; i++) {
+      j = i + (size_t)rand() % (cur->ndocs - i);
+      doc = cur->docs[i];
+      cur->docs[i] = cur->docs[j];
+      cur->docs[j] = doc;
+    }
+    cursor_slice(cur, 0, n > 0 ? n : 1);
+  } else if (strcmp(name, "$count") == 0) {
+    if (!BSON_ITER_HOLDS_UTF8(&it)) {
+      snprintf(errmsg, errsize, "the count field must be a string");
+      return EFAILEDTOPARSE;
+    }
+    n = cur->ndocs;
+    cursor_slice(cur, cur->ndocs, 0);
+    if ((doc = bson_new()) == NULL)
+      err(1, "run_stage");
+    BSON_APPEND_INT32(doc, bson_iter_utf8(&it, NULL), (int32_t)n);
+    if (cursor_add(cur, doc) < 0)
+      err(1, "run_stage");
+  } else if (strcmp(name, "$out") == 0) {
+    if (!BSON_ITER_HOLDS_UTF8(&it) || strlen(bson_iter_utf8(&it, NULL)) >= MAXNAME) {
+      snprintf(errmsg, errsize, "$out only supports a collection name");
+      return EFAILEDTOPARSE;
+    }
+    if ((c = get_coll(db, bson_iter_utf8(&it, NULL), 1)) == NULL)
+      err(1, "run_stage");
+    while (c->ndocs > 0)
+      coll_remove(c, c->ndocs - 1);
+    for (i = 0; i < cur->ndocs; i++) {
+      if ((doc = with_id(cur->docs[i])) == NULL)
+        err(1, "run_stage");
+      if (coll_insert(c, doc) != 0) {
+        bson_destroy(doc);
+        snprintf(errmsg, errsize, "E11000 duplicate key error index: _id_");
+        return EDUPKEY;
+      }
+    }
+    cursor_slice(cur, cur->ndocs, 0);
+  } else {
+    snprintf(errmsg, errsize, "Unrecognized pipeline stage name: '%s'", name);
+    return EUNKNOWNSTAGE;
+  }
+
+  return 0;
+}
+
+/* explain find, count or aggregate with a plan that says whether the _id range scan is used */
+static void
+cmd_explain(const char *db, const bson_t *cmd, bson_t *reply)
+{
+  struct coll *c;
+  bson_t inner, query, pipeline, stage, plan, winning, input, stats, *top;
+  bson_iter_t it;
+  const char *verb, *name;
+  char ns[MAXNS];
+  size_t i, lo, hi;
+  int64_t nret, start;
+  int r, sbe;
+
+  if (!cmd_doc(cmd, "explain", &inner) || !bson_iter_init(&it, &inner) ||
+      !bson_iter_next(&it) || !BSON_ITER_HOLDS_UTF8(&it)) {
+    cmd_error(reply, EFAILEDTOPARSE, "explain must be an object with a command");
+    return;
+  }
+  verb = bson_iter_key(&it);
+  name = bson_iter_utf8(&it, NULL);
+
+  if (strcmp(verb, "find") == 0)
+    r = cmd_doc(&inner, "filter", &query);
+  else if (strcmp(verb, "count") == 0)
+    r = cmd_doc(&inner, "query", &query);
+  else if (strcmp(verb, "aggregate") == 0)
+    r = cmd_doc(&inner, "pipeline", &pipeline) && cmd_doc(&pipeline, "0", &stage) &&
+        cmd_doc(&stage, "$match", &query);
+  else
+    r = 0;
+  if (!r)
+    bson_init(&query);
+
+  start = bson_get_monotonic_time();
+  lo = hi = 0;
+  nret = 0;
+  if ((c = get_coll(db, name, 0)) != NULL) {
+    id_range(c, &query, &lo, &hi);
+    for (i = lo; i < hi; i++) {
+      if ((r = match(c->docs[i], &query)) < 0) {
+        cmd_error(reply, EBADVALUE, "unsupported query operator");
+        return;
+      }
+      nret += r;
+    }
+  }
+
+  snprintf(ns, sizeof(ns), "%s.%s", db, name);
+
+  bson_append_document_begin(reply, "queryPlanner", -1, &plan);
+  BSON_APPEND_UTF8(&plan, "namespace", ns);
+  bson_append_document_begin(&plan, "winningPlan", -1, &winning);
+  /* like servers since 6.0 that run find with SBE, nest the plan in queryPlan */
+  sbe = strcmp(verb, "find") == 0;
+  if (sbe)
+    bson_append_document_begin(&winning, "queryPlan", -1, &stage);
+  top = sbe ? &stage : &winning;
+  if (c != NULL && (lo > 0 || hi < c->ndocs)) {
+    BSON_APPEND_UTF8(top, "stage", "FETCH");
+    bson_append_document_begin(top, "inputStage", -1, &input);
+    BSON_APPEND_UTF8(&input, "stage", "IXSCAN");
+    BSON_APPEND_UTF8(&input, "indexName", "_id_");
+    bson_append_document_end(top, &input);
+  } else {
+    BSON_APPEND_UTF8(top, "stage", "COLLSCAN");
+  }
+  if (sbe) {
+    bson_append_document_end(&winning, &stage);
+    bson_append_document_begin(&winning, "slotBasedPlan", -1, &stage);
+    BSON_APPEND_UTF8(&stage, "stages", "");
+    bson_append_document_end(&winning, &stage);
+  }
+  bson_append_document_end(&plan, &winning);
+  bson_append_document_end(reply, &plan);
+
+  bson_append_document_begin(reply, "executionStats", -1, &stats);
+  BSON_APPEND_INT64(&stats, "nReturned", nret);
+  BSON_APPEND_INT64(&stats, "executionTimeMillis", (bson_get_monotonic_time() - start) / 1000);
+  BSON_APPEND_INT64(&stats, "totalKeysExamined", c != NULL && (lo > 0 || hi < c->ndocs) ? (int64_t)(hi - lo) : 0);
+  BSON_APPEND_INT64(&stats, "totalDocsExamined", (int64_t)(hi - lo));
+  bson_append_document_end(reply, &stats);
+  cmd_ok(reply);
+}
+
+static void
+cmd_listdatabases(const char *db, const bson_t *cmd, bson_t *reply)
+{
+  bson_t arr, d;
+  const char *key;
+  char buf[16];
+  int64_t size, total;
+  size_t i, j;
+  uint32_t n;
+
+  (void)db;
+  (void)cmd;
+
+  total = 0;
+  n = 0;
+  bson_append_array_begin(reply, "databases", -1, &arr);
+  for (i = 0; i < ncolls; i++) {
+    /* skip databases that are already listed */
+    for (j = 0; j < i; j++)
+      if (strcmp(colls[j]->db, colls[i]->db) == 0)
+        break;
+    if (j < i)
+      continue;
+
+    size = 0;
+    for (j = i; j < ncolls; j++)
+      if (strcmp(colls[j]->db, colls[i]->db) == 0)
+        size += colls[j]->size;
+    total += size;
+
+    bson_uint32_to_string(n++, &key, buf, sizeof(buf));
+    bson_append_document_begin(&arr, key, -1, &d);
+    BSON_APPEND_UTF8(&d, "name", colls[i]->db);
+    BSON_APPEND_DOUBLE(&d, "sizeOnDisk", (double)size);
+    BSON_APPEND_BOOL(&d, "empty", size == 0);
+    bson_append_document_end(&arr, &d);
+  }
+  bson_append_array_end(reply, &arr);
+  BSON_APPEND_DOUBLE(reply, "totalSize", (double)total);
+  cmd_ok(reply);
+}
+
+static void
+cmd_listcollections(const char *db, const bson_t *cmd, bson_t *reply)
+{
+  struct cursor *cur;
+  bson_t filter, sub;
+  bson_t *doc;
+  size_t i;
+  int r;
+
+  if (!cmd_doc(cmd, "filter", &filter))
+    bson_init(&filter);
+
+  if ((cur = cursor_new(db, "$cmd.listCollections")) == NULL)
+    err(1, "cmd_listcollections");
+
+  for (i = 0; i < ncolls; i++) {
+    if (strcmp(colls[i]->db, db) != 0)
+      continue;
+
+    if ((doc = bson_new()) == NULL)
+      err(1, "cmd_listcollections");
+    BSON_APPEND_UTF8(doc, "name", colls[i]->name);
+    BSON_APPEND_UTF8(doc, "type", "collection");
+    bson_append_document_begin(doc, "options", -1, &sub);
+    bson_append_document_end(doc, &sub);
+    bson_append_document_begin(doc, "info", -1, &sub);
+    BSON_APPEND_BOOL(&sub, "readOnly", 0);
+    bson_append_document_end(doc, &sub);
+
+    if ((r = match(doc, &filter)) < 0) {
+      bson_destroy(doc);
+      cursor_free(cur);
+      cmd_error(reply, EBADVALUE, "unsupported query operator");
+      return;
+    }
+    if (r == 0)
+      bson_destroy(doc);
+    else if (cursor_add(cur, doc) < 0)
+      err(1, "cmd_listcollections");
+  }
+
+  cursor_reply(reply, cur, "firstBatch", cmd_int64(cmd, "batchSize", 0), 0);
+}
+
+/* list the only index of a collection, the one on _id */
+static void
+cmd_listindexes(const char *db, const bson_t *cmd, bson_t *reply)
+{
+  struct cursor *cur;
+  const char *name;
+  char ns[MAXNS];
+  bson_t *doc, key;
+
+  if ((name = cmd_collname(cmd, reply)) == NULL)
+    return;
+
+  if (get_coll(db, name, 0) == NULL) {
+    cmd_error(reply, ENSNOTFOUND, "ns does not exist: %s.%s", db, name);
+    return;
+  }
+
+  if ((cur = cursor_new(db, "$cmd.listIndexes")) == NULL)
+    err(1, "cmd_listindexes");
+
+  snprintf(ns, sizeof(ns), "%s.%s", db, name);
+  if ((doc = bson_new()) == NULL)
+    err(1, "cmd_listindexes");
+  BSON_APPEND_INT32(doc, "v", 2);
+  bson_append_document_begin(doc, "key", -1, &key);
+  BSON_APPEND_INT32(&key, "_id", 1);
+  bson_append_document_end(doc, &key);
+  BSON_APPEND_UTF8(doc, "name", "_id_");
+  BSON_APPEND_UTF8(doc, "ns", ns);
+  if (cursor_add(cur, doc) < 0)
+    err(1, "cmd_listindexes");
+
+  cursor_reply(reply, cur, "firstBatch", cmd_int64(cmd, "batchSize", 0), 0);
+}
+
+static void
+cmd_create(const char *db, const bson_t *cmd, bson_t *reply)
+{
+  const char *name;
+
+  if ((name = cmd_collname(cmd, reply)) == NULL)
+    return;
+
+  if (get_coll(db, name, 0) != NULL) {
+    cmd_error(reply, ENSEXISTS, "collection already exists");
+    return;
+  }
+
+  if (get_coll(db, name, 1) == NULL)
+    err(1, "cmd_create");
+
+  cmd_ok(reply);
+}
+
+static void
+cmd_drop(const char *db, const bson_t *cmd, bson_t *reply)
+{
+  struct coll *c;
+  const char *name;
+  char ns[MAXNS];
+
+  if ((name = cmd_collname(cmd, reply)) == NULL)
+    return;
+
+  if ((c = get_coll(db, name, 0)) == NULL) {
+    cmd_error(reply, ENSNOTFOUND, "ns not found");
+    return;
+  }
+
+  snprintf(ns, sizeof(ns), "%s.%s", db, name);
+  drop_coll(c);
+
+  BSON_APPEND_UTF8(reply, "ns", ns);
+  BSON_APPEND_INT32(reply, "nIndexesWas", 1);
+  cmd_ok(reply);
+}
+
+/* rename a collection within or across databases, like on a single mongod */
+static void
+cmd_renamecollection(const char *db, const bson_t *cmd, bson_t *reply)
+{
+  struct coll *c;
+  bson_iter_t it;
+  const char *ns[2], *dot[2];
+  char dbname[2][MAXNAME];
+  int i;
+
+  (void)db;
+
+  for (i = 0; i < 2; i++) {
+    if (!bson_iter_init_find(&it, cmd, i == 0 ? "renameCollection" : "to") ||
+        !BSON_ITER_HOLDS_UTF8(&it)) {
+      cmd_error(reply, EFAILEDTOPARSE, "renameCollection and to must be namespaces");
+      return;
+    }
+    ns[i] = bson_iter_utf8(&it, NULL);
+    if ((dot[i] = strchr(ns[i], '.')) == NULL || dot[i] == ns[i] || dot[i][1] == '\0' ||
+        dot[i] - ns[i] >= MAXNAME || strlen(dot[i] + 1) >= MAXNAME) {
+      cmd_error(reply, EBADVALUE, "invalid namespace: %s", ns[i]);
+      return;
+    }
+    snprintf(dbname[i], MAXNAME, "%.*s", (int)(dot[i] - ns[i]), ns[i]);
+  }
+
+  if ((c = get_coll(dbname[0], dot[0] + 1, 0)) == NULL) {
+    cmd_error(reply, ENSNOTFOUND, "source namespace does not exist");
+    return;
+  }
+  if (get_coll(dbname[1], dot[1] + 1, 0) != NULL) {
+    cmd_error(reply, ENSEXISTS, "target namespace exists");
+    return;
+  }
+
+  snprintf(c->db, sizeof(c->db), "%s", dbname[1]);
+  snprintf(c->name, sizeof(c->name), "%s", dot[1] + 1);
+
+  cmd_ok(reply);
+}
+
+static void
+cmd_dropdatabase(const char *db, const bson_t *cmd, bson_t *reply)
+{
+  size_t i;
+
+  (void)cmd;
+
+  for (i = ncolls; i > 0; i--)
+    if (strcmp(colls[i - 1]->db, db) == 0)
+      drop_coll(colls[i - 1]);
+
+  BSON_APPEND_UTF8(reply, "dropped", db);
+  cmd_ok(reply);
+}
+
+static void
+cmd_collstats(const char *db, const bson_t *cmd, bson_t *reply)
+{
+  struct coll *c;
+  const char *name;
+  char ns[MAXNS];
+  int64_t count, size;
+
+  if ((name = cmd_collname(cmd, reply)) == NULL)
+    return;
+
+  count = size = 0;
+  if ((c = get_coll(db, name, 0)) != NULL) {
+    count = c->ndocs;
+    size = c->size;
+  }
+
+  snprintf(ns, sizeof(ns), "%s.%s", db, name);
+  BSON_APPEND_UTF8(reply, "ns", ns);
+  BSON_APPEND_INT64(reply, "count", count);
+  BSON_APPEND_INT64(reply, "size", size);
+  BSON_APPEND_INT64(reply, "avgObjSize", count ? size / count : 0);
+  BSON_APPEND_INT64(reply, "storageSize", size);
+  BSON_APPEND_INT32(reply, "nindexes", 1);
+  BSON_APPEND_INT64(reply, "totalIndexSize", 0);
+  cmd_ok(reply);
+}
+
+/* hash the documents of c into hex, identical collections get the same hash */
+static void
+hash_coll(const struct coll *c, char *hex, size_t hexsize)
+{
+  uint64_t h;
+  const uint8_t *data;
+  size_t i;
+  uint32_t j;
+
+  /* FNV-1a instead of the md5 of mongod, only equality matters */
+  h = 14695981039346656037ULL;
+  for (i = 0; i < c->ndocs; i++) {
+    data = bson_get_data(c->docs[i]);
+    for (j = 0; j < c->docs[i]->len; j++) {
+      h ^= data[j];
+      h *= 1099511628211ULL;
+    }
+  }
+
+  snprintf(hex, hexsize, "%016llx%016llx", (unsigned long long)h, (unsigned long long)c->ndocs);
+}
+
+/* hash the listed collections, or all collections of db */
+static void
+cmd_dbhash(const char *db, const bson_t *cmd, bson_t *reply)
+{
+  bson_iter_t it, names;
+  bson_t hashes;
+  char hex[33];
+  struct coll *c;
+  size_t i;
+
+  bson_append_document_begin(reply, "collections", -1, &hashes);
+  if (bson_iter_init_find(&it, cmd, "collections") && BSON_ITER_HOLDS_ARRAY(&it) &&
+      bson_iter_recurse(&it, &names)) {
+    while (bson_iter_next(&names)) {
+      if (!BSON_ITER_HOLDS_UTF8(&names))
+        continue;
+      if ((c = get_coll(db, bson_iter_utf8(&names, NULL), 0)) == NULL)
+        continue;
+      hash_coll(c, hex, sizeof(hex));
+      BSON_APPEND_UTF8(&hashes, c->name, hex);
+    }
+  } else {
+    for (i = 0; i < ncolls; i++)
+      if (strcmp(colls[i]->db, db) == 0) {
+        hash_coll(colls[i], hex, sizeof(hex));
+        BSON_APPEND_UTF8(&hashes, colls[i]->name, hex);
+      }
+  }
+  bson_append_document_end(reply, &hashes);
+  cmd_ok(reply);
+}
+
+static void
+cmd_dbstats(const char *db, const bson_t *cmd, bson_t *reply)
+{
+  int64_t count, size, n;
+  size_t i;
+
+  (void)cmd;
+
+  n = count = size = 0;
+  for (i = 0; i < ncolls; i++)
+    if (strcmp(colls[i]->db, db) == 0) {
+      n++;
+      count += colls[i]->ndocs;
+      size += colls[i]->size;
+    }
+
+  BSON_APPEND_UTF8(reply, "db", db);
+  BSON_APPEND_INT64(reply, "collections", n);
+  BSON_APPEND_INT64(reply, "objects", count);
+  BSON_APPEND_INT64(reply, "avgObjSize", count ? size / count : 0);
+  BSON_APPEND_INT64(reply, "dataSize", size);
+  BSON_APPEND_INT64(reply, "storageSize", size);
+  BSON_APPEND_INT64(reply, "indexes", n);
+  BSON_APPEND_INT64(reply, "indexSize", 0);
+  cmd_ok(reply);
+}
+
+/* return collection db.name, create it if it does not exist and create is set */
+static struct coll *
+get_coll(const char *db, const char *name, int create)
+{
+  struct coll *c, **p;
+  size_t i;
+
+  for (i = 0; i < ncolls; i++)
+    if (strcmp(colls[i]->db, db) == 0 && strcmp(colls[i]->name, name) == 0)
+      return colls[i];
+
+  if (!create)
+    return NULL;
+
+  if (strlen(db) >= MAXNAME || strlen(name) >= MAXNAME)
+    return NULL;
+
+  if ((p = reallocarray(colls, ncolls + 1, sizeof(*colls))) == NULL)
+    return NULL;
+  colls = p;
+
+  if ((c = calloc(1, sizeof(*c))) == NULL)
+    return NULL;
+  snprintf(c->db, sizeof(c->db), "%s", db);
+  snprintf(c->name, sizeof(c->name), "%s", name);
+
+  colls[ncolls++] = c;
+  return c;
+}
+
+static void
+drop_coll(struct coll *c)
+{
+  size_t i;
+
+  for (i = 0; i < ncolls; i++)
+    if (colls[i] == c)
+      break;
+  if (i == ncolls)
+    return;
+
+  memmove(&colls[i], &colls[i + 1], (ncolls - i - 1) * sizeof(*colls));
+  ncolls--;
+
+  for (i = 0; i < c->ndocs; i++)
+    bson_destroy(c->docs[i]);
+  free(c->docs);
+  free(c);
+}
+
+/*
+ * Insert doc in c and take ownership of it.
+ *
+ * return 0 on success, -1 if a document with the same _id exists
+ */
+static int
+coll_insert(struct coll *c, bson_t *doc)
+{
+  bson_iter_t id, prev;
+  bson_t **p;
+  size_t i;
+
+  if (!doc_id(doc, &id))
+    return -1;
+
+  i = id_bound(c, &id, 1);
+  if (i > 0 && doc_id(c->docs[i - 1], &prev) && cmp_iter(&prev, &id) == 0)
+    return -1;
+
+  if (c->ndocs == c->cap) {
+    if ((p = reallocarray(c->docs, c->cap ? c->cap * 2 : 64, sizeof(*c->docs))) == NULL)
+      err(1, "coll_insert");
+    c->docs = p;
+    c->cap = c->cap ? c->cap * 2 : 64;
+  }
+
+  memmove(&c->docs[i + 1], &c->docs[i], (c->ndocs - i) * sizeof(*c->docs));
+  c->docs[i] = doc;
+  c->ndocs++;
+  c->size += doc->len;
+
+  return 0;
+}
+
+static void
+coll_remove(struct coll *c, size_t i)
+{
+  c->size -= c->docs[i]->len;
+  bson_destroy(c->docs[i]);
+  memmove(&c->docs[i], &c->docs[i + 1], (c->ndocs - i - 1) * sizeof(*c->docs));
+  c->ndocs--;
+}
+
+/* return the index of the first document with an _id >= id, or > id if after is set */
+static size_t
+id_bound(const struct coll *c, const bson_iter_t *id, int after)
+{
+  bson_iter_t it;
+  size_t lo, hi, mid;
+  int r;
+
+  lo = 0;
+  hi = c->ndocs;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    doc_id(c->docs[mid], &it);
+    r = cmp_iter(&it, id);
+    if (r < 0 || (after && r == 0))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+/* narrow the documents to scan for query down to [lo, hi) using conditions on _id */
+static void
+id_range(const struct coll *c, const bson_t *query, size_t *lo, size_t *hi)
+{
+  bson_iter_t it, op;
+  const char *name;
+  size_t b;
+
+  *lo = 0;
+  *hi = c->ndocs;
+
+  if (!bson_iter_init_find(&it, query, "_id"))
+    return;
+
+  if (!is_opdoc(&it)) {
+    if (!BSON_ITER_HOLDS_ARRAY(&it)) {
+      *lo = id_bound(c, &it, 0);
+      *hi = id_bound(c, &it, 1);
+    }
+    return;
+  }
+
+  bson_iter_recurse(&it, &op);
+  while (bson_iter_next(&op)) {
+    name = bson_iter_key(&op);
+    if (strcmp(name, "$eq") == 0 && !BSON_ITER_HOLDS_ARRAY(&op)) {
+      if ((b = id_bound(c, &op, 0)) > *lo)
+        *lo = b;
+      if ((b = id_bound(c, &op, 1)) < *hi)
+        *hi = b;
+    } else if (strcmp(name, "$gt") == 0) {
+      if ((b = id_bound(c, &op, 1)) > *lo)
+        *lo = b;
+    } else if (strcmp(name, "$gte") == 0) {
+      if ((b = id_bound(c, &op, 0)) > *lo)
+        *lo = b;
+    } else if (strcmp(name, "$lt") == 0) {
+      if ((b = id_bound(c, &op, 0)) < *hi)
+        *hi = b;
+    } else if (strcmp(name, "$lte") == 0) {
+      if ((b = id_bound(c, &op, 1)) < *hi)
+        *hi = b;
+    }
+  }
+
+  if (*hi < *lo)
+    *hi = *lo;
+}
+
+static int
+doc_id(const bson_t *doc, bson_iter_t *id)
+{
+  return bson_iter_init_find(id, doc, "_id");
+}
+
+/* return a copy of doc, with a new object id prepended if it has no _id */
+static bson_t *
+with_id(const bson_t *doc)
+{
+  bson_iter_t it;
+  bson_oid_t oid;
+  bson_t *out;
+
+  if (doc_id(doc, &it))
+    return bson_copy(doc);
+
+  if ((out = bson_new()) == NULL)
+    return NULL;
+  bson_oid_init(&oid, NULL);
+  BSON_APPEND_OID(out, "_id", &oid);
+  bson_concat(out, doc);
+
+  return out;
+}
+
+/* canonical sort order of bson types as used by mongod */
+static int
+typeclass(bson_type_t t)
+{
+  switch (t) {
+  case BSON_TYPE_MINKEY:
+    return 0;
+  case BSON_TYPE_UNDEFINED:
+  case BSON_TYPE_NULL:
+    return 1;
+  case BSON_TYPE_INT32:
+  case BSON_TYPE_INT64:
+  case BSON_TYPE_DOUBLE:
+  case BSON_TYPE_DECIMAL128:
+    return 2;
+  case BSON_TYPE_UTF8:
+  case BSON_TYPE_SYMBOL:
+    return 3;
+  case BSON_TYPE_DOCUMENT:
+    return 4;
+  case BSON_TYPE_ARRAY:
+    return 5;
+  case BSON_TYPE_BINARY:
+    return 6;
+  case BSON_TYPE_OID:
+    return 7;
+  case BSON_TYPE_BOOL:
+    return 8;
+  case BSON_TYPE_DATE_TIME:
+    return 9;
+  case BSON_TYPE_TIMESTAMP:
+    return 10;
+  case BSON_TYPE_REGEX:
+    return 11;
+  case BSON_TYPE_MAXKEY:
+    return 13;
+  default:
+    return 12;
+  }
+}
+
+/* compare two values in the canonical order, return <0, 0 or >0 */
+static int
+cmp_iter(const bson_iter_t *a, const bson_iter_t *b)
+{
+  const uint8_t *da, *db;
+  const char *sa, *sb;
+  uint32_t la, lb, ta, tb, ia, ib;
+  bson_subtype_t st;
+  int64_t xa, xb;
+  double fa, fb;
+  int ca, cb, r;
+
+  ca = typeclass(bson_iter_type(a));
+  cb = typeclass(bson_iter_type(b));
+  if (ca != cb)
+    return ca < cb ? -1 : 1;
+
+  switch (ca) {
+  case 2:
+    if (!BSON_ITER_HOLDS_DOUBLE(a) && !BSON_ITER_HOLDS_DOUBLE(b)) {
+      xa = bson_iter_as_int64(a);
+      xb = bson_iter_as_int64(b);
+      return xa < xb ? -1 : xa > xb;
+    }
+    fa = bson_iter_as_double(a);
+    fb = bson_iter_as_double(b);
+    return fa < fb ? -1 : fa > fb;
+  case 3:
+    sa = BSON_ITER_HOLDS_UTF8(a) ? bson_iter_utf8(a, &la) : bson_iter_symbol(a, &la);
+    sb = BSON_ITER_HOLDS_UTF8(b) ? bson_iter_utf8(b, &lb) : bson_iter_symbol(b, &lb);
+    if ((r = memcmp(sa, sb, la < lb ? la : lb)) != 0)
+      return r;
+    return la < lb ? -1 : la > lb;
+  case 4:
+  case 5:
+    if (ca == 4) {
+      bson_iter_document(a, &la, &da);
+      bson_iter_document(b, &lb, &db);
+    } else {
+      bson_iter_array(a, &la, &da);
+      bson_iter_array(b, &lb, &db);
+    }
+    if ((r = memcmp(da, db, la < lb ? la : lb)) != 0)
+      return r;
+    return la < lb ? -1 : la > lb;
+  case 6:
+    bson_iter_binary(a, &st, &la, &da);
+    bson_iter_binary(b, &st, &lb, &db);
+    if (la != lb)
+      return la < lb ? -1 : 1;
+    return memcmp(da, db, la);
+  case 7:
+    return bson_oid_compare(bson_iter_oid(a), bson_iter_oid(b));
+  case 8:
+    return bson_iter_bool(a) - bson_iter_bool(b);
+  case 9:
+    xa = bson_iter_date_time(a);
+    xb = bson_iter_date_time(b);
+    return xa < xb ? -1 : xa > xb;
+  case 10:
+    bson_iter_timestamp(a, &ta, &ia);
+    bson_iter_timestamp(b, &tb, &ib);
+    if (ta != tb)
+      return ta < tb ? -1 : 1;
+    return ia < ib ? -1 : ia > ib;
+  default:
+    return 0;
+  }
+}
+
+/* find the value of a top-level or dotted key in doc */
+static int
+lookup(const bson_t *doc, const char *key, bson_iter_t *it)
+{
+  bson_iter_t root;
+
+  if (strchr(key, '.') == NULL)
+    return bson_iter_init_find(it, doc, key);
+
+  return bson_iter_init(&root, doc) && bson_iter_find_descendant(&root, key, it);
+}
+
+/* return whether it holds a document of which the first key is an operator */
+static int
+is_opdoc(const bson_iter_t *it)
+{
+  bson_iter_t child;
+
+  if (!BSON_ITER_HOLDS_DOCUMENT(it) || !bson_iter_recurse(it, &child) || !bson_iter_next(&child))
+    return 0;
+
+  return bson_iter_key(&child)[0] == '$';
+}
+
+/*
+ * Match doc against query.
+ *
+ * return 1 if it matches, 0 if not, -1 if the query is not supported
+ */
+static int
+match(const bson_t *doc, const bson_t *query)
+{
+  bson_iter_t it, op, val;
+  const char *key, *name;
+  int r;
+
+  if (!bson_iter_init(&it, query))
+    return -1;
+
+  while (bson_iter_next(&it)) {
+    key = bson_iter_key(&it);
+
+    if (strcmp(key, "$and") == 0) {
+      r = match_list(doc, &it, 0);
+    } else if (strcmp(key, "$or") == 0) {
+      r = match_list(doc, &it, 1);
+    } else if (strcmp(key, "$nor") == 0) {
+      if ((r = match_list(doc, &it, 1)) >= 0)
+        r = !r;
+    } else if (key[0] == '$') {
+      r = -1;
+    } else if (is_opdoc(&it)) {
+      r = 1;
+      bson_iter_recurse(&it, &op);
+      while (r == 1 && bson_iter_next(&op)) {
+        name = bson_iter_key(&op);
+        if (strcmp(name, "$ne") == 0) {
+          if ((r = match_field(doc, key, "$eq", &op)) >= 0)
+            r = !r;
+        } else if (strcmp(name, "$nin") == 0) {
+          if ((r = match_field(doc, key, "$in", &op)) >= 0)
+            r = !r;
+        } else if (strcmp(name, "$exists") == 0) {
+          r = lookup(doc, key, &val) == bson_iter_as_bool(&op);
+        } else {
+          r = match_field(doc, key, name, &op);
+        }
+      }
+    } else {
+      r = match_field(doc, key, "$eq", &it);
+    }
+
+    if (r <= 0)
+      return r;
+  }
+
+  return 1;
+}
+
+/* match doc against all, or any if any is set, of the queries in array list */
+static int
+match_list(const bson_t *doc, const bson_iter_t *list, int any)
+{
+  bson_iter_t it;
+  const uint8_t *data;
+  uint32_t len;
+  bson_t q;
+  int r;
+
+  if (!BSON_ITER_HOLDS_ARRAY(list) || !bson_iter_recurse(list, &it))
+    return -1;
+
+  while (bson_iter_next(&it)) {
+    if (!BSON_ITER_HOLDS_DOCUMENT(&it))
+      return -1;
+    bson_iter_document(&it, &len, &data);
+    bson_init_static(&q, data, len);
+    if ((r = match(doc, &q)) < 0)
+      return -1;
+    if (r == any)
+      return r;
+  }
+
+  return !any;
+}
+
+/*
+ * Match field key of doc against one operator. If the field is an array it
+ * also matches if any of its elements matches. A missing field is treated as
+ * null.
+ */
+static int
+match_field(const bson_t *doc, const char *key, const char *op, const bson_iter_t *arg)
+{
+  bson_iter_t val, elem;
+  bson_t null;
+  int r;
+
+  if (!lookup(doc, key, &val)) {
+    bson_init(&null);
+    bson_append_null(&null, "", 0);
+    bson_iter_init_find(&val, &null, "");
+    r = match_cond(&val, op, arg);
+    bson_destroy(&null);
+    return r;
+  }
+
+  if ((r = match_cond(&val, op, arg)) != 0)
+    return r;
+
+  if (BSON_ITER_HOLDS_ARRAY(&val) && bson_iter_recurse(&val, &elem))
+    while (bson_iter_next(&elem))
+      if ((r = match_cond(&elem, op, arg)) != 0)
+        return r;
+
+  return 0;
+}
+
+/* compare one value against one operator, return 1 on match, 0 if not, -1 if op is not supported */
+static int
+match_cond(const bson_iter_t *val, const char *op, const bson_iter_t *arg)
+{
+  bson_iter_t in;
+  int c;
+
+  if (strcmp(op, "$eq") == 0)
+    return cmp_iter(val, arg) == 0;
+
+  if (strcmp(op, "$in") == 0) {
+    if (!BSON_ITER_HOLDS_ARRAY(arg) || !bson_iter_recurse(arg, &in))
+      return -1;
+    while (bson_iter_next(&in))
+      if (cmp_iter(val, &in) == 0)
+        return 1;
+    return 0;
+  }
+
+  if (strcmp(op, "$gt") != 0 && strcmp(op, "$gte") != 0 && strcmp(op, "$lt") != 0 && strcmp(op, "$lte") != 0)
+    return -1;
+
+  /* comparison operators only match values of the same type class */
+  if (typeclass(bson_iter_type(val)) != typeclass(bson_iter_type(arg)))
+    return 0;
+
+  c = cmp_iter(val, arg);
+  if (strcmp(op, "$gt") == 0)
+    return c > 0;
+  if (strcmp(op, "$gte") == 0)
+    return c >= 0;
+  if (strcmp(op, "$lt") == 0)
+    return c < 0;
+  return c <= 0;
+}
+
+/* return a copy of doc with only the top-level fields selected by proj */
+static bson_t *
+project(const bson_t *doc, const bson_t *proj)
+{
+  bson_iter_t it, p;
+  const char *key;
+  bson_t *out;
+  int include, id, keep;
+
+  include = 0;
+  id = 1;
+  bson_iter_init(&it, proj);
+  while (bson_iter_next(&it))
+    if (strcmp(bson_iter_key(&it), "_id") == 0)
+      id = bson_iter_as_bool(&it);
+    else if (bson_iter_as_bool(&it))
+      include = 1;
+
+  if ((out = bson_new()) == NULL)
+    err(1, "project");
+
+  bson_iter_init(&it, doc);
+  while (bson_iter_next(&it)) {
+    key = bson_iter_key(&it);
+    if (strcmp(key, "_id") == 0)
+      keep = id;
+    else if (bson_iter_init_find(&p, proj, key))
+      keep = bson_iter_as_bool(&p);
+    else
+      keep = !include;
+
+    if (keep)
+      bson_append_iter(out, NULL, 0, &it);
+  }
+
+  return out;
+}
+
+/* qsort comparator of two documents on sortspec, missing fields sort as null */
+static int
+cmp_docs(const void *a, const void *b)
+{
+  const bson_t *da = *(bson_t *const *)a, *db = *(bson_t *const *)b;
+  bson_iter_t s, fa, fb;
+  const char *key;
+  bson_t null;
+  int hasa, hasb, r;
+
+  bson_init(&null);
+  bson_append_null(&null, "", 0);
+
+  r = 0;
+  bson_iter_init(&s, sortspec);
+  while (r == 0 && bson_iter_next(&s)) {
+    key = bson_iter_key(&s);
+    /* documents are kept in _id order */
+    if (strcmp(key, "$natural") == 0)
+      key = "_id";
+
+    hasa = lookup(da, key, &fa);
+    hasb = lookup(db, key, &fb);
+    if (!hasa)
+      bson_iter_init_find(&fa, &null, "");
+    if (!hasb)
+      bson_iter_init_find(&fb, &null, "");
+
+    r = cmp_iter(&fa, &fb);
+    if (bson_iter_as_int64(&s) < 0)
+      r = -r;
+  }
+
+  bson_destroy(&null);
+  return r;
+}
+
+/*
+ * Return the result of applying update u to doc. u is either a replacement
+ * document or contains $set, $unset and $inc operators on top-level fields.
+ * On error NULL is returned and code and msg are set.
+ */
+static bson_t *
+apply_update(const bson_t *doc, const bson_t *u, int *code, const char **msg)
+{
+  bson_t set, unset, inc;
+  bson_iter_t it, f, id;
+  const char *key;
+  bson_t *out;
+  int hasset, hasunset, hasinc;
+
+  if (!bson_iter_init(&it, u)) {
+    *code = EFAILEDTOPARSE;
+    *msg = "invalid update document";
+    return NULL;
+  }
+
+  /* replacement, keep the _id */
+  if (!bson_iter_next(&it) || bson_iter_key(&it)[0] != '$') {
+    if ((out = bson_new()) == NULL)
+      err(1, "apply_update");
+    if (doc_id(doc, &id))
+      bson_append_iter(out, NULL, 0, &id);
+
+    bson_iter_init(&it, u);
+    while (bson_iter_next(&it)) {
+      if (strcmp(bson_iter_key(&it), "_id") != 0) {
+        bson_append_iter(out, NULL, 0, &it);
+        continue;
+      }
+      if (!doc_id(doc, &id)) {
+        bson_append_iter(out, NULL, 0, &it);
+      } else if (cmp_iter(&id, &it) != 0) {
+        bson_destroy(out);
+        *code = EIMMUTABLEFIELD;
+        *msg = "the _id field cannot be changed";
+        return NULL;
+      }
+    }
+    return out;
+  }
+
+  hasset = cmd_doc(u, "$set", &set);
+  hasunset = cmd_doc(u, "$unset", &unset);
+  hasinc = cmd_doc(u, "$inc", &inc);
+
+  bson_iter_init(&it, u);
+  while (bson_iter_next(&it)) {
+    key = bson_iter_key(&it);
+    if (strcmp(key, "$set") != 0 && strcmp(key, "$unset") != 0 && strcmp(key, "$inc") != 0 &&
+        strcmp(key, "$setOnInsert") != 0) {
+      *code = EFAILEDTOPARSE;
+      *msg = "unsupported update operator";
+      return NULL;
+    }
+    if (!BSON_ITER_HOLDS_DOCUMENT(&it)) {
+      *code = EFAILEDTOPARSE;
+      *msg = "modifiers must be documents";
+      return NULL;
+    }
+    bson_iter_recurse(&it, &f);
+    while (bson_iter_next(&f)) {
+      /* $setOnInsert only applies to new documents, see upsert_doc */
+      if (strcmp(bson_iter_key(&f), "_id") == 0 && strcmp(key, "$setOnInsert") != 0) {
+        *code = EIMMUTABLEFIELD;
+        *msg = "the _id field cannot be changed";
+        return NULL;
+      }
+      if (strchr(bson_iter_key(&f), '.') != NULL) {
+        *code = EBADVALUE;
+        *msg = "dotted field names are not supported";
+        return NULL;
+      }
+      if (strcmp(key, "$inc") == 0 && !BSON_ITER_HOLDS_NUMBER(&f)) {
+        *code = ETYPEMISMATCH;
+        *msg = "cannot increment with a non-numeric argument";
+        return NULL;
+      }
+    }
+  }
+
+  if ((out = bson_new()) == NULL)
+    err(1, "apply_update");
+
+  bson_iter_init(&it, doc);
+  while (bson_iter_next(&it)) {
+    key = bson_iter_key(&it);
+    if (hasunset && bson_iter_init_find(&f, &unset, key))
+      continue;
+    if (hasset && bson_iter_init_find(&f, &set, key)) {
+      bson_append_iter(out, key, -1, &f);
+    } else if (hasinc && bson_iter_init_find(&f, &inc, key)) {
+      if (!BSON_ITER_HOLDS_NUMBER(&it)) {
+        bson_destroy(out);
+        *code = ETYPEMISMATCH;
+        *msg = "cannot apply $inc to a non-numeric field";
+        return NULL;
+      }
+      append_sum(out, key, &it, &f);
+    } else {
+      bson_append_iter(out, NULL, 0, &it);
+    }
+  }
+
+  /* append new fields */
+  if (hasset) {
+    bson_iter_init(&f, &set);
+    while (bson_iter_next(&f))
+      if (!bson_has_field(doc, bson_iter_key(&f)))
+        bson_append_iter(out, NULL, 0, &f);
+  }
+  if (hasinc) {
+    bson_iter_init(&f, &inc);
+    while (bson_iter_next(&f))
+      if (!bson_has_field(doc, bson_iter_key(&f)) && !(hasset && bson_has_field(&set, bson_iter_key(&f))))
+        bson_append_iter(out, NULL, 0, &f);
+  }
+
+  return out;
+}
+
+/*
+ * Return the document inserted by an upsert of u when nothing matches q. The
+ * equality conditions of q are the base document for update operators, a
+ * replacement document only takes the _id from q. Fields of $setOnInsert are
+ * added last.
+ */
+static bson_t *
+upsert_doc(const bson_t *q, const bson_t *u, int *code, const char **msg)
+{
+  bson_t base, soi, *out, *doc;
+  bson_iter_t it;
+  const char *key;
+  int replace;
+
+  replace = !bson_iter_init(&it, u) || !bson_iter_next(&it) || bson_iter_key(&it)[0] != '$';
+
+  bson_init(&base);
+  bson_iter_init(&it, q);
+  while (bson_iter_next(&it)) {
+    key = bson_iter_key(&it);
+    if (key[0] == '$' || strchr(key, '.') != NULL || is_opdoc(&it))
+      continue;
+    if (replace && strcmp(key, "_id") != 0)
+      continue;
+    bson_append_iter(&base, NULL, 0, &it);
+  }
+
+  out = apply_update(&base, u, code, msg);
+  bson_destroy(&base);
+  if (out == NULL)
+    return NULL;
+
+  if (!replace && cmd_doc(u, "$setOnInsert", &soi)) {
+    if ((doc = bson_new()) == NULL)
+      err(1, "upsert_doc");
+    if (bson_iter_init_find(&it, &soi, "_id") && !bson_has_field(out, "_id"))
+      bson_append_iter(doc, NULL, 0, &it);
+    bson_iter_init(&it, out);
+    while (bson_iter_next(&it))
+      bson_append_iter(doc, NULL, 0, &it);
+    bson_iter_init(&it, &soi);
+    while (bson_iter_next(&it))
+      if (strcmp(bson_iter_key(&it), "_id") != 0 && !bson_has_field(out, bson_iter_key(&it)))
+        bson_append_iter(doc, NULL, 0, &it);
+    bson_destroy(out);
+    out = doc;
+  }
+
+  doc = with_id(out);
+  bson_destroy(out);
+  if (doc == NULL)
+    err(1, "upsert_doc");
+
+  return doc;
+}
+
+/* append the sum of two numbers, keeping int32 if both are and it fits */
+static void
+append_sum(bson_t *b, const char *key, const bson_iter_t *x, const bson_iter_t *y)
+{
+  int64_t s;
+
+  if (BSON_ITER_HOLDS_DOUBLE(x) || BSON_ITER_HOLDS_DOUBLE(y)) {
+    BSON_APPEND_DOUBLE(b, key, bson_iter_as_double(x) + bson_iter_as_double(y));
+    return;
+  }
+
+  s = bson_iter_as_int64(x) + bson_iter_as_int64(y);
+  if (BSON_ITER_HOLDS_INT32(x) && BSON_ITER_HOLDS_INT32(y) && s >= INT32_MIN && s <= INT32_MAX)
+    BSON_APPEND_INT32(b, key, (int32_t)s);
+  else
+    BSON_APPEND_INT64(b, key, s);
+}
+
+static void
+write_error(bson_t *errs, int *nerr, int index, int code, const char *msg)
+{
+  const char *key;
+  char buf[16];
+  bson_t e;
+
+  bson_uint32_to_string(*nerr, &key, buf, sizeof(buf));
+  bson_append_document_begin(errs, key, -1, &e);
+  BSON_APPEND_INT32(&e, "index", index);
+  BSON_APPEND_INT32(&e, "code", code);
+  BSON_APPEND_UTF8(&e, "errmsg", msg);
+  bson_append_document_end(errs, &e);
+  (*nerr)++;
+}
+
+static struct cursor *
+cursor_new(const char *db, const char *name)
+{
+  struct cursor *cur;
+
+  if ((cur = calloc(1, sizeof(*cur))) == NULL)
+    return NULL;
+  snprintf(cur->ns, sizeof(cur->ns), "%s.%s", db, name);
+
+  return cur;
+}
+
+/* append doc to cur and take ownership of it */
+static int
+cursor_add(struct cursor *cur, bson_t *doc)
+{
+  bson_t **p;
+
+  if (doc == NULL)
+    return -1;
+
+  if (cur->ndocs == cur->cap) {
+    if ((p = reallocarray(cur->docs, cur->cap ? cur->cap * 2 : 64, sizeof(*cur->docs))) == NULL)
+      return -1;
+    cur->docs = p;
+    cur->cap = cur->cap ? cur->cap * 2 : 64;
+  }
+  cur->docs[cur->ndocs++] = doc;
+
+  return 0;
+}
+
+static void
+cursor_free(struct cursor *cur)
+{
+  size_t i;
+
+  for (i = 0; i < cur->ndocs; i++)
+    bson_destroy(cur->docs[i]);
+  free(cur->docs);
+  free(cur);
+}
+
+/* drop the first skip documents and everything after limit, limit 0 means no limit */
+static void
+cursor_slice(struct cursor *cur, int64_t skip, int64_t limit)
+{
+  size_t i, n;
+
+  if (skip < 0)
+    skip = 0;
+  if ((size_t)skip > cur->ndocs)
+    skip = cur->ndocs;
+
+  for (i = 0; i < (size_t)skip; i++)
+    bson_destroy(cur->docs[i]);
+  memmove(cur->docs, cur->docs + skip, (cur->ndocs - skip) * sizeof(*cur->docs));
+  cur->ndocs -= skip;
+
+  n = cur->ndocs;
+  if (limit > 0 && (size_t)limit < n)
+    n = limit;
+  for (i = n; i < cur->ndocs; i++)
+    bson_destroy(cur->docs[i]);
+  cur->ndocs = n;
+}
+
+/*
+ * Copy all documents of c that match query to cur, stop after max documents if
+ * max > 0.
+ *
+ * return 0 on success, -1 if the query is not supported
+ */
+static int
+cursor_collect(struct cursor *cur, const struct coll *c, const bson_t *query, int64_t max)
+{
+  size_t i, lo, hi;
+  int r;
+
+  id_range(c, query, &lo, &hi);
+  for (i = lo; i < hi && (max <= 0 || (int64_t)cur->ndocs < max); i++) {
+    if ((r = match(c->docs[i], query)) < 0)
+      return -1;
+    if (r && cursor_add(cur, bson_copy(c->docs[i])) < 0)
+      err(1, "cursor_collect");
+  }
+
+  return 0;
+}
+
+/*
+ * Append the next batch of at most n documents, or as many as fit if n <= 0,
+ * to reply as a cursor document. If documents remain the cursor is registered
+ * for getMore, otherwise it is freed.
+ */
+static void
+cursor_reply(bson_t *reply, struct cursor *cur, const char *field, int64_t n, int single)
+{
+  struct cursor **cp;
+  bson_t cursor, batch;
+  const char *key;
+  char buf[16];
+  size_t bytes;
+  uint32_t i;
+  int64_t id;
+
+  bson_append_document_begin(reply, "cursor", -1, &cursor);
+  bson_append_array_begin(&cursor, field, -1, &batch);
+  bytes = 0;
+  for (i = 0; cur->pos < cur->ndocs && (n <= 0 || i < n); i++, cur->pos++) {
+    if (i > 0 && bytes + cur->docs[cur->pos]->len > MAXBATCH)
+      break;
+    bytes += cur->docs[cur->pos]->len;
+    bson_uint32_to_string(i, &key, buf, sizeof(buf));
+    bson_append_document(&batch, key, -1, cur->docs[cur->pos]);
+  }
+  bson_append_array_end(&cursor, &batch);
+
+  if (single || cur->pos == cur->ndocs) {
+    /* unregister and free */
+    for (cp = &cursors; *cp != NULL; cp = &(*cp)->next)
+      if (*cp == cur) {
+        *cp = cur->next;
+        break;
+      }
+    id = 0;
+  } else {
+    if (cur->id == 0) {
+      cur->id = ++lastcursor;
+      cur->next = cursors;
+      cursors = cur;
+    }
+    id = cur->id;
+  }
+
+  BSON_APPEND_INT64(&cursor, "id", id);
+  BSON_APPEND_UTF8(&cursor, "ns", cur->ns);
+  bson_append_document_end(reply, &cursor);
+  cmd_ok(reply);
+
+  if (id == 0)
+    cursor_free(cur);
+}